@@ -0,0 +1,25 @@
+#ifndef ALLOCATOR_H
+#define ALLOCATOR_H
+#include <stddef.h>
+#include <stdlib.h>
+
+/*
+ * Where vec.h and hash.h get memory from at runtime, so a whole compile's worth of vecs and tables can live in an arena
+ * and go away with it. NULL wherever one is taken means the usual malloc and free.
+ *
+ * `resize` works like realloc, getting NULL for a new block and a size of 0 to free one. `old` is how big the block was,
+ * for allocators that don't keep track themselves. Freeing can do nothing, if everything goes at once anyway.
+ */
+struct allocator {
+	void* (*resize)(struct allocator* a, void* ptr, size_t old, size_t size);
+};
+
+static inline void* aresize(struct allocator* a, void* ptr, size_t old, size_t size) {
+	if(a) return a->resize(a, ptr, old, size);
+	if(!ptr) return malloc(size);
+	if(size) return realloc(ptr, size);
+	free(ptr);
+	return NULL;
+}
+
+#endif
@@ -1,136 +1,133 @@
 #ifndef HASH_H
 #define HASH_H
 #include <stdbool.h>
+#include <stddef.h>
+#include "allocator.h"
 
 
 #pragma GCC diagnostic ignored "-Wunused-value"
 
-// Generic structs for sizing
-struct GENERIC_ITEM_ { void* k; void* v; struct GENERIC_ITEM_* next; };
-#define TABLEFIELDS unsigned int n; unsigned int size; unsigned int filledbuckets; unsigned int ksize;
+/*
+ * Open addressing, laid out like a Swiss table. Every slot has a control byte: HT_EMPTY, or the top 7 bits of the hash
+ * of the key in it. Slots come in groups of 16, and a lookup compares all 16 control bytes of a group against the key's
+ * 7 bits in one go (SSE2 where there is, a plain loop otherwise), so keys only get compared when those already match.
+ * The low bits of the hash pick the first group, the next ones are probed triangularly until a group with an empty slot.
+ * Keys and values sit right in `items`, the slot count is a power of two, and the table grows once it's 7/8 full.
+ *
+ * Growing moves every entry at once, unless the table was made with `.incremental = true`. Those keep the old slots
+ * around and move a group over on every insert that adds a key, with lookups checking both until it's done,
+ * so no one insert pays for the whole table. hfor and hreserve finish any moving first.
+ *
+ * Tables made with `.concurrent = true` can be shared between threads. hget/hgets and hput/hputs never lock, inserts
+ * take turns, and growing fills the new slots before swapping them in. The slots a table grew out of stay allocated
+ * until hfree, in case a reader is still probing them. hset on one is only safe while nobody reads, because its value
+ * gets assigned after the key is visible. Everything else needs the table to itself.
+ *
+ * `.alloc` picks where a table's slots and string keys come from, see allocator.h.
+ *
+ * Pointers hget and hset return point into the table, so they're only good until the next hset that adds a key.
+ * Tables with `char*` keys own a copy of each string, and only go through hgets/hsets.
+ * A zeroed table is an empty one.
+ *
+ * How keys get hashed is picked from their type at compile time: 4 and 8 byte keys go through one multiply, strings and
+ * everything else through XXH3. Both mix in a seed, hseed sets one so hostile input can't pile keys into one group.
+ */
+#define TABLEFIELDS unsigned int n; unsigned int cap; unsigned int growth; /* Entries, slots, entries left before growing */\
+	unsigned int oldcap; unsigned int moved; /* Slots being moved out of, how many of those are done */\
+	bool incremental; bool concurrent; bool writing; struct allocator* alloc;
 struct GENERIC_TABLE_ {
 	TABLEFIELDS
 
-	void*** keys; // An ARRAY containing pointers to key POINTERS stored in the item, so requires 3 ptr things lol
-	struct GENERIC_ITEM_* items;
+	unsigned char* ctrl;    // One per slot, the entries are allocated right after them
+	void* items;            // Entries of the table's own type, one per slot
+	unsigned char* oldctrl; // The slots being moved out of, while growing incrementally
 };
 
-#define HASH_STRIFY2_(x) #x
-#define HASH_STRIFY_(x) HASH_STRIFY2_(x)
-
-// #define HASH_CONCAT_RAW_(x, y, z) x##y##z
-// #define HASH_CONCAT_(x, y, z) HASH_CONCAT_RAW_(x, y, z)
-
-// Defines an item for the hashtable. Types for `k` get messed up when you pass in `char*` but we ignore it bc it barely matters.
-// #define ITEMNAMEMANGLER HASH
-// #define item(key, val) struct HASH_CONCAT(itemht_, __LINE__, ITEMNAMEMANGLER) { key* k; val* v; struct HASH_CONCAT(itemht_, __LINE__, ITEMNAMEMANGLER)* next; }
-#define HASH_ITEM(key, val) struct { key* k; val* v; void* next; }
+#define HT_GROUP 16
+#define HT_EMPTY 0x80
 
 // Defines a hashtable type.
 #define ht(key, val) struct { TABLEFIELDS\
-	key** keys; HASH_ITEM(key, val)* items; }
+	unsigned char* ctrl; struct { key k; val v; }* items; unsigned char* oldctrl; }
 
 // macros for easy hashtable method calling, main api:
-#define hkeyt(htb) typeof(**(htb).keys)
-#define hvalt(htb) typeof(*(htb).items->v)
-
-// Resize if there are too many conflicts (n - filledbuckets). Aim for 3/4 filled buckets.
-// What the current algorithm does, is when the number of filled buckets is less than 3/4s of the total items (conflicts exceeds 1/4), it resizes the table.
-#define shouldresize(htb) ((htb).n >= (htb).filledbuckets * 4 / 3)
-#define mayberesize(htb) shouldresize(htb) && _Generic(**(htb).keys,\
-	char*: htsresize((struct GENERIC_TABLE_*) &(htb), (htb).size * 3 / 2 + 10),\
-	default: htresize((struct GENERIC_TABLE_*) &(htb), (htb).size * 3 / 2 + 10, sizeof(**(htb).keys)))
-
-#define hget(htb, ...)   (hvalt(htb)*) htget((struct GENERIC_TABLE_*) &(htb), (hkeyt(htb)*) &__VA_ARGS__, sizeof(**(htb).keys), false)
-#define hgetst(htb, ...) (hvalt(htb)*) htget((struct GENERIC_TABLE_*) &(htb), &(hkeyt(htb)) __VA_ARGS__, sizeof(**(htb).keys), false)
-#define hgets(htb, key)  (hvalt(htb)*) htget((struct GENERIC_TABLE_*) &(htb), key, strlen(key) + 1, true)
+#define hkeyt(htb) typeof((htb).items->k)
+#define hvalt(htb) typeof((htb).items->v)
+
+enum { HT_KEY_BYTES, HT_KEY_4, HT_KEY_8, HT_KEY_STR };
+
+// What the untyped functions need to know about a table's entries
+struct GENERIC_LAYOUT_ {
+	unsigned int ksize;
+	unsigned int esize;
+	unsigned int voff; // Where the value starts in an entry
+	unsigned int kind; // HT_KEY_*, HT_KEY_STR has the entry point to a copy of the string
+	unsigned int vsize;
+};
+#define HKIND_(htb) _Generic((htb).items->k, char*: HT_KEY_STR,\
+	default: sizeof(hkeyt(htb)) == 4 ? HT_KEY_4 : sizeof(hkeyt(htb)) == 8 ? HT_KEY_8 : HT_KEY_BYTES)
+#define HLAYOUT_(htb) ((struct GENERIC_LAYOUT_) { sizeof(hkeyt(htb)), sizeof(*(htb).items),\
+	offsetof(typeof(*(htb).items), v), HKIND_(htb), sizeof(hvalt(htb)) })
 
+#define hget(htb, ...)   (hvalt(htb)*) htget((struct GENERIC_TABLE_*) &(htb), (hkeyt(htb)*) &__VA_ARGS__, sizeof(hkeyt(htb)), HLAYOUT_(htb))
+#define hgetst(htb, ...) (hvalt(htb)*) htget((struct GENERIC_TABLE_*) &(htb), &(hkeyt(htb)) __VA_ARGS__, sizeof(hkeyt(htb)), HLAYOUT_(htb))
+#define hgets(htb, key)  (hvalt(htb)*) htget((struct GENERIC_TABLE_*) &(htb), key, strlen(key) + 1, HLAYOUT_(htb))
 
-#define hset(htb, ...) mayberesize(htb), *(hvalt(htb)*) htset((struct GENERIC_TABLE_*) &(htb), (hkeyt(htb)*) &__VA_ARGS__, sizeof(**(htb).keys), sizeof(*(htb).items->v), false)
-#define hsetst(htb, ...) mayberesize(htb), *(hvalt(htb)*) htset((struct GENERIC_TABLE_*) &(htb), &(hkeyt(htb)) __VA_ARGS__, sizeof(**(htb).keys), sizeof(*(htb).items->v), false)
-#define hsets(htb, key) mayberesize(htb), *(hvalt(htb)*) htset((struct GENERIC_TABLE_*) &(htb), key, strlen(key) + 1, sizeof(*(htb).items->v), true)
+// New keys get a value that's uninitialized, so these are meant to be assigned to: `hset(table, key) = value;`
+#define hset(htb, ...)   *(hvalt(htb)*) htset((struct GENERIC_TABLE_*) &(htb), (hkeyt(htb)*) &__VA_ARGS__, sizeof(hkeyt(htb)), HLAYOUT_(htb))
+#define hsetst(htb, ...) *(hvalt(htb)*) htset((struct GENERIC_TABLE_*) &(htb), &(hkeyt(htb)) __VA_ARGS__, sizeof(hkeyt(htb)), HLAYOUT_(htb))
+#define hsets(htb, key)  *(hvalt(htb)*) htset((struct GENERIC_TABLE_*) &(htb), key, strlen(key) + 1, HLAYOUT_(htb))
 
-#define hset_strcpy(str, htb, ...) mayberesize(htb), strcpy((char*) htset((struct GENERIC_TABLE_*) &(htb), (hkeyt(htb)*) &__VA_ARGS__, sizeof(**(htb).keys), strlen(str), false), str)
-#define hsetst_strcpy(str, htb, ...) mayberesize(htb), strcpy((char*) htset((struct GENERIC_TABLE_*) &(htb), &(hkeyt(htb)) __VA_ARGS__, sizeof(**(htb).keys), strlen(str), false), str)
-#define hsets_strcpy(str, htb, key) mayberesize(htb), strcpy((char*) htset((struct GENERIC_TABLE_*) &(htb), key, strlen(key) + 1, strlen(str) + 1, true), str)
+// Adds the key with the value unless it's there already, either way giving back the value the key has in the table.
+// Keys with commas in them need parentheses around them.
+#define hput(htb, key, ...)  (hvalt(htb)*) htput((struct GENERIC_TABLE_*) &(htb), (hkeyt(htb)[1]) { key }, sizeof(hkeyt(htb)),\
+	(hvalt(htb)[1]) { __VA_ARGS__ }, HLAYOUT_(htb))
+#define hputs(htb, key, ...) (hvalt(htb)*) htput((struct GENERIC_TABLE_*) &(htb), key, strlen(key) + 1,\
+	(hvalt(htb)[1]) { __VA_ARGS__ }, HLAYOUT_(htb))
 
-#define hfree(htb) htfree((struct GENERIC_TABLE_*) &(htb))
-#define hreset(htb) htreset((struct GENERIC_TABLE_*) &(htb))
+#define hreserve(htb, size) htreserve((struct GENERIC_TABLE_*) &(htb), size, HLAYOUT_(htb))
+#define hfree(htb) htfree((struct GENERIC_TABLE_*) &(htb), HLAYOUT_(htb))
+#define hreset(htb) htreset((struct GENERIC_TABLE_*) &(htb), HLAYOUT_(htb))
+#define hsettle(htb) htsettle((struct GENERIC_TABLE_*) &(htb), HLAYOUT_(htb))
 
-#define hlastv(htb) (((typeof((htb).items)) ((htb).keys[(htb).n - 1]))->v)
-#define hgetn(htb, idx) (((typeof((htb).items)) ((htb).keys[idx]))->v)
-#define hfirst(htb) ((typeof((htb).items)) ((htb).keys[0]))
+// Goes through every entry in slot order, `e->k` and `e->v`
+#define hfor(htb, e) for(typeof((htb).items) e = (hsettle(htb), (htb).items), _end = e + (htb).cap; e < _end; e ++)\
+	if((htb).ctrl[e - (htb).items] != HT_EMPTY)
 
 
 #define hentry(htb) struct { hkeyt(htb) key; hvalt(htb) item; }
 #define HTINITIALIZER_(htb) hentry(htb) htinitarr[]
 
-// In a perfect world where _Generic was actually good. :(
-/*
-#define haddentries(htb, ...) do { HTINITIALIZER_(htb) = __VA_ARGS__;\
-  htinit((struct GENERIC_TABLE_*) &(htb), sizeof(htinitarr));\
-  for(unsigned int i = 0; i < sizeof(htinitarr) / htinitarr[0]; i++)\
-    _Generic(**(htb).keys,\
-      char*: _Generic(*(htb).items->v,\
-        char*: (hsets_strcpy(htinitarr[i].item, htb, htinitarr[i].key)),\
-        default: (hsets(htb, htinitarr[i].key) = htinitarr[i].item)\
-      ),\
-      default: Generic(*(htb).items->v,\
-        char*: (hset_strcpy(htinitarr[i].item, htb, htinitarr[i].key)),\
-        default: (hset(htb, htinitarr[i].key) = htinitarr[i].item)\
-      )\
-    );\
-} while(0)
-*/
-
 #define hadd_entries(htb, ...) do { HTINITIALIZER_(htb) = __VA_ARGS__;\
-  htinit((struct GENERIC_TABLE_*) &(htb), sizeof(htinitarr));\
-  for(unsigned int i = 0; i < sizeof(htinitarr) / sizeof(htinitarr[0]); i++)\
-    _Generic(**(htb).keys,\
-      char*: (hsets(htb, htinitarr[i].key) = htinitarr[i].item),\
-      default: (hset(htb, htinitarr[i].key) = htinitarr[i].item)\
-    );\
-} while(0)
-
-#define hadd_entries_strcpy(htb, ...) do { HTINITIALIZER_(htb) = __VA_ARGS__;\
-	htinit((struct GENERIC_TABLE_*) &(htb), sizeof(htinitarr));\
+	hreserve(htb, sizeof(htinitarr) / sizeof(htinitarr[0]));\
 	for(unsigned int i = 0; i < sizeof(htinitarr) / sizeof(htinitarr[0]); i++)\
-		_Generic(**(htb).keys,\
-			char*: (hsets_strcpy(htinitarr[i].item, htb, htinitarr[i].key)),\
-			default: (hset_strcpy(htinitarr[i].item, htb, htinitarr[i].key))\
+		_Generic((htb).items->k,\
+			char*: (hsets(htb, htinitarr[i].key) = htinitarr[i].item),\
+			default: (hset(htb, htinitarr[i].key) = htinitarr[i].item)\
 		);\
 } while(0)
 
 #define hmerge_entries(htb, entries) do {\
-	htinit((struct GENERIC_TABLE_*) &(htb), sizeof(entries));\
+	hreserve(htb, sizeof(entries) / sizeof(entries[0]));\
 	for(unsigned int i = 0; i < sizeof(entries) / sizeof(entries[0]); i++)\
-		_Generic(**(htb).keys,\
+		_Generic((htb).items->k,\
 			char*: (hsets(htb, entries[i].key) = entries[i].item),\
 			default: (hset(htb, entries[i].key) = entries[i].item)\
 		);\
 } while(0)
 
-#define hmerge_entries_strcpy(htb, entries) do {\
-	htinit((struct GENERIC_TABLE_*) &(htb), sizeof(entries));\
-	for(unsigned int i = 0; i < sizeof(entries) / sizeof(entries[0]); i++)\
-		_Generic(**(htb).keys,\
-			char*: (hsets_strcpy(entries[i].item, htb, entries[i].key)),\
-			default: (hset_strcpy(entries[i].item, htb, entries[i].key))\
-		);\
-} while(0)
-
-// Raw Hashtable methods
-void  htinit(struct GENERIC_TABLE_* t, unsigned int size);
+// Raw Hashtable methods. `klen` is how many bytes of `k` to hash, the string's length + 1 for string keys.
+void  hseed(unsigned long long seed); // Only while every table is empty, the ones with keys would lose them
+void  htreserve(struct GENERIC_TABLE_* t, unsigned int size, struct GENERIC_LAYOUT_ l);
+void  htsettle(struct GENERIC_TABLE_* t, struct GENERIC_LAYOUT_ l); // Finishes growing, everything ends up in `items`
 
-bool  htresize(struct GENERIC_TABLE_* t, unsigned int size, unsigned int ksize);
-bool  htsresize(struct GENERIC_TABLE_* t, unsigned int size);
+void  htfree(struct GENERIC_TABLE_* t, struct GENERIC_LAYOUT_ l);
+void  htreset(struct GENERIC_TABLE_* t, struct GENERIC_LAYOUT_ l);
 
-void  htfree(struct GENERIC_TABLE_* t);
-void  htreset(struct GENERIC_TABLE_* t);
+void* htget(struct GENERIC_TABLE_* t, const void* k, unsigned int klen, struct GENERIC_LAYOUT_ l);
 
-void* htget(struct GENERIC_TABLE_* t, void* k, unsigned int ksize, bool str);
-
-void* htset(struct GENERIC_TABLE_* t, void* k, unsigned int ksize, unsigned int vsize, bool str);
+void* htset(struct GENERIC_TABLE_* t, const void* k, unsigned int klen, struct GENERIC_LAYOUT_ l);
+void* htput(struct GENERIC_TABLE_* t, const void* k, unsigned int klen, const void* v, struct GENERIC_LAYOUT_ l);
 
 
 /*
@@ -158,247 +155,344 @@ int main() {
 
 #ifdef HASH_H_IMPLEMENTATION
 
-/*
- * IDEAS:
-	* I really hate that we have to store pointers to linked lists in every item, even when we require that 3/4s of the actual buffer be non-conflicts. It is wasting wasting 1/3rd of the memory for 3/4ts of the items, coming up to more than 1/4th of the whole hashtable being completely useless.
-		What if we just remove the pointer to the next item(basically take out the linked list) and just put the item in conflict in the next row? We can still count conflicts, and although they would be more prevalent(since one conflict can now become another conflict), it would be much better for cache locality and memory usage.
-	 * This idea deviates from the idea of a hashtable completely, and I realize it's more like just using a hash function to kind of tell where something is lol. Also, it could be worse for perf but who knows, string comp is pretty fast and cache locality is important.
-	 [ ] Take off the `next` pointer
-	 [ ] Implement putting items beside the original bucket if there is a conflict
-	 [ ] Get items through checking every string key in conflict.
-	 [ ] Manage resizing if the item does not fit.
-	 [ ] Find a way to not loop till the end of the array and checking every key till then.
- * TODO:
-	[-] Properly add:
-	 [x] `keys`
-	 [x] `filledbuckets`
-		[x] In Resize
-	[ ] Clearing
-	[x] Resizing
-	 [x] Don't rehash + traverse for keys in the array, just use ptr
-	[x] Freeing
-*/
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <threads.h>
+#define XXH_INLINE_ALL
+#include <xxhash.h>
 
+typedef unsigned int uint; // bc why
 
-// Defined this file for a clear interface for the main hash function used in the project
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64)
+#include <emmintrin.h>
+typedef __m128i ht_bytes; // The control bytes of a group
 
-// http://www.azillionmonkeys.com/qed/hash.html
-#include "stdint.h" /* Replace with <stdint.h> if appropriate */
-uint32_t hash(const char * data, uint32_t len);
+static inline ht_bytes ht_load(const unsigned char* group) {
+	return _mm_loadu_si128((const __m128i*) group);
+}
+// Shared tables get control bytes written under their readers, so those load them atomically, 8 at a time. Acquiring
+// pairs with ht_publish.
+static inline ht_bytes ht_load_shared(const unsigned char* group) {
+	uint64_t lo = atomic_load_explicit((_Atomic uint64_t*) group, memory_order_acquire);
+	uint64_t hi = atomic_load_explicit((_Atomic uint64_t*) (group + 8), memory_order_acquire);
+	return _mm_set_epi64x((long long) hi, (long long) lo);
+}
+// Bit i is set if control byte i of the group is `byte`
+static inline uint ht_match(ht_bytes group, unsigned char byte) {
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char) byte)));
+}
+// Only HT_EMPTY has the top bit set
+static inline uint ht_empties(ht_bytes group) {
+	return _mm_movemask_epi8(group);
+}
+#else
+typedef struct { unsigned char b[HT_GROUP]; } ht_bytes;
 
+static inline ht_bytes ht_load(const unsigned char* group) {
+	ht_bytes g;
+	memcpy(g.b, group, HT_GROUP);
+	return g;
+}
+static inline ht_bytes ht_load_shared(const unsigned char* group) {
+	ht_bytes g;
+	uint64_t lo = atomic_load_explicit((_Atomic uint64_t*) group, memory_order_acquire);
+	uint64_t hi = atomic_load_explicit((_Atomic uint64_t*) (group + 8), memory_order_acquire);
+	memcpy(g.b, &lo, 8), memcpy(g.b + 8, &hi, 8);
+	return g;
+}
+static inline uint ht_match(ht_bytes group, unsigned char byte) {
+	uint mask = 0;
+	for(uint i = 0; i < HT_GROUP; i ++) mask |= (uint) (group.b[i] == byte) << i;
+	return mask;
+}
+static inline uint ht_empties(ht_bytes group) {
+	return ht_match(group, HT_EMPTY);
+}
+#endif
 
-#include <string.h>
-#include <stdlib.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+static inline uint ht_ctz(uint x) { unsigned long i; _BitScanForward(&i, x); return i; }
+#else
+static inline uint ht_ctz(uint x) { return __builtin_ctz(x); }
+#endif
 
-// #include <stdio.h>
+static uint64_t ht_seed;
 
-typedef unsigned int uint; // bc why
+void hseed(unsigned long long seed) {
+	ht_seed = seed;
+}
+
+// Multiplies out to 128 bits and folds the halves, so every bit of the key reaches both the low and the top bits
+static inline uint64_t ht_mix(uint64_t k) {
+	k ^= ht_seed;
+#if defined(__SIZEOF_INT128__)
+	__uint128_t m = (__uint128_t) k * 0x9E3779B97F4A7C15ull;
+	return (uint64_t) m ^ (uint64_t) (m >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+	uint64_t hi, lo = _umul128(k, 0x9E3779B97F4A7C15ull, &hi);
+	return lo ^ hi;
+#else
+	k *= 0x9E3779B97F4A7C15ull;
+	return k ^ (k >> 32);
+#endif
+}
 
-// Aligns to the next multiple of a, where a is a power of 2
-static inline uint align(uint n, uint a) { return (n + a - 1) & ~(a - 1); }
-static inline void pushkey(struct GENERIC_TABLE_* t, void* ptr) {
-	if(!t->keys) {
-		t->keys = malloc(10 * sizeof(void*));
-		t->keys[0] = ptr;
-		t->ksize = 10;
-		t->n = 1;
-		return;
+// The top 7 bits go in the control byte, the low ones pick the group. `kind` is a constant wherever it's known.
+static inline uint64_t ht_hash(const void* k, uint klen, uint kind) {
+	switch(kind) {
+		case HT_KEY_4: { uint32_t v; memcpy(&v, k, 4); return ht_mix(v); }
+		case HT_KEY_8: { uint64_t v; memcpy(&v, k, 8); return ht_mix(v); }
+		case HT_KEY_STR: return XXH3_64bits_withSeed(k, klen - 1, ht_seed);
+		default: return XXH3_64bits_withSeed(k, klen, ht_seed);
+	}
+}
+#define ht_tag(h) ((unsigned char) ((h) >> 57))
+
+static inline bool ht_same(const char* entry, const void* k, uint klen, uint kind) {
+	switch(kind) {
+		case HT_KEY_4: { uint32_t a, b; memcpy(&a, entry, 4), memcpy(&b, k, 4); return a == b; }
+		case HT_KEY_8: { uint64_t a, b; memcpy(&a, entry, 8), memcpy(&b, k, 8); return a == b; }
+		case HT_KEY_STR: return !strcmp(*(char**) entry, k);
+		default: return !memcmp(entry, k, klen);
 	}
-	uint newsize = align(t->n + 1, 8) + 2;
-	if(newsize > t->ksize)
-		t->keys = realloc(t->keys, newsize * sizeof(void*)), t->ksize = newsize;
-	t->keys[t->n] = ptr;
-	t->n ++;
 }
 
+static inline uint64_t ht_entry_hash(const char* entry, struct GENERIC_LAYOUT_ l) {
+	if(l.kind == HT_KEY_STR) return ht_hash(*(char**) entry, strlen(*(char**) entry) + 1, HT_KEY_STR);
+	return ht_hash(entry, l.ksize, l.kind);
+}
+
+// Slots are allocated as one block: this, a control byte per slot, then the entries. Keeps both 16 byte aligned.
+#define HT_HEAD 16
+struct ht_head {
+	uint cap;
+	unsigned char* retired; // The slots a shared table grew out of, freed along with these
+};
 
+static inline struct ht_head* ht_head(const unsigned char* ctrl) {
+	return (struct ht_head*) (ctrl - HT_HEAD);
+}
 
+static inline size_t ht_block(uint cap, struct GENERIC_LAYOUT_ l) {
+	return HT_HEAD + cap + (size_t) cap * l.esize;
+}
 
+static unsigned char* ht_alloc(struct GENERIC_TABLE_* t, uint cap, struct GENERIC_LAYOUT_ l) {
+	unsigned char* ctrl = (unsigned char*) aresize(t->alloc, NULL, 0, ht_block(cap, l)) + HT_HEAD;
+	*ht_head(ctrl) = (struct ht_head) { cap, NULL };
+	memset(ctrl, HT_EMPTY, cap);
+	return ctrl;
+}
 
-// Initializes a hashtable
-void htinit(struct GENERIC_TABLE_* t, uint size) {
-	t->n = 0; t->size = size;
-	t->items = calloc(sizeof(struct GENERIC_ITEM_), size); 
-}
-
-// Resizes a hashtable, rehashing all the keys. Slow right now, will make it faster later™.
-#define RESIZE(...) {\
-	if(!t->size) { htinit(t, size); return true; }\
-	struct GENERIC_ITEM_* new = calloc(sizeof(struct GENERIC_ITEM_), size);\
-	t->filledbuckets = 0;\
-\
-	for(uint i = 0; i < t->n; i++) {\
-		__VA_ARGS__\
-		uint h = hash(*t->keys[i], ksize);\
-		uint newind = h % size;\
-\
-		struct GENERIC_ITEM_* item = (struct GENERIC_ITEM_*)t->keys[i];\
-		struct GENERIC_ITEM_* newitem = new + newind;\
-\
-		/* If it's a top level item, we would have to copy it over or allocate it separately */\
-		if (item >= t->items && item < t->items + t->size) {\
-			if (newitem->k) {\
-				while(newitem->next) newitem = newitem->next;\
-				newitem->next = malloc(sizeof(struct GENERIC_ITEM_));\
-				newitem = newitem->next;\
-			} else t->filledbuckets ++; /* Need to know the new bucket count so we can resize accurately in the future. Biggest risk is causing subsequent resizes, but it would be very rare */\
-			newitem->k = item->k;\
-			newitem->v = item->v;\
-			newitem->next = NULL;\
-			t->keys[i] = &newitem->k;\
-			continue;\
-		}\
-\
-		/* If it's not top level, it's separately allocated, so we need to free it in the instance we're setting to top level, or just set the item -> next to the new item */\
-		if (newitem->k) {\
-			while(newitem->next) newitem = newitem->next;\
-			newitem = (newitem->next = item);\
-			newitem->next = NULL;\
-		}\
-		else {\
-			newitem->k = item->k;\
-			newitem->v = item->v;\
-			/* newitem->next = NULL; // Already NULL*/\
-			t->filledbuckets ++;\
-			free(item);\
-		}\
-		t->keys[i] = &newitem->k;\
-	}\
-\
-	free(t->items);\
-	t->items = new;\
-	t->size = size;\
-	return true;\
-}\
-
-bool htresize(struct GENERIC_TABLE_* t, uint size, uint ksize) RESIZE()
-bool htsresize(struct GENERIC_TABLE_* t, uint size)
-RESIZE(
-	uint ksize = strlen(*t->keys[i]) + 1;
-)
-
-
-
-
-
-// Frees a linked item, an item not in the main array of items.
-static inline void freeitem(struct GENERIC_ITEM_* item) {
-	free(item->k); free(item->v);
-	if(item->next) freeitem(item->next);
-	free(item);
-}
-
-void htfree(struct GENERIC_TABLE_* t) {
-	for(uint i = 0; i < t->n; i ++) {
-		struct GENERIC_ITEM_* k = (struct GENERIC_ITEM_*) t->keys[i];
-		if(k < t->items || k > t->items + t->size) continue; // Only select top level items, items that aren't separately allocated and linked to
-		free(k->k); free(k->v);
-		if(k->next) freeitem(k->next); // Much simpler to do it recursively here.
+static void ht_release(struct GENERIC_TABLE_* t, unsigned char* ctrl, struct GENERIC_LAYOUT_ l) {
+	while(ctrl) {
+		struct ht_head* head = ht_head(ctrl);
+		ctrl = head->retired;
+		aresize(t->alloc, head, ht_block(head->cap, l), 0);
 	}
-	free(t->items);
-	free(t->keys);
 }
 
-void htreset(struct GENERIC_TABLE_* t) {
-	for(uint i = 0; i < t->n; i ++) {
-		struct GENERIC_ITEM_* k = (struct GENERIC_ITEM_*) t->keys[i];
-		if(k < t->items || k > t->items + t->size) continue;
-		free(k->k); free(k->v);
-		if(k->next) freeitem(k->next);
-		memset(k, 0, sizeof(struct GENERIC_ITEM_));
+// First empty slot for hash `h`. The key can't be in the table already.
+static inline uint ht_empty_slot(const unsigned char* ctrl, uint cap, uint64_t h) {
+	uint mask = cap / HT_GROUP - 1, group = h & mask;
+	for(uint step = 1;; group = (group + step ++) & mask) {
+		uint empty = ht_empties(ht_load(ctrl + group * HT_GROUP));
+		if(empty) return group * HT_GROUP + ht_ctz(empty);
 	}
-	memset(t->keys, 0, t->n * sizeof(void*));
+}
+
+// Puts the entries in slots [from, to) of `src` into `dst`. Keys never need comparing, none of them are in `dst` yet.
+static void ht_copy(unsigned char* dst, const unsigned char* src, uint from, uint to, struct GENERIC_LAYOUT_ l) {
+	uint cap = ht_head(dst)->cap;
+	char* items = (char*) dst + cap;
+	const char* srcitems = (const char*) src + ht_head(src)->cap;
+	for(uint i = from; i < to; i ++) {
+		if(src[i] == HT_EMPTY) continue;
+		const char* entry = srcitems + (size_t) i * l.esize;
+		uint64_t h = ht_entry_hash(entry, l);
+		uint slot = ht_empty_slot(dst, cap, h);
+		dst[slot] = ht_tag(h);
+		memcpy(items + (size_t) slot * l.esize, entry, l.esize);
+	}
+}
+
+// Old groups moved over per insert. Plenty, doubling leaves 7/16 of the new slots to fill and the old ones are half.
+#define HT_MOVE_GROUPS 1
+
+// Moves the old slots before `upto` over, and lets go of the old slots once they're all done.
+// Any key in the new slots was looked for in the old ones before it got added, so they never have the same key.
+static void ht_move(struct GENERIC_TABLE_* t, uint upto, struct GENERIC_LAYOUT_ l) {
+	if(!t->oldcap) return;
+	if(upto > t->oldcap) upto = t->oldcap;
+	ht_copy(t->ctrl, t->oldctrl, t->moved, upto, l);
+	t->moved = upto;
+	if(t->moved < t->oldcap) return;
+	ht_release(t, t->oldctrl, l);
+	t->oldctrl = NULL;
+	t->oldcap = t->moved = 0;
+}
+
+// Switches over to `cap` slots, and moves everything into them unless it's done as inserts come.
+// Shared tables always move everything before the new slots get published.
+static void ht_grow(struct GENERIC_TABLE_* t, uint cap, bool now, struct GENERIC_LAYOUT_ l) {
+	ht_move(t, t->oldcap, l);
+	unsigned char* ctrl = ht_alloc(t, cap, l);
+	if(t->concurrent) {
+		if(t->cap) ht_copy(ctrl, t->ctrl, 0, t->cap, l);
+		ht_head(ctrl)->retired = t->ctrl;
+	} else if(now) {
+		if(t->cap) ht_copy(ctrl, t->ctrl, 0, t->cap, l);
+		ht_release(t, t->ctrl, l);
+	} else t->oldctrl = t->ctrl, t->oldcap = t->cap, t->moved = 0;
+	t->cap = cap;
+	t->growth = cap - cap / 8 - t->n;
+	t->items = ctrl + cap;
+	atomic_store_explicit((_Atomic(unsigned char*)*) &t->ctrl, ctrl, memory_order_release);
+}
+
+// Inserts on shared tables take turns
+static inline void ht_lock(struct GENERIC_TABLE_* t) {
+	if(t->concurrent) while(atomic_exchange_explicit((_Atomic bool*) &t->writing, true, memory_order_acquire)) thrd_yield();
+}
+static inline void ht_unlock(struct GENERIC_TABLE_* t) {
+	if(t->concurrent) atomic_store_explicit((_Atomic bool*) &t->writing, false, memory_order_release);
+}
+
+void htsettle(struct GENERIC_TABLE_* t, struct GENERIC_LAYOUT_ l) {
+	ht_move(t, t->oldcap, l);
+}
+
+// Makes room for `size` entries in total, so adding up to that many never moves anything
+void htreserve(struct GENERIC_TABLE_* t, uint size, struct GENERIC_LAYOUT_ l) {
+	uint cap = HT_GROUP;
+	while(cap - cap / 8 < size) cap *= 2;
+	ht_lock(t);
+	if(cap > t->cap) ht_grow(t, cap, true, l);
+	else htsettle(t, l);
+	ht_unlock(t);
+}
+
+static inline void ht_free_key(struct GENERIC_TABLE_* t, char* entry) {
+	char* key = *(char**) entry;
+	aresize(t->alloc, key, strlen(key) + 1, 0);
+}
+
+// String keys are owned by whichever slot has them, old slots only from where moving got to
+static void ht_free_keys(struct GENERIC_TABLE_* t, struct GENERIC_LAYOUT_ l) {
+	if(l.kind != HT_KEY_STR) return;
+	for(uint i = 0; i < t->cap; i ++)
+		if(t->ctrl[i] != HT_EMPTY) ht_free_key(t, (char*) t->items + (size_t) i * l.esize);
+	for(uint i = t->moved; i < t->oldcap; i ++)
+		if(t->oldctrl[i] != HT_EMPTY) ht_free_key(t, (char*) t->oldctrl + t->oldcap + (size_t) i * l.esize);
+}
+
+void htfree(struct GENERIC_TABLE_* t, struct GENERIC_LAYOUT_ l) {
+	ht_free_keys(t, l);
+	ht_release(t, t->ctrl, l);
+	ht_release(t, t->oldctrl, l);
+	*t = (struct GENERIC_TABLE_) { .incremental = t->incremental, .concurrent = t->concurrent, .alloc = t->alloc };
+}
+
+// Empties the table, but keeps its slots around
+void htreset(struct GENERIC_TABLE_* t, struct GENERIC_LAYOUT_ l) {
+	if(!t->cap) return;
+	ht_free_keys(t, l);
+	ht_release(t, t->oldctrl, l);
+	t->oldctrl = NULL;
+	t->oldcap = t->moved = 0;
+	memset(t->ctrl, HT_EMPTY, t->cap);
 	t->n = 0;
-	t->filledbuckets = 0;
-	// t->size = 0;
+	t->growth = t->cap - t->cap / 8;
 }
 
-// Gets an arbitrary type key from hash table
-void* htget(struct GENERIC_TABLE_* t, void* k, uint ksize, bool str) {
-	if(!t->size) return NULL; // If the table is empty, return NULL (no key found)
-	int index = hash(k, ksize) % t->size;
-	struct GENERIC_ITEM_* item = t->items + index;
-	
-	if(item->k != NULL) {
-		switch (ksize) {
-		case 4:
-			do {
-				if (*(uint*) item->k == *(uint*) k)
-					return item->v;
-				else item = item->next;
-			} while (item != NULL);
-			break;
-		case 8:
-			do {
-				if (*(uint64_t*) item->k == *(uint64_t*) k)
-					return item->v;
-				else item = item->next;
-			} while (item != NULL);
-			break;
-		default:
-			if(str) do {
-				if (strcmp(item->k, k) == 0)
-					return item->v;
-				else item = item->next;
-			} while (item != NULL);
-			else do {
-				if (memcmp(item->k, k, ksize) == 0)
-					return item->v;
-				else item = item->next;
-			} while (item != NULL);
+// Probes one set of slots for the key
+static inline char* ht_probe(const unsigned char* ctrls, uint cap, const void* k, uint klen, struct GENERIC_LAYOUT_ l,
+	uint64_t h, bool shared) {
+	unsigned char tag = ht_tag(h);
+	char* items = (char*) ctrls + cap;
+	uint mask = cap / HT_GROUP - 1, group = h & mask;
+	for(uint step = 1;; group = (group + step ++) & mask) {
+		ht_bytes ctrl = shared ? ht_load_shared(ctrls + group * HT_GROUP) : ht_load(ctrls + group * HT_GROUP);
+		for(uint match = ht_match(ctrl, tag); match; match &= match - 1) {
+			char* entry = items + (size_t) (group * HT_GROUP + ht_ctz(match)) * l.esize;
+			if(ht_same(entry, k, klen, l.kind)) return entry;
 		}
+		if(ht_empties(ctrl)) return NULL;
 	}
+}
 
-	return NULL;
+// Where the key's entry is, NULL if it isn't in the table. `*h` gets the key's hash.
+// Old slots that were moved still have their keys, but those are found in the new slots first.
+static inline char* ht_find(struct GENERIC_TABLE_* t, const void* k, uint klen, struct GENERIC_LAYOUT_ l, uint64_t* h) {
+	*h = ht_hash(k, klen, l.kind);
+	if(t->concurrent) {
+		// Whichever slots were published last, with everything that was in them by then
+		const unsigned char* ctrl = atomic_load_explicit((_Atomic(unsigned char*)*) &t->ctrl, memory_order_acquire);
+		return ctrl ? ht_probe(ctrl, ht_head(ctrl)->cap, k, klen, l, *h, true) : NULL;
+	}
+	if(!t->cap) return NULL;
+	char* entry = ht_probe(t->ctrl, t->cap, k, klen, l, *h, false);
+	if(!entry && t->oldcap) entry = ht_probe(t->oldctrl, t->oldcap, k, klen, l, *h, false);
+	return entry;
 }
 
-// Sets/inserts an arbitrary type key in the given hash table
-void* htset(struct GENERIC_TABLE_* t, void* k, uint ksize, uint vsize, bool str) {
-	if(!ksize) return NULL; // There needs to be a key
-	int index = hash(k, ksize) % t->size;
-	struct GENERIC_ITEM_* item = t->items + index;
-	struct GENERIC_ITEM_* last = NULL;
-
-	if(item->k != NULL) {
-		switch (ksize) {
-		case 4:
-			do {
-				if (*(uint*) item->k == *(uint*) k)
-					return item->v = realloc(item->v, vsize);
-				else last = item, item = item->next;
-			} while (item != NULL);
-			break;
-		case 8:
-			do {
-				if (*(uint64_t*) item->k == *(uint64_t*) k)
-					return item->v = realloc(item->v, vsize);
-				else last = item, item = item->next;
-			} while (item != NULL);
-			break;
-		default:
-			if(str) do {
-				if (strcmp(item->k, k) == 0)
-					return item->v = realloc(item->v, vsize);
-				else last = item, item = item->next;
-			} while (item != NULL);
-			else do {
-				if (memcmp(item->k, k, ksize) == 0)
-					return item->v = realloc(item->v, vsize);
-				else last = item, item = item->next;
-			} while (item != NULL);
-		}
-	} else t->filledbuckets ++;
-	if(!item) item = malloc(sizeof(struct GENERIC_ITEM_));
-	if(last) last->next = item;
-	
-	item->v = malloc(vsize);
-	item->k = malloc(ksize);
-	memcpy(item->k, k, ksize);
-	item->next = NULL;
-	pushkey(t, &item->k);
-	return item->v;
+// Stores a control byte of a shared table after the rest of its entry. Readers load whole words, so it goes in as one.
+static inline void ht_publish(unsigned char* ctrl, uint slot, unsigned char tag) {
+	_Atomic uint64_t* word = (_Atomic uint64_t*) (ctrl + slot / 8 * 8);
+	uint64_t w = atomic_load_explicit(word, memory_order_relaxed);
+	memcpy((unsigned char*) &w + slot % 8, &tag, 1);
+	atomic_store_explicit(word, w, memory_order_release);
+}
+
+// Adds a key that isn't in the table yet, with `v` as its value if there is one. The control byte goes in last, so a
+// reader never finds the key before the rest of its entry.
+static char* ht_add(struct GENERIC_TABLE_* t, const void* k, uint klen, const void* v, uint64_t h, struct GENERIC_LAYOUT_ l) {
+	ht_move(t, t->moved + HT_MOVE_GROUPS * HT_GROUP, l);
+	if(!t->growth) ht_grow(t, t->cap ? t->cap * 2 : HT_GROUP, !t->incremental, l);
+	uint slot = ht_empty_slot(t->ctrl, t->cap, h);
+	char* entry = (char*) t->items + (size_t) slot * l.esize;
+	if(l.kind == HT_KEY_STR) *(char**) entry = memcpy(aresize(t->alloc, NULL, 0, klen), k, klen);
+	else memcpy(entry, k, l.ksize);
+	if(v) memcpy(entry + l.voff, v, l.vsize);
+	if(t->concurrent) ht_publish(t->ctrl, slot, ht_tag(h));
+	else t->ctrl[slot] = ht_tag(h);
+	t->growth --;
+	t->n ++;
+	return entry;
+}
+
+// Gets an arbitrary type key from hash table
+void* htget(struct GENERIC_TABLE_* t, const void* k, uint klen, struct GENERIC_LAYOUT_ l) {
+	uint64_t h;
+	char* entry = ht_find(t, k, klen, l, &h);
+	return entry ? entry + l.voff : NULL;
 }
 
+// Sets/inserts an arbitrary type key in the given hash table
+void* htset(struct GENERIC_TABLE_* t, const void* k, uint klen, struct GENERIC_LAYOUT_ l) {
+	if(!klen) return NULL; // There needs to be a key
+	uint64_t h;
+	ht_lock(t);
+	char* entry = ht_find(t, k, klen, l, &h);
+	if(!entry) entry = ht_add(t, k, klen, NULL, h, l);
+	ht_unlock(t);
+	return entry + l.voff;
+}
 
+// Inserts the key with value `v`, unless it's there already. Keys that are there never take the lock.
+void* htput(struct GENERIC_TABLE_* t, const void* k, uint klen, const void* v, struct GENERIC_LAYOUT_ l) {
+	if(!klen) return NULL;
+	uint64_t h;
+	char* entry = ht_find(t, k, klen, l, &h);
+	if(entry) return entry + l.voff;
+	ht_lock(t);
+	if(t->concurrent) entry = ht_find(t, k, klen, l, &h); // Could have been added while waiting
+	if(!entry) entry = ht_add(t, k, klen, v, h, l);
+	ht_unlock(t);
+	return entry + l.voff;
+}
 
 #endif
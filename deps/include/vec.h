@@ -18,10 +18,21 @@
  *     Name for user-provided realloc(void*, size_t) function.
  *   VEC_H_FREE:
  *     Name for user-provided free(void*) function.
+ *   VEC_H_GROW:
+ *     How many bytes a vec that has to grow to fit `n` makes room for, as a macro of n. 1.25n + 16 by default.
+ *   VEC_H_SIZE64:
+ *     Counts sizes in 64 bits instead of 32, for vecs past 4 GiB. The header gets 8 bytes bigger. Has to be the same in
+ *     every file that shares vecs.
  *   VEC_H_OVERLOAD_ALLOCATORS:
- *     Define `void* vnew()` as you see fit, but after initial allocation, cast to struct vecdata_* and add 1 to pointer as done in current implementation.
- *     Define re-allocator function with the function signature: struct vecdata_* name(struct vecdata_* data, uint32_t size);
+ *     Define `void* vnew()` and `void* vnewn(vsize_t n)` as you see fit. After the initial allocation, return
+ *     `vinit(memory, cap)`, which fills in the whole header and gives back the vec. The header includes `alloc`, which
+ *     has to be NULL for vecs from your allocators. If it holds garbage, every later grow goes through a garbage
+ *     allocator.
+ *     Define re-allocator function with the function signature: struct vecdata_* name(struct vecdata_* data, vsize_t size);
  *     Make sure to define VEC_H_REALLOC_FUNC with `name` after redefining.
+ *
+ * Allocators can also be picked at runtime, per vec: one made with `vnewin(allocator)` gets all of its memory from that
+ * allocator (see allocator.h) for as long as it lives, instead of the ones above.
  *     
  * WARNING: CURRENTLY NOT FULLY THREAD SAFE. Use with caution when using in thread safe code!
  */
@@ -41,13 +52,30 @@
 
 #include <stdint.h>
 #include <string.h>
+#include "allocator.h"
+
+#ifdef VEC_H_SIZE64
+	typedef uint64_t vsize_t;
+#else
+	typedef uint32_t vsize_t;
+#endif
+
+#ifndef VEC_H_GROW
+	#define VEC_H_GROW(n) ((n) + ((n) >> 2) + 16)
+#endif
+
+#define VEC_HEADER_ \
+	vsize_t used; \
+	vsize_t cap; \
+	struct allocator* alloc; /* NULL for VEC_H_CALLOC and friends */
 
 struct vecdata_ {
-	uint32_t used;
-	uint32_t cap;
+	VEC_HEADER_
 	uint8_t data[];
 };
 #define _DATA(x) ((struct vecdata_*)(x) - 1)
+// Sets up an empty vec with `n` bytes of room in `mem`, which holds a header and then those bytes. Off the default allocators.
+#define vinit(mem, n) (*(struct vecdata_*) (mem) = (struct vecdata_) { .used = 0, .cap = (n), .alloc = NULL }, (void*) ((struct vecdata_*) (mem) + 1))
 #define vlen(x) (_DATA(x)->used / sizeof(*(x)))
 #define vcap(x) (_DATA(x)->cap / sizeof(*(x)))
 
@@ -83,7 +111,8 @@ struct vecdata_ {
 	#define vpopn(x, n) (_DATA(x)->data + (_DATA(x)->used -= (n) * sizeof(*(x))))
 	#define vpopto(x, idx) (_DATA(x)->data + (_DATA(x)->used = (idx) * sizeof(*(x))))
 	#define vempty(x) (_DATA(x)->data + (_DATA(x)->used = 0))
-	#define vfree(x) VEC_H_FREE(_DATA(x))
+	#define vfree(x) (_DATA(x)->alloc ? (void) aresize(_DATA(x)->alloc, _DATA(x), sizeof(struct vecdata_) + _DATA(x)->cap, 0)\
+		: VEC_H_FREE(_DATA(x)))
 #else
 	#define vpop(x) vpop_((x), sizeof(*(x)))
 	#define vpopn(x, n) vpop_((x), (n) * sizeof(*(x)))
@@ -99,18 +128,41 @@ struct vecdata_ {
 // Prealloc more space before setting elements.
 #define vprealloc(x, n) vpush_((void**)&(x), sizeof(*(x)) * (n))
 
+/*
+ * For filling a vec with lots at once. vreserve makes room for n more elements without changing the length, so pushes
+ * up to there never have to grow it again. vemplace_n adds n elements that are left for the caller to fill in, and
+ * vpush_unsafe pushes without checking for room at all, for after a vreserve that was big enough.
+ */
+#define vreserve(x, n) vreserve_((void**) &(x), sizeof(*(x)) * (n))
+#define vemplace_n(x, n) ((typeof(x)) vpush_((void**) &(x), sizeof(*(x)) * (n)))
+#define vpush_unsafe(x, ...) ((x)[(_DATA(x)->used += sizeof(*(x))) / sizeof(*(x)) - 1] = (typeof(*(x))) __VA_ARGS__)
+
 // New vector initialized with a struct or array
 #define vecify(x) ((typeof(x))vnewn(sizeof(x)) = x)
 
 // For loop that iterates over the vector
 #define vfor(x, y) for(typeof(x) y = x, _end = x + vlen(x); y < _end; y ++)
 
+/*
+ * A vec that starts out in a buffer of its own, wherever that's declared, and only goes to the heap once it outgrows it:
+ *     vsmall(int, 8) buf;
+ *     int* v = vsmallinit(buf);
+ * `v` is a normal vec from then on. vfree it as usual, that does nothing while it still fits in `buf`.
+ */
+#define vsmall(T, n) struct { VEC_HEADER_ T items[n]; }
+#define vsmallinit(s) ((s).used = 0, (s).cap = sizeof((s).items), (s).alloc = vsmall_alloc_(), (s).items)
+
 // V String that has length info and is automatically push-able
 typedef char* vstr;
 
 // All you need to get started with this vector lib!
 VEC_H_EXTERN void* vnew();
-VEC_H_EXTERN void* vnewn(uint32_t n);
+VEC_H_EXTERN void* vnewn(vsize_t n);
+// The same, with memory from `a`
+VEC_H_EXTERN void* vnewin(struct allocator* a);
+VEC_H_EXTERN void* vnewnin(vsize_t n, struct allocator* a);
+// What vecs in a vsmall buffer grow with, it copies them out to VEC_H_REALLOC's memory for good
+VEC_H_EXTERN struct allocator* vsmall_alloc_(void);
 // #define vnew() ((void*) ((struct vecdata_*) calloc(1, sizeof(struct vecdata_)) + 1))
 
 // Returns a *new* concatenated vector, use `pushv` if you don't want a new vec :D
@@ -122,22 +174,24 @@ VEC_H_EXTERN char  vcmp(void* a, void* b);
 // Initialize a vector with a string straight away
 // VEC_H_EXTERN char* strtov(char* s);
 VEC_H_EXTERN char* vtostr(void* v);
-VEC_H_EXTERN void  vremove_(void* v, uint32_t size, uint32_t pos);
-VEC_H_EXTERN void* vpush_(void** v, uint32_t size);
+VEC_H_EXTERN void  vremove_(void* v, vsize_t size, vsize_t pos);
+VEC_H_EXTERN void* vpush_(void** v, vsize_t size);
+VEC_H_EXTERN void  vreserve_(void** v, vsize_t size);
 VEC_H_EXTERN void  vpushsf_(void** v, char* fmt, ...);
-VEC_H_EXTERN void  vpushn_(void** v, uint32_t n, uint32_t size, void* thing);
-// VEC_H_EXTERN void* vunshift_(void** v, uint32_t size);
+VEC_H_EXTERN void  vpushn_(void** v, vsize_t n, vsize_t size, void* thing);
+// VEC_H_EXTERN void* vunshift_(void** v, vsize_t size);
 VEC_H_EXTERN char* vfmt(char* str, ...);
 
 #ifndef VEC_H_MORE_MACROS
-	VEC_H_EXTERN void* vpop_(void* v, uint32_t size);
+	VEC_H_EXTERN void* vpop_(void* v, vsize_t size);
 	VEC_H_EXTERN void* vempty(void* v);
 	VEC_H_EXTERN void  vfree(void* v);
 #endif
 
 #endif
 
-#ifdef VEC_H_IMPLEMENTATION
+#if defined VEC_H_IMPLEMENTATION && !defined VEC_H_IMPLEMENTED_
+#define VEC_H_IMPLEMENTED_ // Headers can include this too, for vsmall
 
 #if !defined VEC_H_FREE || !defined VEC_H_REALLOC || !defined VEC_H_CALLOC
 	#include <stdlib.h>
@@ -161,18 +215,39 @@ VEC_H_EXTERN char* vfmt(char* str, ...);
 #ifndef VEC_H_OVERLOAD_ALLOCATORS
 	// Callocs a vec with a cap of 16 so subsequent pushes don't immediately trigger reallocation.
 	VEC_H_EXTERN void* vnew() {
-		struct vecdata_* v = VEC_H_CALLOC(1, sizeof(struct vecdata_) + 16 * sizeof(char));
-		v->cap = 16;
-		return v + 1;
+		return vinit(VEC_H_CALLOC(1, sizeof(struct vecdata_) + 16 * sizeof(char)), 16);
 	}
 
-	VEC_H_EXTERN void* vnewn(uint32_t n) {
-		struct vecdata_* v = VEC_H_CALLOC(1, sizeof(struct vecdata_) + n * sizeof(char));
-		v->cap = n;
-		return v + 1;
+	VEC_H_EXTERN void* vnewn(vsize_t n) {
+		return vinit(VEC_H_CALLOC(1, sizeof(struct vecdata_) + n * sizeof(char)), n);
 	}
 #endif
 
+VEC_H_EXTERN void* vnewnin(vsize_t n, struct allocator* a) {
+	if(!a) return vnewn(n);
+	struct vecdata_* v = aresize(a, NULL, 0, sizeof(struct vecdata_) + n);
+	*v = (struct vecdata_) { .used = 0, .cap = n, .alloc = a };
+	return v + 1;
+}
+
+VEC_H_EXTERN void* vnewin(struct allocator* a) {
+	return vnewnin(16, a);
+}
+
+static void* vsmall_resize_(struct allocator* a, void* ptr, size_t old, size_t size) {
+	(void) a;
+	if(!size) return NULL; // Still in the buffer, nothing to free
+	struct vecdata_* v = VEC_H_REALLOC(NULL, size);
+	if(ptr) memcpy(v, ptr, old < size ? old : size);
+	v->alloc = NULL;
+	return v;
+}
+
+VEC_H_EXTERN struct allocator* vsmall_alloc_(void) {
+	static struct allocator a = { vsmall_resize_ };
+	return &a;
+}
+
 // Combines two vectors into a new vector
 VEC_H_EXTERN void* vcat(void* a, void* b) {
 	struct vecdata_* v = VEC_H_CALLOC(1, _DATA(b)->used + _DATA(a)->used + sizeof(struct vecdata_));
@@ -184,15 +259,15 @@ VEC_H_EXTERN void* vcat(void* a, void* b) {
 }
 
 VEC_H_EXTERN char vcmp(void* a, void* b) {
-	uint32_t len = _DATA(a)->used;
+	vsize_t len = _DATA(a)->used;
 	if(len != _DATA(b)->used) return 1;
-	for(uint32_t idx = 0; idx < len; idx ++)
+	for(vsize_t idx = 0; idx < len; idx ++)
 		if(((char*)a)[idx] != ((char*)b)[idx]) return 1;
 	return 0;
 }
 
 VEC_H_EXTERN char* strtov(char* s) {
-	uint32_t len = strlen(s);
+	vsize_t len = strlen(s);
 	struct vecdata_* v = VEC_H_CALLOC(1, len + sizeof(struct vecdata_));
 	v->used = v->cap = len;
 	v += 1;
@@ -201,7 +276,7 @@ VEC_H_EXTERN char* strtov(char* s) {
 }
 
 VEC_H_EXTERN char* vtostr(void* v) {
-	uint32_t len = _DATA(v)->used;
+	vsize_t len = _DATA(v)->used;
 	char* str = malloc(len + 1);
 	memcpy(str, v, len);
 	str[len] = 0;
@@ -210,21 +285,29 @@ VEC_H_EXTERN char* vtostr(void* v) {
 
 #ifndef VEC_H_MORE_MACROS
 	VEC_H_EXTERN void* vempty(void* v) { _DATA(v)->used = 0; return v; }
-	VEC_H_EXTERN void* vpop_(void* v, uint32_t size) { _DATA(v)->used -= size; return _DATA(v)->data + _DATA(v)->used; }
-	VEC_H_EXTERN void vfree(void* v) { VEC_H_FREE(_DATA(v)); }
+	VEC_H_EXTERN void* vpop_(void* v, vsize_t size) { _DATA(v)->used -= size; return _DATA(v)->data + _DATA(v)->used; }
+	VEC_H_EXTERN void vfree(void* v) {
+		if(_DATA(v)->alloc) aresize(_DATA(v)->alloc, _DATA(v), sizeof(struct vecdata_) + _DATA(v)->cap, 0);
+		else VEC_H_FREE(_DATA(v));
+	}
 #endif
 
 
 
+// Moves the vec to a block with room for `cap` bytes
+static inline struct vecdata_* vrealloc_(struct vecdata_* data, vsize_t cap) {
+	vsize_t old = data->cap;
+	data->cap = cap;
+	if(data->alloc) return data->alloc->resize(data->alloc, data, sizeof(struct vecdata_) + old, sizeof(struct vecdata_) + cap);
+	return VEC_H_REALLOC(data, sizeof(struct vecdata_) + cap);
+}
+
 // Reallocs more size for the array, hopefully without moves
 #ifndef VEC_H_OVERLOAD_ALLOCATORS
 	#define VEC_H_REALLOC_FUNC alloc_
-	static inline void* alloc_(struct vecdata_* data, uint32_t size) {
+	static inline void* alloc_(struct vecdata_* data, vsize_t size) {
 		data->used += size;
-		if(data->cap < data->used) {
-			data->cap = data->used + (data->used >> 2) + 16;
-			return (struct vecdata_*)VEC_H_REALLOC(data, sizeof(struct vecdata_) + data->cap) + 1;
-		}
+		if(data->cap < data->used) return vrealloc_(data, VEC_H_GROW(data->used)) + 1;
 		return data + 1;
 	}
 #elif !defined VEC_H_REALLOC_FUNC
@@ -239,41 +322,47 @@ VEC_H_EXTERN char* vtostr(void* v) {
 	#define VEC_INTERNAL_PUSH_NAME vpush__
 #endif
 
-static inline void* VEC_INTERNAL_PUSH_NAME(void** v, uint32_t size) {
+static inline void* VEC_INTERNAL_PUSH_NAME(void** v, vsize_t size) {
 	struct vecdata_* data = _DATA(*v = VEC_H_REALLOC_FUNC(_DATA(*v), size));
 	return data->data + data->used - size;
 }
 
 #ifndef VEC_H_STATIC_INLINE
-	VEC_H_EXTERN void* vpush_(void** v, uint32_t size) { return VEC_INTERNAL_PUSH_NAME(v, size); }
+	VEC_H_EXTERN void* vpush_(void** v, vsize_t size) { return VEC_INTERNAL_PUSH_NAME(v, size); }
 #endif
 
+// Grows the same way pushing does, so reserving a little at a time in a loop is still amortized linear
+VEC_H_EXTERN void vreserve_(void** v, vsize_t size) {
+	struct vecdata_* data = _DATA(*v);
+	if(data->cap - data->used < size) *v = vrealloc_(data, VEC_H_GROW(data->used + size)) + 1;
+}
+
 // Gets length of formatted string to allocate from vector first, and then basically writes to the ptr returned by push
 VEC_H_EXTERN void vpushsf_(void** v, char* fmt, ...) {
 	va_list args;
 	va_start(args, fmt);
 	va_list args2;
 	va_start(args2, fmt);
-	uint32_t len = vsnprintf(NULL, 0, fmt, args);
+	vsize_t len = vsnprintf(NULL, 0, fmt, args);
 	vsnprintf(VEC_INTERNAL_PUSH_NAME(v, len), len, fmt, args2);
 	va_end(args);
 	va_end(args2);
 }
 
-VEC_H_EXTERN void vpushn_(void** v, uint32_t n, uint32_t size, void* thing) {
+VEC_H_EXTERN void vpushn_(void** v, vsize_t n, vsize_t size, void* thing) {
 	char* place = VEC_INTERNAL_PUSH_NAME(v, n * size);
 	if(size == 1) memset(place, *((char*) thing), size);
-	else for(uint32_t i = 0; i < n; i ++) memcpy(place + size * i, thing, size);
+	else for(vsize_t i = 0; i < n; i ++) memcpy(place + size * i, thing, size);
 }
 
 // Adds an element at the start of the vector, ALSO CHANGES PTR
-VEC_H_EXTERN void* vunshift_(void** v, uint32_t size) {
+VEC_H_EXTERN void* vunshift_(void** v, vsize_t size) {
 	memmove((char*) (*v = alloc_(_DATA(*v), size)) + size, *v, _DATA(*v)->used);
 	return *v;
 }
 
 // Deletes data from the middle of the array
-VEC_H_EXTERN void vremove_(void* v, uint32_t size, uint32_t pos) {
+VEC_H_EXTERN void vremove_(void* v, vsize_t size, vsize_t pos) {
 	memmove(_DATA(v) + pos, _DATA(v) + pos + size, _DATA(v)->used - pos - size);
 	_DATA(v)->used -= size;
 }
@@ -285,7 +374,7 @@ VEC_H_EXTERN char* vfmt(char* str, ...) {
 	va_list args, args2;
 	va_start(args, str);
 	va_copy(args2, args);
-	uint32_t len = vsnprintf(NULL, 0, str, args) + 1;
+	vsize_t len = vsnprintf(NULL, 0, str, args) + 1;
 	if(len - _DATA(fmtstr)->used > 0)
 		VEC_INTERNAL_PUSH_NAME((void**) &fmtstr, len - _DATA(fmtstr)->used);
 	vsnprintf(fmtstr, len, str, args2);
@@ -0,0 +1,71 @@
+#pragma once
+#include <stdlib.h>
+#include <string.h>
+#include <allocator.h>
+#include "util.h"
+
+/*
+ * Bump allocator for things that all die at the same time, like everything hanging off of one parse. Blocks are chained
+ * instead of reallocated so pointers into the arena stay valid, and freeing is one walk down the chain.
+ * `alloc` hands the arena to vecs and tables, which then need no freeing of their own.
+ */
+#define ARENA_BLOCK 65536
+
+struct RS_ArenaBlock {
+	struct RS_ArenaBlock* prev;
+	size_t used;
+	size_t cap;
+	char data[]; // Pointer aligned, like everything that goes in here
+};
+
+struct RS_Arena {
+	struct allocator alloc; // ARENA_INIT sets it up
+	struct RS_ArenaBlock* cur;
+};
+typedef struct RS_Arena RS_Arena;
+
+static inline void* arena_resize(struct allocator* al, void* ptr, size_t old, size_t size);
+#define ARENA_INIT { .alloc = { arena_resize } }
+
+// NULL when the size can't be had, vecs grown past 4 GiB go through here too
+static inline void* arena_alloc(RS_Arena* a, size_t size) {
+	size_t align = sizeof(void*) - 1;
+	if(size > SIZE_MAX - sizeof(struct RS_ArenaBlock) - align) return NULL;
+	size = (size + align) & ~align;
+	struct RS_ArenaBlock* b = a->cur;
+	if(!b || b->cap - b->used < size) {
+		size_t cap = size > ARENA_BLOCK ? size : ARENA_BLOCK;
+		b = malloc(sizeof(struct RS_ArenaBlock) + cap);
+		if(!b) return NULL;
+		*b = (struct RS_ArenaBlock) { .prev = a->cur, .used = 0, .cap = cap };
+		a->cur = b;
+	}
+	void* ptr = b->data + b->used;
+	b->used += size;
+	return ptr;
+}
+
+static inline void arena_free(RS_Arena* a) {
+	for(struct RS_ArenaBlock* b = a->cur, * prev; b; b = prev) {
+		prev = b->prev;
+		free(b);
+	}
+	a->cur = NULL;
+}
+
+// Growing whatever was allocated last happens in place, anything else gets copied. Freeing is left to arena_free.
+static inline void* arena_resize(struct allocator* al, void* ptr, size_t old, size_t size) {
+	RS_Arena* a = (RS_Arena*) al;
+	if(!size) return NULL;
+	struct RS_ArenaBlock* b = a->cur;
+	size_t align = sizeof(void*) - 1;
+	// Blocks and what's in them are pointer aligned, so `size` fitting in what's left means its rounded size does too
+	char* end = (char*) ptr + ((old + align) & ~align);
+	if(ptr && end == b->data + b->used && size <= b->cap - ((char*) ptr - b->data)) {
+		b->used = (char*) ptr - b->data + ((size + align) & ~align);
+		return ptr;
+	}
+	void* fresh = arena_alloc(a, size);
+	if(fresh && ptr) memcpy(fresh, ptr, old < size ? old : size);
+	return fresh;
+}
@@ -2,40 +2,72 @@
 #include <vec.h>
 #include <hash.h>
 #include "../parse.h"
-#include "../asm/asm_x86.h"
+#include "../cache.h"
+#include "../asm/asm_x64.h"
 #include "x86.h"
 
+// Code only needs a flat tree and what its tokens are, which either a parse or its cache has
 struct x86State {
 	u32 ind;
-	struct RS_ParserState* st;
+	u32 node; // Next node of the flat tree to generate code for
+	RS_FlatAST ast;
+	RS_TokList* toks;     // From a parse
+	RS_CacheTok* cached;  // Or from the cache, when `toks` is NULL
 	x64Ins* code;
 };
 
-static void parse_expr(struct x86State* st, RS_Expr* node);
+static void parse_expr(struct x86State* st, u32 root);
 static void parse_stmt(struct x86State* st);
 
-RS_MachineResult x86_machine(struct RS_ParserState* st) {
-	struct x86State state = { .st = st, .ind = 0, .code = vnew() };
+static inline RS_TokenType toktype(struct x86State* st, u32 tok) {
+	return st->toks ? st->toks->tt[tok] : st->cached[tok].type;
+}
+
+static inline u64 tokint(struct x86State* st, u32 tok) {
+	return st->toks ? toks_val(st->toks, tok).intv : st->cached[tok].intv;
+}
 
-	while(st->ast[state.ind].type != ST_EOF) parse_stmt(&state);
+static RS_MachineResult machine(struct x86State* state) {
+	vsmall(x64Ins, 32) code; // Enough for small functions to never touch the heap
+	state->code = vsmallinit(code);
+	while(state->ast.stmts[state->ind].type != ST_EOF) parse_stmt(state);
 
 	u32 len;
-	return (RS_MachineResult) { x64as(state.code, &len), len };
+	char* out = (char*) x64as(state->code, vlen(state->code), &len);
+	vfree(state->code);
+	return (RS_MachineResult) { out, len };
+}
+
+RS_MachineResult x86_machine(struct RS_ParserState* st) {
+	struct x86State state = { .ast = flatten(st), .toks = &st->toks };
+	RS_MachineResult res = machine(&state);
+	free_flat(&state.ast);
+	return res;
+}
+
+// Straight from the mapped file, nothing gets parsed or flattened
+RS_MachineResult x86_machine_cached(RS_ASTCache* cache) {
+	struct x86State state = { .ast = cache->ast, .cached = cache->toks };
+	return machine(&state);
 }
 
 char* x86_asm(struct RS_ParserState* st) {
-	struct x86State state = { .st = st, .code = vnew() };
-	return x64stringify(state.code);
+	vsmall(x64Ins, 32) code;
+	struct x86State state = { .toks = &st->toks, .code = vsmallinit(code) };
+	char* out = x64stringify(state.code, vlen(state.code));
+	vfree(state.code);
+	return out;
 }
 
 static void parse_stmt(struct x86State* st) {
-	switch(st->st->ast[st->ind++].type) {
+	RS_FlatStmt* stmt = st->ast.stmts + st->ind++;
+	switch(stmt->type) {
 		case ST_RETURN:
-			parse_expr(st, st->st->ast[st->ind - 1].ret);
+			parse_expr(st, stmt->expr);
 			vpush(st->code, (x64Ins) {RET});
 			return;
 		case ST_EXPR:
-			parse_expr(st, st->st->ast[st->ind - 1].expr);
+			parse_expr(st, stmt->expr);
 			return;
 		case ST_EOF:
 			vpush(st->code, (x64Ins) {RET});
@@ -44,18 +76,55 @@ static void parse_stmt(struct x86State* st) {
 	}
 }
 
-static void parse_expr(struct x86State* st, RS_Expr* node) {
-	switch(node->type) {
-		case EX_PRIM:
-			switch(node->tok->type) {
-				case TT_INT:
-					vpush(st->code, (x64Ins) {MOV, rax, imm(node->tok->intv)});
-					return;
-				default:
-					return;
-			}
-			return;
-		default:
-			return;
+/*
+ * Statements' nodes come one after the other in post-order, so an expression is just the next run of nodes up to its
+ * root, and every operator comes up right after its operands. The newest value sits in rax and the older ones that are
+ * still waiting on an operator get pushed. An expression with anything unsupported in it emits nothing at all, since
+ * cutting it off halfway would leave its pushes on the stack.
+ */
+static void parse_expr(struct x86State* st, u32 root) {
+	if(root == RS_NONE) return;
+
+	u32 live = 0, start = vlen(st->code);
+	for(; st->node <= root; st->node ++) {
+		RS_FlatExpr* node = st->ast.nodes + st->node;
+		RS_TokenType type = toktype(st, node->tok);
+		switch(node->type) {
+			case EX_PRIM:
+				switch(type) {
+					case TT_INT:
+						if(live++) vpush(st->code, (x64Ins) {PUSH, rax});
+						vpush(st->code, (x64Ins) {MOV, rax, imm(tokint(st, node->tok))});
+						continue;
+					default: goto unsupported;
+				}
+			case EX_REGULAR:
+				if(node->params[1] == RS_NONE) switch(type) {
+					case TT_POPENPAR: case TT_OPADD: continue;
+					case TT_OPSUB: vpush(st->code, (x64Ins) {NEG, rax}); continue;
+					case TT_OPBNOT: vpush(st->code, (x64Ins) {NOT, rax}); continue;
+					default: goto unsupported;
+				}
+
+				// Right operand is in rax, left one is on the stack
+				vpush(st->code, (x64Ins) {MOV, rcx, rax});
+				vpush(st->code, (x64Ins) {POP, rax});
+				live --;
+				switch(type) {
+					case TT_OPADD: vpush(st->code, (x64Ins) {ADD, rax, rcx}); continue;
+					case TT_OPSUB: vpush(st->code, (x64Ins) {SUB, rax, rcx}); continue;
+					case TT_OPMUL: vpush(st->code, (x64Ins) {IMUL, rax, rcx}); continue;
+					case TT_OPBAND: vpush(st->code, (x64Ins) {AND, rax, rcx}); continue;
+					case TT_OPBOR: vpush(st->code, (x64Ins) {OR, rax, rcx}); continue;
+					case TT_OPBXOR: vpush(st->code, (x64Ins) {XOR, rax, rcx}); continue;
+					default: goto unsupported;
+				}
+			default: goto unsupported;
+		}
 	}
+	return;
+
+unsupported:
+	vpopto(st->code, start);
+	st->node = root + 1;
 }
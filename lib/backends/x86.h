@@ -1,4 +1,5 @@
 #include "parse.h"
+#include "cache.h"
 #include "util.h"
 
 typedef struct RS_MachineResult RS_MachineResult;
@@ -9,4 +10,5 @@ struct RS_MachineResult {
 };
 
 RS_MachineResult x86_machine(struct RS_ParserState* st);
+RS_MachineResult x86_machine_cached(RS_ASTCache* cache);
 char* x86_asm(struct RS_ParserState* st);
\ No newline at end of file
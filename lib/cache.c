@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#define VEC_H_STATIC_INLINE
+#include <vec.h>
+#include <hash.h>
+#include <xxhash.h>
+#include "util.h"
+#include "tok.h"
+#include "parse.h"
+#include "cache.h"
+
+enum { SEC_STMTS, SEC_NODES, SEC_ARGS, SEC_TOKS, SEC_NAMES, SEC_TYPES, SEC_COUNT };
+
+struct RS_CacheHeader {
+	char magic[4];
+	u32 version;
+	u64 key;
+	u64 size;                // Of the whole file, so one that got cut off reads as stale
+	u32 sections[SEC_COUNT]; // Where each section's vec header starts
+};
+
+// These are written out as is, RS_CACHE_VERSION has to go up along with any change to them
+_Static_assert(sizeof(RS_FlatStmt) == 16 && sizeof(RS_FlatExpr) == 24 && sizeof(RS_CacheTok) == 24 &&
+	sizeof(RS_Type) == 16, "cache layout changed");
+// Token numbers are in the file too, adding one renumbers the rest. So are vec headers, which VEC_H_SIZE64 makes bigger.
+#define VERSION (RS_CACHE_VERSION << 16 | sizeof(struct vecdata_) << 8 | TT_ERROR)
+
+u64 cache_key(char* src, u64 len) {
+	return XXH64(src, len, 0);
+}
+
+// Appends `size` bytes as a vec, starting on 8 bytes so whatever's in it is aligned once mapped
+static u32 section(char** out, void* data, u32 size) {
+	u32 pad = -vlen(*out) & 7;
+	memset(vprealloc(*out, pad), 0, pad);
+	u32 at = vlen(*out);
+	*(struct vecdata_*) vprealloc(*out, sizeof(struct vecdata_)) = (struct vecdata_) { .used = size, .cap = size };
+	if(size) memcpy(vprealloc(*out, size), data, size);
+	return at;
+}
+
+/*
+ * Writes next to `path` and renames it over, so a reader only ever sees a whole file. Tokens lose their pointers on the
+ * way out, each distinct name is only written once.
+ */
+bool cache_save(char* path, struct RS_ParserState* st, u64 key) {
+	RS_FlatAST ast = flatten(st);
+	RS_CacheTok* toks = vnew();
+	char* names = vnew();
+	ht(char*, u32) interned = {};
+	vpush(names, 0);
+
+	for(u32 i = 0; i < vlen(st->toks.tt); i ++) {
+		RS_Token tok = toks_at(&st->toks, i);
+		RS_CacheTok out;
+		memset(&out, 0, sizeof(out)); // Same source, same bytes
+		out.place = tok.place, out.len = tok.len, out.from = tok.from, out.type = tok.type, out.nl = tok.nl;
+		if(tok.type == TT_INT) out.intv = tok.intv;
+		else if(tok.type == TT_FLOAT) out.floatv = tok.floatv;
+		else if(toks_data(&st->toks, i)) {
+			u32* at = hgets(interned, tok.data);
+			if(at) out.name = *at;
+			else {
+				out.name = vlen(names);
+				hsets(interned, tok.data) = out.name;
+				memcpy(vprealloc(names, strlen(tok.data) + 1), tok.data, strlen(tok.data) + 1);
+			}
+		}
+		memcpy(vprealloc(toks, 1), &out, sizeof(out));
+	}
+
+	char* out = vnew();
+	struct RS_CacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, RS_CACHE_MAGIC, 4);
+	header.version = VERSION, header.key = key;
+	vprealloc(out, sizeof(header));
+	header.sections[SEC_STMTS] = section(&out, ast.stmts, vlen(ast.stmts) * sizeof(*ast.stmts));
+	header.sections[SEC_NODES] = section(&out, ast.nodes, vlen(ast.nodes) * sizeof(*ast.nodes));
+	header.sections[SEC_ARGS] = section(&out, ast.args, vlen(ast.args) * sizeof(*ast.args));
+	header.sections[SEC_TOKS] = section(&out, toks, vlen(toks) * sizeof(*toks));
+	header.sections[SEC_NAMES] = section(&out, names, vlen(names));
+	header.sections[SEC_TYPES] = section(&out, st->types, vlen(st->types) * sizeof(*st->types));
+	header.size = vlen(out);
+	memcpy(out, &header, sizeof(header));
+
+	free_flat(&ast);
+	vfree(toks);
+	vfree(names);
+	hfree(interned);
+
+	size_t len = strlen(path);
+	char* tmp = malloc(len + 5);
+	memcpy(tmp, path, len);
+	memcpy(tmp + len, ".tmp", 5);
+	FILE* fp = fopen(tmp, "wb");
+	bool ok = fp && fwrite(out, 1, vlen(out), fp) == vlen(out);
+	if(fp) ok = !fclose(fp) && ok;
+#ifdef _WIN32
+	ok = ok && MoveFileExA(tmp, path, MOVEFILE_REPLACE_EXISTING); // rename won't go over a file that's there
+#else
+	ok = ok && !rename(tmp, path);
+#endif
+	if(!ok) remove(tmp);
+	free(tmp);
+	vfree(out);
+	return ok;
+}
+
+// Points `*sec` at the section's data if it's all inside the file
+static bool find_section(void* map, u64 size, u32 at, u32 elem, void** sec) {
+	if(at & 7 || (u64) at + sizeof(struct vecdata_) > size) return false;
+	struct vecdata_* v = (struct vecdata_*) ((char*) map + at);
+	if(v->used != v->cap || v->used % elem || (u64) at + sizeof(struct vecdata_) + v->used > size) return false;
+	*sec = v->data;
+	return true;
+}
+
+#define within(x, n) ((x) == RS_NONE || (x) < (n))
+
+/*
+ * Every index in the file has to land inside the section it points into, so a cache that got cut off or corrupted
+ * without its key changing reads as stale instead of sending a backend off the end. Children come before their parent
+ * and inner types before the types made of them, same as when they were written, so nothing loops either.
+ */
+static bool check_indices(RS_ASTCache* c) {
+	u32 nstmts = vlen(c->ast.stmts), nnodes = vlen(c->ast.nodes), nargs = vlen(c->ast.args);
+	u32 ntoks = vlen(c->toks), nnames = vlen(c->names), ntypes = vlen(c->types);
+	if(!nstmts || c->ast.stmts[nstmts - 1].type != ST_EOF) return false; // Backends go until they see it
+	for(RS_FlatStmt* s = c->ast.stmts; s < c->ast.stmts + nstmts; s ++)
+		if(s->type < ST_EXPR || s->type > ST_EOF || !within(s->expr, nnodes)) return false;
+	for(u32 i = 0; i < nnodes; i ++) {
+		RS_FlatExpr* n = c->ast.nodes + i;
+		if(n->tok >= ntoks || n->ty >= ntypes) return false;
+		switch(n->type) {
+			case EX_CALL:
+				if(!within(n->params[0], i) || (u64) n->params[1] + n->params[2] > nargs) return false;
+				break;
+			case EX_REGULAR: case EX_PRIM:
+				for(u32 j = 0; j < 3; j ++) if(!within(n->params[j], i)) return false;
+				break;
+			case EX_VAR: break; // Depth and slot, not nodes
+			default: return false;
+		}
+	}
+	for(u32 i = 0; i < nargs; i ++) if(c->ast.args[i] >= nnodes) return false;
+	for(RS_CacheTok* t = c->toks; t < c->toks + ntoks; t ++)
+		if(t->type > TT_ERROR || (t->type != TT_INT && t->type != TT_FLOAT && t->name >= nnames)) return false;
+	for(u32 i = 0; i < ntypes; i ++) {
+		RS_Type* t = c->types + i;
+		if(t->kind > TY_RECORD || !within(t->inner, i) || !within(t->field, i)) return false;
+	}
+	return true;
+}
+
+#undef within
+
+/*
+ * Maps the cache for a source with hash `key`. False if there isn't one, or it's from another version or another source,
+ * in which case the caller parses like normal and saves over it.
+ */
+bool cache_load(RS_ASTCache* cache, char* path, u64 key) {
+	*cache = (RS_ASTCache) {};
+#ifdef _WIN32
+	FILE* fp = fopen(path, "rb");
+	if(!fp) return false;
+	fseek(fp, 0, SEEK_END);
+	u64 size = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+	void* map = malloc(size ? size : 1);
+	bool read = fread(map, 1, size, fp) == size;
+	fclose(fp);
+	if(!read) { free(map); return false; }
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return false;
+	struct stat info;
+	if(fstat(fd, &info) || (u64) info.st_size < sizeof(struct RS_CacheHeader)) { close(fd); return false; }
+	u64 size = info.st_size;
+	void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED) return false;
+#endif
+	cache->map = map;
+	cache->mapsize = size;
+
+	struct RS_CacheHeader* header = map;
+	bool ok = size >= sizeof(struct RS_CacheHeader) && !memcmp(header->magic, RS_CACHE_MAGIC, 4) &&
+		header->version == VERSION && header->key == key && header->size == size &&
+		find_section(map, size, header->sections[SEC_STMTS], sizeof(RS_FlatStmt), (void**) &cache->ast.stmts) &&
+		find_section(map, size, header->sections[SEC_NODES], sizeof(RS_FlatExpr), (void**) &cache->ast.nodes) &&
+		find_section(map, size, header->sections[SEC_ARGS], sizeof(u32), (void**) &cache->ast.args) &&
+		find_section(map, size, header->sections[SEC_TOKS], sizeof(RS_CacheTok), (void**) &cache->toks) &&
+		find_section(map, size, header->sections[SEC_NAMES], 1, (void**) &cache->names) &&
+		find_section(map, size, header->sections[SEC_TYPES], sizeof(RS_Type), (void**) &cache->types) &&
+		vlen(cache->names) && cache->names[vlen(cache->names) - 1] == 0 && check_indices(cache);
+	if(!ok) cache_free(cache);
+	return ok;
+}
+
+void cache_free(RS_ASTCache* cache) {
+#ifdef _WIN32
+	free(cache->map);
+#else
+	if(cache->map) munmap(cache->map, cache->mapsize);
+#endif
+	*cache = (RS_ASTCache) {};
+}
@@ -0,0 +1,47 @@
+#pragma once
+#include "util.h"
+#include "parse.h"
+
+/*
+ * On-disk copy of a parse, so modules whose source hasn't changed skip tokenizing and parsing. The file is a header and
+ * then each section laid out as a vec, so the mapped file gets used in place: vlen works on every pointer in an
+ * RS_ASTCache. `ast` and `toks` stand in for a parse wherever a backend takes one (x86_machine_cached), just not for
+ * free_flat. parse_modules maps these in for every file that has an up to date one.
+ * Files are native endian and only ever read back by the same build, anything that doesn't check out is just stale.
+ */
+#define RS_CACHE_MAGIC "RSAC"
+#define RS_CACHE_VERSION 5 // Bump whenever anything written out here changes layout
+
+// A token without its pointer. Identifiers and strings point into `names` with an offset instead.
+struct RS_CacheTok {
+	union {
+		u64 intv;
+		double floatv;
+		u64 name;
+	};
+	u32 place;
+	u32 len;
+	u32 from;
+	u8 type;
+	bool nl;
+};
+typedef struct RS_CacheTok RS_CacheTok;
+
+struct RS_ASTCache {
+	RS_FlatAST ast;
+	RS_CacheTok* toks; // What the `tok` of every node indexes into
+	char* names;       // Every distinct name once, NUL terminated. Starts with an empty one for tokens without a name
+	RS_Type* types;    // What the `ty` of every node indexes into
+	void* map;
+	u64 mapsize;
+};
+typedef struct RS_ASTCache RS_ASTCache;
+
+static inline char* cache_name(RS_ASTCache* cache, RS_CacheTok* tok) {
+	return cache->names + tok->name;
+}
+
+u64 cache_key(char* src, u64 len);
+bool cache_save(char* path, struct RS_ParserState* st, u64 key);
+bool cache_load(RS_ASTCache* cache, char* path, u64 key);
+void cache_free(RS_ASTCache* cache);
@@ -0,0 +1,155 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+#include <hash.h>
+#include "util.h"
+#include "tok.h"
+#include "parse.h"
+#include "error.h"
+#include "cache.h"
+#include "driver.h"
+
+/*
+ * Files get dealt out as one contiguous range per worker. A worker eats its own range from the front, and once that's
+ * empty it steals the back half of whichever range has the most left, so a handful of huge files can't leave the rest
+ * of the pool sitting idle. A range is one word holding [lo, hi), owner and thieves agree on it with a single CAS.
+ */
+#define SPAN(lo, hi) ((u64) (hi) << 32 | (lo))
+#define SPAN_LO(s) ((u32) (s))
+#define SPAN_HI(s) ((u32) ((s) >> 32))
+
+struct drv_range {
+	_Atomic u64 span;
+	char pad[56]; // Each on its own cache line, the owner hits this for every file
+};
+
+struct drv_pool {
+	RS_SourceFile* files;
+	struct RS_ParserState** states;
+	RS_ASTCache* caches;
+	RS_Diags* diags; // Per file, so they come out in the files' order no matter who parsed what
+	struct drv_range* ranges;
+	u32 threads;
+	_Atomic u32 failed;
+};
+
+struct drv_worker {
+	struct drv_pool* pool;
+	u32 id;
+};
+
+static bool take(struct drv_range* r, u32* idx) {
+	u64 s = atomic_load_explicit(&r->span, memory_order_relaxed);
+	do if(SPAN_LO(s) >= SPAN_HI(s)) return false;
+	while(!atomic_compare_exchange_weak(&r->span, &s, SPAN(SPAN_LO(s) + 1, SPAN_HI(s))));
+	*idx = SPAN_LO(s);
+	return true;
+}
+
+// Moves the back half of the fullest range over to `self`, false once every range is empty
+static bool steal(struct drv_pool* pool, u32 self) {
+	for(;;) {
+		u32 victim = self, most = 0;
+		for(u32 i = 0; i < pool->threads; i ++) {
+			u64 s = atomic_load_explicit(&pool->ranges[i].span, memory_order_relaxed);
+			if(SPAN_LO(s) < SPAN_HI(s) && SPAN_HI(s) - SPAN_LO(s) > most) most = SPAN_HI(s) - SPAN_LO(s), victim = i;
+		}
+		if(!most) return false;
+
+		u64 s = atomic_load_explicit(&pool->ranges[victim].span, memory_order_relaxed);
+		u32 lo = SPAN_LO(s), hi = SPAN_HI(s);
+		if(lo >= hi) continue;
+		u32 mid = hi - (hi - lo + 1) / 2;
+		if(!atomic_compare_exchange_strong(&pool->ranges[victim].span, &s, SPAN(lo, mid))) continue;
+		// Nobody touches an empty range, so ours can just be overwritten
+		atomic_store(&pool->ranges[self].span, SPAN(mid, hi));
+		return true;
+	}
+}
+
+/*
+ * Each parse owns its own arena and is only ever touched by the worker that made it, so the nodes of one file all end up
+ * in memory that worker allocated. Caching needs the whole source to hash, so files that can't be mapped just parse.
+ */
+static void parse_one(struct drv_pool* pool, u32 idx) {
+	RS_SourceFile* f = pool->files + idx;
+	struct RS_ParserState* st = NULL;
+	RS_Diags* outer = diags_current();
+	diags_collect(pool->diags + idx);
+	RS_TokState lex;
+	bool opened = !f->src && tok_init_file(&lex, f->file);
+	char* src = f->src ? f->src : opened && lex.map ? lex.buf : NULL;
+	u64 key = f->cache && src ? cache_key(src, strlen(src)) : 0;
+	bool cached = f->cache && src && cache_load(pool->caches + idx, f->cache, key);
+
+	if(!cached) {
+		if(f->src) st = parse(f->file, f->src);
+		else if(opened) st = parse_stream(f->file, &lex);
+		else error_at(NULL, NULL, 0, f->file, "Couldn't open the file");
+		if(st && f->cache && src && !st->errors && !st->warnings) cache_save(f->cache, st, key);
+	}
+	if(opened) tok_free(&lex);
+	diags_collect(outer);
+	pool->states[idx] = st;
+	if(!cached && (!st || st->errors)) atomic_fetch_add_explicit(&pool->failed, 1, memory_order_relaxed);
+}
+
+static int drv_work(void* arg) {
+	struct drv_worker* w = arg;
+	u32 idx;
+	do while(take(&w->pool->ranges[w->id], &idx)) parse_one(w->pool, idx);
+	while(steal(w->pool, w->id));
+	return 0;
+}
+
+// Parses every file on `threads` threads (the calling one included), then puts them all in one table by name.
+RS_Modules parse_modules(RS_SourceFile* files, u32 n, u32 threads) {
+	if(threads > n) threads = n;
+	if(threads < 1) threads = 1;
+
+	struct drv_pool pool = {
+		.files = files,
+		.states = calloc(n ? n : 1, sizeof(struct RS_ParserState*)),
+		.caches = calloc(n ? n : 1, sizeof(RS_ASTCache)),
+		.diags = calloc(n ? n : 1, sizeof(RS_Diags)),
+		.ranges = aligned_alloc(64, threads * sizeof(struct drv_range)),
+		.threads = threads,
+	};
+	struct drv_worker* workers = malloc(threads * sizeof(struct drv_worker));
+	for(u32 i = 0; i < threads; i ++) {
+		atomic_init(&pool.ranges[i].span, SPAN((u64) n * i / threads, (u64) n * (i + 1) / threads));
+		workers[i] = (struct drv_worker) { .pool = &pool, .id = i };
+	}
+
+	thrd_t* handles = malloc(threads * sizeof(thrd_t));
+	for(u32 i = 1; i < threads; i ++) thrd_create(handles + i, drv_work, workers + i);
+	drv_work(workers);
+	for(u32 i = 1; i < threads; i ++) thrd_join(handles[i], NULL);
+	free(handles);
+	free(workers);
+	free(pool.ranges);
+
+	// Into the caller's sink if there is one, otherwise out in one go
+	RS_Diags all = {}, * to = diags_current() ? diags_current() : &all;
+	for(u32 i = 0; i < n; i ++) diags_merge(to, pool.diags + i), diags_free(pool.diags + i);
+	diags_flush(&all, stderr, rs_diag_format);
+	diags_free(&all);
+	free(pool.diags);
+
+	RS_Modules mods = { .states = pool.states, .caches = pool.caches, .n = n, .failed = pool.failed };
+	for(u32 i = 0; i < n; i ++) if(pool.states[i] || pool.caches[i].map) hsets(mods.table, files[i].file) = i;
+	return mods;
+}
+
+void free_modules(RS_Modules* mods) {
+	for(u32 i = 0; i < mods->n; i ++) {
+		if(mods->states[i]) free_parser(mods->states[i]);
+		if(mods->caches[i].map) cache_free(mods->caches + i);
+	}
+	hfree(mods->table);
+	free(mods->states);
+	free(mods->caches);
+	*mods = (RS_Modules) {};
+}
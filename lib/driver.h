@@ -0,0 +1,38 @@
+#pragma once
+#include "util.h"
+#include "parse.h"
+#include "cache.h"
+
+// One file of a project. `src` can be left NULL to have the driver map `file` in itself.
+struct RS_SourceFile {
+	char* file;
+	char* src;
+	char* cache; // Where to keep its parse between runs, NULL to always parse it
+};
+typedef struct RS_SourceFile RS_SourceFile;
+
+/*
+ * Every file of a project after parsing, looked up by file name through `table` (see find_module). `states` keeps the
+ * order the files were given in, with NULL for the ones that couldn't be opened or lexed. `failed` also counts files
+ * that parsed with errors. Owns every state in it. Messages all come out at the end in the order of the files, or go to
+ * the caller's sink.
+ * A file with a `cache` whose source hasn't changed since it was saved gets mapped from there instead: it's in `caches`,
+ * ready for a backend, and has no state. Only parses without any messages get saved, so those don't have any to repeat.
+ */
+struct RS_Modules {
+	ht(char*, u32) table; // File name to where it is in `states` and `caches`, parsed or cached
+	struct RS_ParserState** states;
+	RS_ASTCache* caches; // Per file, all zeroes unless it came from its cache
+	u32 n;
+	u32 failed;
+};
+typedef struct RS_Modules RS_Modules;
+
+// Where `file` is in `states` and `caches`, RS_NONE if it was never given or couldn't be opened
+static inline u32 find_module(RS_Modules* mods, char* file) {
+	u32* at = hgets(mods->table, file);
+	return at ? *at : RS_NONE;
+}
+
+RS_Modules parse_modules(RS_SourceFile* files, u32 n, u32 threads);
+void free_modules(RS_Modules* mods);
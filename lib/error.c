@@ -1,23 +1,62 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define VEC_H_STATIC_INLINE
+#include <vec.h>
 #include "util.h"
+#include "error.h"
 
-// Every single piece of info about a line you'd ever want
-static inline u32 line(char* str, u32 place, u32* start, u32* end) {
+/*
+ * Newlines get counted first so the table can be made exactly as big as it has to be, then found again to fill it in.
+ * With SSE2 both go 16 bytes at a time.
+ */
+u32* line_starts(char* str) {
+	u32 len = strlen(str), count = 0, i = 0;
+#ifdef __SSE2__
+	__m128i nl = _mm_set1_epi8('\n');
+	for(; i + 16 <= len; i += 16)
+		count += __builtin_popcount(_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) (str + i)), nl)));
+#endif
+	for(; i < len; i ++) count += str[i] == '\n';
 
-	if(end) {
-		u32 cur = place;
-		while(str[cur] && str[cur] != '\n') cur ++;
-		*end = cur;
-	}
+	u32* starts = vnew();
+	vreserve(starts, count + 2);
+	vpush_unsafe(starts, 0);
+	i = 0;
+#ifdef __SSE2__
+	for(; i + 16 <= len; i += 16)
+		for(u32 m = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) (str + i)), nl)); m; m &= m - 1)
+			vpush_unsafe(starts, i + __builtin_ctz(m) + 1);
+#endif
+	for(; i < len; i ++) if(str[i] == '\n') vpush_unsafe(starts, i + 1);
+	vpush_unsafe(starts, len + 1);
+	return starts;
+}
 
-	u32 cur = place;
-	while(cur > 0 && str[cur] != '\n') cur --;
-	if(start) *start = cur;
-	
-	u32 line_count = 1;
-	for(; cur > 0; cur --) if(str[cur] == '\n') line_count ++;
-	return line_count;
+u32 line_col(char* str, u32* starts, u32 place, u32* col) {
+	// starts[lo] <= place < starts[hi], the last entry is past anything a message can point at
+	u32 lo = 0, hi = vlen(starts) - 1;
+	while(hi - lo > 1) {
+		u32 mid = (lo + hi) / 2;
+		if(starts[mid] <= place) lo = mid;
+		else hi = mid;
+	}
+	if(col) {
+		// Continuation bytes are the ones that look like 10xxxxxx
+		*col = 1;
+		for(u32 i = starts[lo]; i < place; i ++) *col += ((u8) str[i] & 0xC0) != 0x80;
+	}
+	return lo + 1;
 }
 
 // Counts the length of an integer
@@ -56,32 +95,180 @@ static inline int count_digits(uint32_t n) {
 #endif
 }
 
+RS_DiagFormat rs_diag_format = DIAG_CARET;
+
+static _Thread_local RS_Diags* current;
+
+void diags_collect(RS_Diags* d) {
+	current = d;
+}
+
+RS_Diags* diags_current(void) {
+	return current;
+}
+
+// Copies `len` bytes of `s` into the sink, NUL terminated, returns where they went
+static u32 keep(RS_Diags* d, const char* s, u32 len) {
+	if(!d->text) d->text = vnew();
+	u32 at = vlen(d->text);
+	char* to = vprealloc(d->text, len + 1);
+	memcpy(to, s, len);
+	to[len] = 0;
+	return at;
+}
+
+void parser_message(RS_Diags* d, RS_Severity sev, char* str, u32** lines, u32 place, char* file, char* fmt, ...) {
+	// Even on its own, a message goes out in a single write
+	RS_Diags one = {};
+	RS_Diags* to = d ? d : &one;
+	if(!to->list) to->list = vnew();
+	RS_Diag diag = { .severity = sev, .file = keep(to, file, strlen(file)), .place = place };
+
+	va_list args;
+	va_start(args, fmt);
+	u32 len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	diag.msg = vlen(to->text);
+	va_start(args, fmt);
+	vsnprintf(vprealloc(to->text, len + 1), len + 1, fmt, args);
+	va_end(args);
+
+	// Streamed sources aren't around anymore, so there's no line to show
+	if(str) {
+		u32* starts = lines && *lines ? *lines : line_starts(str);
+		if(lines) *lines = starts;
+		diag.line = line_col(str, starts, place, &diag.col);
+		u32 start = starts[diag.line - 1], end = starts[diag.line] - 1;
+		if(!lines) vfree(starts);
+		diag.snippet = keep(to, str + start, end - start), diag.snippetlen = end - start;
+	}
+	vpush(to->list, diag);
+
+	if(!d) {
+		diags_flush(&one, stderr, rs_diag_format);
+		diags_free(&one);
+	}
+}
+
+void diags_merge(RS_Diags* to, RS_Diags* from) {
+	if(!from->list || !vlen(from->list)) return;
+	if(!to->list) to->list = vnew();
+	if(!to->text) to->text = vnew();
+	u32 base = vlen(to->text);
+	vpushv(to->text, from->text);
+	vfor(from->list, m) {
+		RS_Diag moved = *m;
+		moved.file += base, moved.msg += base, moved.snippet += base;
+		vpush(to->list, moved);
+	}
+	vempty(from->list);
+	vempty(from->text);
+}
+
+void diags_free(RS_Diags* d) {
+	if(d->list) vfree(d->list);
+	if(d->text) vfree(d->text);
+	*d = (RS_Diags) {};
+}
+
+// printf onto the end of a vec
+#if defined __clang__ || defined __GNUC__
+__attribute__((format(printf, 2, 3)))
+#endif
+static void put(char** out, char* fmt, ...) {
+	va_list args;
+	va_start(args, fmt);
+	u32 len = vsnprintf(NULL, 0, fmt, args);
+	va_end(args);
+	va_start(args, fmt);
+	vsnprintf(vprealloc(*out, len + 1), len + 1, fmt, args);
+	va_end(args);
+	vpop(*out); // The NUL
+}
+
+// A JSON string, quotes included
+static void put_json(char** out, char* s) {
+	vpush(*out, '"');
+	for(; *s; s ++) {
+		if(*s == '"' || *s == '\\') vpush(*out, '\\'), vpush(*out, *s);
+		else if(*s == '\n') put(out, "\\n");
+		else if(*s == '\t') put(out, "\\t");
+		else if((u8) *s < 0x20) put(out, "\\u%04x", *s);
+		else vpush(*out, *s);
+	}
+	vpush(*out, '"');
+}
+
 #define ERRORSTRMAXWIDTH 200
 
 /*
-	Makes an error like
+	Caret messages look like
 ----------------------------------
-test.c@18:8: Unexpected identifier
+test.c@18:8: error: Unexpected identifier
 18 | let br;h
    |        ^
 ----------------------------------
+	Colored when they go to a terminal.
 */
-void parser_message(char* str, u32 place, char* file, char* fmt, ...) {
-	u32 start, end;
-	u32 linenum = line(str, place, &start, &end);
-	u32 linenumlen = count_digits(linenum);
-	// u32 len = start - end - 1 + 3 + linenumlen;
+static void put_caret(char** out, RS_Diags* d, RS_Diag* m, bool color) {
+	char* sev = m->severity == SEV_ERROR ? "error" : "warning";
+	if(!m->line) {
+		put(out, "%s@%u: %s: %s\n", d->text + m->file, m->place, sev, d->text + m->msg);
+		return;
+	}
+	put(out, "%s@%u:%u: %s: %s\n", d->text + m->file, m->line, m->col, sev, d->text + m->msg);
+	put(out, "%u | %.*s\n", m->line, (int) m->snippetlen, d->text + m->snippet);
+	put(out, "%*s| %*s%s^%s\n", count_digits(m->line) + 1, "", (int) (m->col - 1), "", color ? "\033[31;1m" : "",
+		color ? "\033[0m" : "");
+}
 
-	// The error
-	va_list args;
-	va_start(args, fmt);
-	fprintf(stderr, "%s@%d:%d: ", file, linenum, place - start);
-	vfprintf(stderr, fmt, args);
-	fprintf(stderr, "\n");
+static void put_record(char** out, RS_Diags* d, RS_Diag* m) {
+	put(out, "{\"severity\": \"%s\", \"file\": ", m->severity == SEV_ERROR ? "error" : "warning");
+	put_json(out, d->text + m->file);
+	if(m->line) put(out, ", \"line\": %u, \"column\": %u", m->line, m->col);
+	put(out, ", \"offset\": %u, \"message\": ", m->place);
+	put_json(out, d->text + m->msg);
+	put(out, "}");
+}
 
-	// Prints out the line
-	fprintf(stderr, "%d | %.*s\n", linenum, (u32) (start - end - 1), str + start);
+// Columns count code points, like ours, instead of SARIF's default of UTF-16 units
+static void put_sarif(char** out, RS_Diags* d, RS_Diag* m) {
+	put(out, "{\"level\": \"%s\", \"message\": {\"text\": ", m->severity == SEV_ERROR ? "error" : "warning");
+	put_json(out, d->text + m->msg);
+	put(out, "}, \"locations\": [{\"physicalLocation\": {\"artifactLocation\": {\"uri\": ");
+	put_json(out, d->text + m->file);
+	if(m->line) put(out, "}, \"region\": {\"startLine\": %u, \"startColumn\": %u}}}]}", m->line, m->col);
+	else put(out, "}, \"region\": {\"charOffset\": %u}}}]}", m->place);
+}
+
+void diags_flush(RS_Diags* d, FILE* out, RS_DiagFormat format) {
+	if(!d->list || !vlen(d->list)) return;
+#ifdef _WIN32
+	bool color = _isatty(_fileno(out));
+#else
+	bool color = isatty(fileno(out));
+#endif
+
+	char* buf = vnew();
+	if(format == DIAG_JSON) put(&buf, "[\n");
+	if(format == DIAG_SARIF) put(&buf, "{\"version\": \"2.1.0\", \"$schema\": \"https://json.schemastore.org/sarif-2.1.0.json\", "
+		"\"runs\": [{\"tool\": {\"driver\": {\"name\": \"rush\"}}, \"columnKind\": \"unicodeCodePoints\", \"results\": [\n");
+	vfor(d->list, m) {
+		bool last = m == vlast(d->list);
+		if(format == DIAG_CARET) put_caret(&buf, d, m, color);
+		else {
+			put(&buf, "\t");
+			if(format == DIAG_JSON) put_record(&buf, d, m);
+			else put_sarif(&buf, d, m);
+			put(&buf, last ? "\n" : ",\n");
+		}
+	}
+	if(format == DIAG_JSON) put(&buf, "]\n");
+	if(format == DIAG_SARIF) put(&buf, "]}]}\n");
 
-	// Prints out the spaces and then the ^
-	fprintf(stderr, "%*s|%*s\033[31;1m^\033[0m\n", linenumlen + 1, "", place - linenumlen - 2 - start, "");
+	fwrite(buf, 1, vlen(buf), out);
+	fflush(out);
+	vfree(buf);
+	vempty(d->list);
+	vempty(d->text);
 }
@@ -1,11 +1,73 @@
 #pragma once
+#include <stdio.h>
 #include "util.h"
 
 // void error_at(char* str, u32 place, char* fmt, ...);
 
+enum RS_Severity { SEV_ERROR, SEV_WARNING };
+typedef enum RS_Severity RS_Severity;
+
+enum RS_DiagFormat {
+	DIAG_CARET, // What people read, the message and then its line with a ^ under the spot
+	DIAG_JSON,  // One array of every message, for tools
+	DIAG_SARIF, // SARIF 2.1.0, for tools that already read that
+};
+typedef enum RS_DiagFormat RS_DiagFormat;
+
+/*
+ * One message. Everything it points at is copied into its sink's `text`, as offsets, so it can outlive the source and
+ * the parse it came from. `line` is 0 for streamed sources, those only have `place` to go by.
+ */
+struct RS_Diag {
+	u8 severity;
+	u32 file;
+	u32 place;
+	u32 line, col;
+	u32 msg;
+	u32 snippet, snippetlen; // The line it's on
+};
+typedef struct RS_Diag RS_Diag;
+
+/*
+ * Messages collected to go out together in one write. A sink only ever gets filled by one thread, parallel parses each
+ * fill their own and whoever started them merges those in a fixed order at the end. Zeroed is empty.
+ */
+struct RS_Diags {
+	RS_Diag* list; // vec, NULL until the first message
+	char* text;    // vec
+};
+typedef struct RS_Diags RS_Diags;
+
+// How messages that get flushed for the caller come out, see diags_flush. Caret by default.
+extern RS_DiagFormat rs_diag_format;
+
+/*
+ * Sets where this thread's messages go until the next call, NULL to have each parse collect its own and flush them when
+ * it's done.
+ */
+void diags_collect(RS_Diags* d);
+RS_Diags* diags_current(void);
+
+/*
+ * Adds a message about `place` in `str` to `d`, with the line it's on. `lines` is where the source's line_starts are
+ * kept between messages, the first one builds them. NULL builds them just for this message. A NULL `d` writes the
+ * message out right away.
+ */
 #if defined __clang__ || defined __GNUC__
-__attribute__((format(printf, 4, 5)))
+__attribute__((format(printf, 7, 8)))
 #endif
-void parser_message(char* str, u32 place, char* file, char* fmt, ...);
+void parser_message(RS_Diags* d, RS_Severity sev, char* str, u32** lines, u32 place, char* file, char* fmt, ...);
+
+// Moves every message of `from` to the end of `to`, leaving `from` empty
+void diags_merge(RS_Diags* to, RS_Diags* from);
+// Writes out every message in the order they came in, in one go, and empties `d`. Nothing at all if it's empty.
+void diags_flush(RS_Diags* d, FILE* out, RS_DiagFormat format);
+void diags_free(RS_Diags* d);
+
+// Where each line of `str` starts as a vec, ending with one past the terminator so every line has a next start
+u32* line_starts(char* str);
+// The line `place` is on, counting from 1. `col` gets its column, UTF-8 sequences counting as one.
+u32 line_col(char* str, u32* starts, u32 place, u32* col);
 
-#define error_at(str, place, file, ...) parser_message(str, place, file, "error: " __VA_ARGS__)
+#define error_at(str, lines, place, file, ...) parser_message(diags_current(), SEV_ERROR, str, lines, place, file, __VA_ARGS__)
+#define warning_at(str, lines, place, file, ...) parser_message(diags_current(), SEV_WARNING, str, lines, place, file, __VA_ARGS__)
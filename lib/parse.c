@@ -1,4 +1,5 @@
 #include <stdlib.h>
+#include <string.h>
 
 #define VEC_H_STATIC_INLINE
 #include <vec.h>
@@ -6,7 +7,8 @@
 #include "parse.h"
 #include "error.h"
 
-#define error(...) error_at(st->src, st->toks[st->ind + 1].place, st->file, __VA_ARGS__)
+// Points at the token the parser is on
+#define error(...) (st->errors ++, error_at(st->src, &st->lines, st->toks.place[st->ind], st->file, __VA_ARGS__))
 
 
 enum RS_OpClass {
@@ -20,113 +22,543 @@ enum RS_OpClass {
 	OC_PAREN /* () */
 };
 
-static inline RS_Expr* new_expr(RS_Expr* ex) {
-	return memcpy(malloc(sizeof(RS_Expr)), ex, sizeof(RS_Expr));
+static inline RS_Expr* new_expr(struct RS_ParserState* st, RS_Expr* ex) {
+	RS_Expr* node = arena_alloc(&st->arena, sizeof(RS_Expr));
+	*node = *ex;
+	return node;
 }
 
 static void parse_stmt(struct RS_ParserState*);
-static RS_Expr* parse_expr(struct RS_ParserState* st, enum RS_OpClass highest);
-static RS_Type* parse_type(struct RS_ParserState*);
+static void push_stmt(struct RS_ParserState* st, RS_Stmt stmt, struct RS_StmtMark mark);
+static void end_file(struct RS_ParserState* st);
+static void leave(struct RS_ParserState* st);
+static void shift_stmts(struct RS_ParserState* st, RS_Stmt* stmts, u32 n, i64 shift);
+static bool pull(struct RS_ParserState* st);
+static RS_Expr* parse_expr(struct RS_ParserState* st);
+static u32 parse_type(struct RS_ParserState*);
 static RS_FuncArg* parse_funcarg(struct RS_ParserState*);
 static void parse_check(struct RS_ParserState* st, RS_Expr* ex);
-static RS_Token* expect(struct RS_ParserState* st, enum RS_TokenType type);
+static void init_types(struct RS_ParserState* st);
+static u32 intern_type(struct RS_ParserState* st, RS_Type ty);
+static u32 assign(struct RS_ParserState* st, u32 to, RS_Expr* value);
+static u32 settle(struct RS_ParserState* st, RS_Expr* ex);
+static u32 expect(struct RS_ParserState* st, enum RS_TokenType type);
 
 
 struct RS_ParserState* parse(char* file, char* str) {
-	RS_Token* toks = tokenize(str);
+	RS_TokState lex;
+	tok_init(&lex, str);
+	return parse_stream(file, &lex);
+}
 
-	if(vlast(toks)->type == TT_ERROR) {
-		error_at(str, vlast(toks)->place, file, "%s", vlast(toks)->data);
-		return NULL;
-	}
+// Without a sink from whoever's parsing, a parse collects its own messages and writes them all out once it's done
+static RS_Diags* own_diags(RS_Diags* own) {
+	if(diags_current()) return NULL;
+	diags_collect(own);
+	return own;
+}
+
+static void flush_own(RS_Diags* own) {
+	if(!own) return;
+	diags_collect(NULL);
+	diags_flush(own, stderr, rs_diag_format);
+	diags_free(own);
+}
 
+static struct RS_ParserState* parse_stream_(char* file, RS_TokState* lex);
+static struct RS_ParserState* reparse_(struct RS_ParserState* st, char* str, u32 offset, u32 deleted, u32 inserted);
+
+/*
+ * Parses straight out of a tokenizer, only lexing as far as the parser has gotten. That only bounds what the tokenizer
+ * holds: the state keeps every token it pulled along with the tree, so a parse still takes memory in proportion to the
+ * file. A mapped file's source is only there for messages during the parse, it goes away with the tokenizer.
+ */
+struct RS_ParserState* parse_stream(char* file, RS_TokState* lex) {
+	RS_Diags own = {}, * mine = own_diags(&own);
+	struct RS_ParserState* st = parse_stream_(file, lex);
+	flush_own(mine);
+	return st;
+}
+
+static struct RS_ParserState* parse_stream_(char* file, RS_TokState* lex) {
 	struct RS_ParserState* state = malloc(sizeof(struct RS_ParserState));
 	*state = (struct RS_ParserState) {
 		.ast = vnew(),
+		.marks = vnew(),
+		.after = { .ast = vnew(), .marks = vnew() },
 		.types = vnew(),
+		// Tables only ever grow, so they can live in the arena along with their keys
+		.typeids = { .alloc = &state->arena.alloc },
+		.fields = { .alloc = &state->arena.alloc },
 
 		.file = file,
-		.src = str,
-		.toks = toks,
+		.src = lex->read ? NULL : lex->buf,
+		.lex = lex,
+		.arena = ARENA_INIT,
+		.symbols = { .alloc = &state->arena.alloc },
+		.binds = vnew(),
+		.bound = vnew(),
 		.ind = 0,
 		.errors = 0,
 		.warnings = 0,
 	};
+	state->exprs = vsmallinit(state->small.exprs);
+	state->walk = vsmallinit(state->small.walk);
+	state->args = vsmallinit(state->small.args);
+	state->scopes = vsmallinit(state->small.scopes);
+	state->fieldstack = vsmallinit(state->small.fieldstack);
+	toks_init(&state->toks);
+
+	init_types(state);
 
-	while(state->toks[state->ind].type != TT_EOF) parse_stmt(state);
-	vpush(state->ast, { .type = ST_EOF });
+	while(pull(state)) {
+		if(state->ind >= vlen(state->toks.tt) || state->toks.tt[state->ind] == TT_EOF) {
+			end_file(state);
+			state->lex = NULL;
+			if(lex->map) {
+				state->src = NULL;
+				if(state->lines) vfree(state->lines), state->lines = NULL;
+			}
+			return state;
+		}
+		parse_stmt(state);
+	}
+
+	u32 err = vlen(state->toks.tt) - 1;
+	error_at(state->src, &state->lines, state->toks.place[err], file, "%s", toks_data(&state->toks, err));
+	free_parser(state);
+	return NULL;
+}
+
+/*
+ * Brings `st` up to date after `deleted` bytes at `offset` of its source got replaced with `inserted` new ones, `str`
+ * being the whole source after the edit. toks_retokenize patches the tokens, then parsing restarts at the statement
+ * before the first changed token and stops once it lands on the start of an old statement past the last one. Parsing
+ * only ever looks at a statement's own tokens, so everything from there on would come out the same. Statements outside
+ * that get kept as is, the same nodes.
+ * Names resolve against what's in scope, so parsing only restarts and stops outside of blocks, where that's just the
+ * globals declared so far. Declaring a global in between means everything after gets parsed again too, anything after
+ * might've been pointing at it.
+ * The tree has a gap at the edit like the tokens do, with the statements past it in `after`, so nothing past the edit
+ * gets touched. An edit costs what it reparses plus moving the gap over from the last one, next to nothing while edits
+ * stay in one place. close_gap puts the tree back in one piece for going over all of it, flatten does that by itself.
+ * Diagnostics only come out for what got parsed again, `errors` and `warnings` still count the whole file. Nodes of the
+ * statements that got replaced stay in the arena until the state is freed. Like parse, returns NULL (and frees the
+ * state) if the new source doesn't lex.
+ */
+struct RS_ParserState* reparse(struct RS_ParserState* st, char* str, u32 offset, u32 deleted, u32 inserted) {
+	RS_Diags own = {}, * mine = own_diags(&own);
+	st = reparse_(st, str, offset, deleted, inserted);
+	flush_own(mine);
+	return st;
+}
 
-	// vfor(state->expressions, expr)
-	// 	parse_check(state, expr);
-	
-	return state;
+// Statement `i`'s mark, wherever the gap is
+static struct RS_StmtMark mark_at(struct RS_ParserState* st, u32 i) {
+	if(i < vlen(st->marks)) return st->marks[i];
+	struct RS_StmtMark at = st->after.marks[vlen(st->after.marks) - 1 - (i - vlen(st->marks))];
+	at.tok += toks_count(&st->toks), at.errors += st->errors, at.warnings += st->warnings;
+	return at;
+}
+
+/*
+ * Moves statements over the gap until `ast` has the first `at`, or all of them. Past the gap everything counts back
+ * from the end of the file, tokens from how many there are and errors and warnings from the totals, the nodes' tokens
+ * too, so an edit before them doesn't change them. Where the gap is only globals are in scope, the ones declared before
+ * it, so moving a global's declaration over it binds or unbinds it.
+ */
+static void seek(struct RS_ParserState* st, u32 at) {
+	u32 count = toks_count(&st->toks);
+	while(vlen(st->ast) > at) {
+		RS_Stmt stmt = *vlast(st->ast);
+		struct RS_StmtMark mark = *vlast(st->marks);
+		vpop(st->ast), vpop(st->marks);
+		if(stmt.type == ST_DECLARE && !stmt.var->depth) {
+			st->bound[stmt.var->sym] = vlast(st->binds)->shadows;
+			vpop(st->binds);
+		}
+		shift_stmts(st, &stmt, 1, -(i64) count);
+		mark.tok -= count, mark.errors -= st->errors, mark.warnings -= st->warnings;
+		vpush(st->after.ast, stmt);
+		vpush(st->after.marks, mark);
+	}
+	while(vlen(st->ast) < at && vlen(st->after.ast)) {
+		RS_Stmt stmt = *vlast(st->after.ast);
+		struct RS_StmtMark mark = *vlast(st->after.marks);
+		vpop(st->after.ast), vpop(st->after.marks);
+		shift_stmts(st, &stmt, 1, count);
+		mark.tok += count, mark.errors += st->errors, mark.warnings += st->warnings;
+		vpush(st->ast, stmt);
+		vpush(st->marks, mark);
+		if(stmt.type == ST_DECLARE && !stmt.var->depth) {
+			vpush(st->binds, { .var = stmt.var, .shadows = st->bound[stmt.var->sym] });
+			st->bound[stmt.var->sym] = vlen(st->binds);
+		}
+	}
+}
+
+// Puts every statement and token back before the gap, so `ast`, `marks` and `toks` have the whole file again
+void close_gap(struct RS_ParserState* st) {
+	seek(st, UINT32_MAX);
+	toks_seek(&st->toks, UINT32_MAX);
+}
+
+static struct RS_ParserState* reparse_(struct RS_ParserState* st, char* str, u32 offset, u32 deleted, u32 inserted) {
+	// Keep statements [0, head), the last of those could've ended differently if the token after it changed
+	u32 restart = toks_restart(&st->toks, offset);
+	u32 lo = 0, hi = vlen(st->ast) + vlen(st->after.ast);
+	while(lo < hi) {
+		u32 mid = (lo + hi) / 2;
+		if(mark_at(st, mid).tok < restart) lo = mid + 1;
+		else hi = mid;
+	}
+	while(lo && mark_at(st, lo - 1).depth) lo --;
+	u32 head = lo ? lo - 1 : 0;
+	struct RS_StmtMark from = lo ? mark_at(st, head) : (struct RS_StmtMark) {};
+	u32 errors = st->errors, warnings = st->warnings;
+	seek(st, head); // Scopes are back to how they were there too
+	u32 globals = vlen(st->binds);
+
+	RS_TokEdit edit;
+	u32 count = toks_count(&st->toks);
+	toks_retokenize(&st->toks, str, offset, deleted, inserted, &edit);
+	st->src = str;
+	if(st->lines) vfree(st->lines), st->lines = NULL; // Lines moved with the edit
+	if(vlen(st->toks.tt) && *vlast(st->toks.tt) == TT_ERROR) {
+		u32 last = vlen(st->toks.tt) - 1;
+		error_at(st->src, &st->lines, st->toks.place[last], st->file, "%s", toks_data(&st->toks, last));
+		free_parser(st);
+		return NULL;
+	}
+
+	// Statements that started in what got lexed again are gone, the ones after still start at the same tokens from the end
+	while(vlen(st->after.ast) && vlast(st->after.marks)->tok + count < edit.end) vpop(st->after.ast), vpop(st->after.marks);
+	count = toks_count(&st->toks);
+
+	// Parse until we're at an old statement that's entirely past the edit, or at the end
+	st->ind = from.tok;
+	st->errors = from.errors;
+	st->warnings = from.warnings;
+	struct RS_StmtMark* next;
+	for(;;) {
+		while(vlen(st->after.ast) && vlast(st->after.marks)->tok + count < st->ind) vpop(st->after.ast), vpop(st->after.marks);
+		next = vlen(st->after.marks) ? vlast(st->after.marks) : NULL;
+		if(next && next->tok + count == st->ind && !next->depth && !vlen(st->scopes) && next->binds == globals &&
+			vlen(st->binds) == globals) break;
+		pull(st);
+		if(st->toks.tt[st->ind] == TT_EOF) {
+			end_file(st);
+			vpopto(st->after.ast, 0), vpopto(st->after.marks, 0);
+			next = NULL;
+			break;
+		}
+		parse_stmt(st);
+	}
+
+	// The statements kept past the gap count theirs back from the totals, which only changed by what got parsed again
+	if(next) errors = st->errors - next->errors, warnings = st->warnings - next->warnings;
+	else errors = st->errors, warnings = st->warnings;
+	st->ind = count - 1;
+	st->errors = errors, st->warnings = warnings;
+	return st;
+}
+
+// Everything the parse made goes in one go, the tree's nodes and the tables are all in the arena
+void free_parser(struct RS_ParserState* st) {
+	vfree(st->ast);
+	vfree(st->marks);
+	vfree(st->after.ast);
+	vfree(st->after.marks);
+	vfree(st->types);
+	vfree(st->fieldstack);
+	toks_free(&st->toks);
+	vfree(st->exprs);
+	vfree(st->args);
+	vfree(st->walk);
+	vfree(st->binds);
+	vfree(st->bound);
+	vfree(st->scopes);
+	if(st->lines) vfree(st->lines);
+	arena_free(&st->arena);
+	free(st);
+}
+
+_Static_assert(TT_ERROR <= UINT8_MAX, "token types have to fit in RS_TokList.tt");
+
+// Moves the tree's token indices over by `shift`
+static void shift_expr(struct RS_ParserState* st, RS_Expr* ex, i64 shift) {
+	if(ex) vpush(st->walk, ex);
+	while(vlen(st->walk)) {
+		RS_Expr* at = *vlast(st->walk);
+		vpop(st->walk);
+		at->tok += shift;
+		if(at->type == EX_CALL) {
+			vpush(st->walk, at->func);
+			if(at->args) vfor(at->args, arg) vpush(st->walk, *arg);
+		}
+		else if(at->type != EX_VAR) for(u32 i = 0; i < 3; i ++) if(at->params[i]) vpush(st->walk, at->params[i]);
+	}
+}
+
+static void shift_stmts(struct RS_ParserState* st, RS_Stmt* stmts, u32 n, i64 shift) {
+	for(RS_Stmt* stmt = stmts; stmt < stmts + n; stmt ++) switch(stmt->type) {
+		case ST_EXPR: case ST_RETURN: shift_expr(st, stmt->expr, shift); break;
+		case ST_IF: case ST_ELSE: case ST_WHILE: shift_expr(st, stmt->cond, shift); break;
+		case ST_DECLARE: shift_expr(st, stmt->var->value, shift); break;
+		default: break;
+	}
+}
+
+/*
+ * Lexes up to the end of the statement at `st->ind`, plus TOK_LOOKAHEAD more tokens since errors peek ahead. The tree
+ * holds tokens by index, so this can happen anywhere tokens run out: between statements, in types and while recovering.
+ * Returns false if the tokenizer errored.
+ */
+#define TOK_LOOKAHEAD 2
+static bool pull(struct RS_ParserState* st) {
+	u8* tt;
+	#define ended() (vlen(st->toks.tt) && ((tt = vlast(st->toks.tt)), *tt == TT_EOF || *tt == TT_ERROR))
+	// After a reparse, what's past the gap is already lexed
+	#define more() (vlen(st->toks.after.tt) ? toks_seek(&st->toks, vlen(st->toks.tt) + 1) \
+		: toks_push(&st->toks, tok_next(st->lex)))
+
+	for(u32 i = st->ind;; i ++) {
+		if(i >= vlen(st->toks.tt)) {
+			if(ended()) break;
+			more();
+		}
+		RS_TokenType type = st->toks.tt[i];
+		if(type == TT_ERROR) return false;
+		if(type == TT_PSEMICOLON || type == TT_EOF) break;
+	}
+	for(u32 n = 0; n < TOK_LOOKAHEAD && !ended(); n ++) more();
+
+	#undef ended
+	#undef more
+	return true;
+}
+
+// Taken before a statement parses, so parsing again from it starts from the same counts, whatever the statement reports
+static inline struct RS_StmtMark mark(struct RS_ParserState* st) {
+	return (struct RS_StmtMark) {
+		.tok = st->ind, .errors = st->errors, .warnings = st->warnings, .binds = vlen(st->binds), .depth = vlen(st->scopes),
+	};
+}
+
+// A statement that parsed, every one pushed also gets its mark
+static void push_stmt(struct RS_ParserState* st, RS_Stmt stmt, struct RS_StmtMark mark) {
+	vpush(st->ast, stmt);
+	vpush(st->marks, mark);
+}
+
+// Blocks still open at the end all get closed, with one error for the lot
+static void end_file(struct RS_ParserState* st) {
+	push_stmt(st, (RS_Stmt) { .type = ST_EOF }, mark(st));
+	if(!vlen(st->scopes)) return;
+	error("Expected a closing brace before the end of the file");
+	while(vlen(st->scopes)) leave(st);
+}
+
+/*
+ * Scopes are one stack of bindings shared by every block, plus `bound`, which has every symbol's innermost binding.
+ * Declaring pushes a binding that remembers what it shadowed, closing a block pops its bindings and puts those back,
+ * so resolving a name is one lookup of its symbol no matter how deep the blocks go.
+ */
+static struct RS_Variable* lookup(struct RS_ParserState* st, char* name) {
+	if(!vlen(st->binds)) return NULL;
+	u32* sym = hgets(st->symbols, name);
+	if(!sym || !st->bound[*sym]) return NULL;
+	return st->binds[st->bound[*sym] - 1].var;
+}
+
+static u32 intern(struct RS_ParserState* st, char* name) {
+	u32* sym = hgets(st->symbols, name);
+	if(sym) return *sym;
+	u32 id = st->symbols.n;
+	hsets(st->symbols, name) = id;
+	vpush(st->bound, 0);
+	return id;
+}
+
+static void bind(struct RS_ParserState* st, struct RS_Variable* var) {
+	var->sym = intern(st, var->vname);
+	var->depth = vlen(st->scopes);
+	var->slot = vlen(st->binds) - (var->depth ? st->scopes[0] : 0);
+	vpush(st->binds, { .var = var, .shadows = st->bound[var->sym] });
+	st->bound[var->sym] = vlen(st->binds);
+}
+
+static void enter(struct RS_ParserState* st) {
+	vpush(st->scopes, vlen(st->binds));
+}
+
+static void leave(struct RS_ParserState* st) {
+	u32 from = *vlast(st->scopes);
+	while(vlen(st->binds) > from) {
+		struct RS_Binding* b = vlast(st->binds);
+		st->bound[b->var->sym] = b->shadows;
+		vpop(st->binds);
+	}
+	vpop(st->scopes);
+}
+
+/*
+ * Panic mode: after an error, the rest of the statement gets skipped up to a token a statement can end or start with, so
+ * one mistake makes one diagnostic. Always moves past `start`, and never looks at a token twice, so a file full of errors
+ * still only costs one pass. What errored can have read past the semicolon `pull` stopped at, a record type's fields
+ * end lines too, so this lexes more when it runs out.
+ */
+static void recover(struct RS_ParserState* st, u32 start) {
+	if(st->ind <= start) st->ind = start + 1;
+	for(;; st->ind ++) {
+		if(st->ind >= vlen(st->toks.tt)) pull(st);
+		RS_TokenType type = st->toks.tt[st->ind];
+		if(type == TT_PSEMICOLON) { st->ind ++; return; }
+		if(type == TT_EOF || type == TT_ERROR || type == TT_POPENCBR || type == TT_PCLOSECBR || iskeyword(type)) return;
+	}
 }
 
 static void parse_stmt(struct RS_ParserState* st) {
-	switch(st->toks[st->ind++].type) {
-		case TT_PSEMICOLON: return;
-		case TT_KRETURN:
-			vpush(st->ast, { .type = ST_RETURN, .ret = parse_expr(st, 0) });
+	struct RS_StmtMark at = mark(st);
+	u32 start = st->ind;
+	RS_Stmt stmt;
+	switch(st->toks.tt[st->ind++]) {
+		case TT_PSEMICOLON:
+			if(st->toks.len[start]) { // Inserted ones have no length
+				st->warnings ++;
+				warning_at(st->src, &st->lines, st->toks.place[start], st->file, "Extra semicolon");
+			}
 			return;
+		case TT_KRETURN:
+			stmt = (RS_Stmt) { .type = ST_RETURN, .ret = parse_expr(st) };
+			break;
 		case TT_KLET:
-			
+		case TT_KCONST: {
+			u32 name = expect(st, TT_IDENT);
+			char* vname = name != RS_NONE ? toks_data(&st->toks, name) : NULL;
+			u32 declared = RS_NONE;
+			if(vname && st->toks.tt[st->ind] == TT_PCOLON) {
+				st->ind ++;
+				declared = parse_type(st);
+				if(declared == RS_NONE) vname = NULL;
+				else pull(st); // The value's past the semicolons a record's fields ended on, which is where pulling stopped
+			}
+			if(!vname || expect(st, TT_OPSET) == RS_NONE) {
+				recover(st, start);
+				return;
+			}
+			RS_Expr* value = parse_expr(st);
+			struct RS_Variable* var = NULL;
+			if(value) {
+				var = arena_alloc(&st->arena, sizeof(struct RS_Variable));
+				*var = (struct RS_Variable) {
+					.vcons = st->toks.tt[start] == TT_KCONST, .vname = vname, .value = value, .type = declared,
+				};
+			}
+			stmt = (RS_Stmt) { .type = ST_DECLARE, .var = var };
+			break;
+		}
+		case TT_POPENCBR:
+			enter(st);
+			return;
+		case TT_PCLOSECBR:
+			if(vlen(st->scopes)) leave(st);
+			else {
+				st->ind = start;
+				error("Unmatched closing brace");
+				st->ind ++;
+			}
 			return;
 		default:
 			st->ind--;
-			vpush(st->ast, { .type = ST_EXPR, .expr = parse_expr(st, 0) });
-			return;
+			stmt = (RS_Stmt) { .type = ST_EXPR, .expr = parse_expr(st) };
+			break;
+	}
+
+	if(!stmt.expr) {
+		recover(st, start);
+		return;
 	}
+	// Lines starting with a brace carry on the last one for the likes of `fn f()`, a block on its own ends the statement
+	RS_TokenType next = st->toks.tt[st->ind];
+	if(next != TT_PSEMICOLON && next != TT_EOF && next != TT_PCLOSECBR && !(next == TT_POPENCBR && toks_nl(&st->toks, st->ind))) {
+		error("Expected a semicolon after the statement (got %s)", toktostr[next]);
+		recover(st, start);
+		return;
+	}
+	if(next == TT_PSEMICOLON) st->ind ++;
+	if(stmt.type == ST_DECLARE) stmt.var->type = stmt.var->type == RS_NONE ? settle(st, stmt.var->value) : assign(st, stmt.var->type, stmt.var->value);
+	else settle(st, stmt.expr);
+	push_stmt(st, stmt, at);
+	if(stmt.type == ST_DECLARE) bind(st, stmt.var); // Only from the next statement on
 }
 
-struct {
-	enum RS_OpClass prec[3];
-	bool right_assoc;
-} precedences[] = {
-	[TT_OPADD]     = { { OC_FORBIDDEN, OC_ADD,       OC_FORBIDDEN } },
-	[TT_OPSUB]     = { { OC_UNARY,     OC_ADD,       OC_FORBIDDEN } },
-	[TT_OPMUL]     = { { OC_FORBIDDEN, OC_MUL,       OC_FORBIDDEN } },
-	[TT_OPDIV]     = { { OC_FORBIDDEN, OC_MUL,       OC_FORBIDDEN } },
-	[TT_OPMOD]     = { { OC_FORBIDDEN, OC_MUL,       OC_FORBIDDEN } },
-	[TT_OPPOW]     = { { OC_FORBIDDEN, OC_POW,       OC_FORBIDDEN }, true },
-	[TT_OPBXOR]    = { { OC_FORBIDDEN, OC_BIT,       OC_FORBIDDEN } },
-	[TT_OPBOR]     = { { OC_FORBIDDEN, OC_BIT,       OC_FORBIDDEN } },
-	[TT_OPBAND]    = { { OC_FORBIDDEN, OC_BIT,       OC_FORBIDDEN } },
-	[TT_OPBSHR]    = { { OC_FORBIDDEN, OC_BIT,       OC_FORBIDDEN } },
-	[TT_OPBSHL]    = { { OC_FORBIDDEN, OC_BIT,       OC_FORBIDDEN } },
-	[TT_OPSET]     = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPADDSET]  = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPSUBSET]  = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPMULSET]  = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPDIVSET]  = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPMODSET]  = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPPOWSET]  = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPBXORSET] = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPBORSET]  = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPBANDSET] = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPBSHRSET] = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPBSHLSET] = { { OC_FORBIDDEN, OC_ASSIGN,    OC_FORBIDDEN } },
-	[TT_OPDOT]     = { { OC_FORBIDDEN, OC_POSTFIX,   OC_FORBIDDEN } },
-	[TT_OPQUESDOT] = { { OC_FORBIDDEN, OC_POSTFIX,   OC_FORBIDDEN } },
-	[TT_OPQUES]    = { { OC_FORBIDDEN, OC_TERTIARY,  OC_FORBIDDEN } },
-	[TT_OPINCR]    = { { OC_FORBIDDEN, OC_POSTFIX,   OC_FORBIDDEN } },
-	[TT_OPDECR]    = { { OC_FORBIDDEN, OC_POSTFIX,   OC_FORBIDDEN } },
-
-	[TT_POPENPAR]  = { { OC_PAREN,     OC_FORBIDDEN, OC_FORBIDDEN } },
-
-	[TT_LNOT]      = { { OC_FORBIDDEN, OC_UNARY,     OC_FORBIDDEN } },
-	[TT_LOR]       = { { OC_FORBIDDEN, OC_UNARY,     OC_FORBIDDEN } },
-	[TT_LAND]      = { { OC_FORBIDDEN, OC_UNARY,     OC_FORBIDDEN } },
-	// [TT_PCOLON] = { { OC_FORBIDDEN, OC_TERTIARY,  OC_FORBIDDEN } },
-	[TT_ERROR]     = { { OC_FORBIDDEN, OC_FORBIDDEN, OC_FORBIDDEN } }, // Just to extend the array size to accomodate all tokens
-};
+/*
+ * What class every operator is in front of an operand and after one, and whether it groups to the right. The binding
+ * powers parse_expr actually works with are generated from this list at compile time, so it's the only place to touch
+ * when adding an operator.
+ */
+#define PRECEDENCES(X) \
+	/* token         prefix        infix/postfix  right_assoc */ \
+	X(TT_OPADD,      OC_UNARY,     OC_ADD,        false) \
+	X(TT_OPSUB,      OC_UNARY,     OC_ADD,        false) \
+	X(TT_OPMUL,      OC_FORBIDDEN, OC_MUL,        false) \
+	X(TT_OPDIV,      OC_FORBIDDEN, OC_MUL,        false) \
+	X(TT_OPMOD,      OC_FORBIDDEN, OC_MUL,        false) \
+	X(TT_OPPOW,      OC_FORBIDDEN, OC_POW,        true)  \
+	X(TT_OPBXOR,     OC_FORBIDDEN, OC_BIT,        false) \
+	X(TT_OPBOR,      OC_FORBIDDEN, OC_BIT,        false) \
+	X(TT_OPBAND,     OC_FORBIDDEN, OC_BIT,        false) \
+	X(TT_OPBSHR,     OC_FORBIDDEN, OC_BIT,        false) \
+	X(TT_OPBSHL,     OC_FORBIDDEN, OC_BIT,        false) \
+	X(TT_OPSET,      OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPADDSET,   OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPSUBSET,   OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPMULSET,   OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPDIVSET,   OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPMODSET,   OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPPOWSET,   OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPBXORSET,  OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPBORSET,   OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPBANDSET,  OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPBSHRSET,  OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPBSHLSET,  OC_FORBIDDEN, OC_ASSIGN,     true)  \
+	X(TT_OPBNOT,     OC_UNARY,     OC_FORBIDDEN,  false) \
+	X(TT_OPDOT,      OC_FORBIDDEN, OC_POSTFIX,    false) \
+	X(TT_OPQUESDOT,  OC_FORBIDDEN, OC_POSTFIX,    false) \
+	X(TT_OPQUES,     OC_FORBIDDEN, OC_TERTIARY,   true)  \
+	X(TT_OPINCR,     OC_UNARY,     OC_POSTFIX,    false) \
+	X(TT_OPDECR,     OC_UNARY,     OC_POSTFIX,    false) \
+	X(TT_POPENPAR,   OC_PAREN,     OC_POSTFIX,    false) /* Grouping, and calls */ \
+	X(TT_LNOT,       OC_UNARY,     OC_FORBIDDEN,  false) \
+	X(TT_LOR,        OC_FORBIDDEN, OC_UNARY,      false) \
+	X(TT_LAND,       OC_FORBIDDEN, OC_UNARY,      false)
+
+// Tighter classes bind harder. Powers are even so a right associative operator can let its own kind bind one lower.
+#define BP(oc) ((oc) ? 2 * (OC_PAREN - (oc)) : 0)
+#define BINDING(tok, prefix, infix, rassoc) [tok] = { BP(prefix), BP(infix), BP(infix) - (rassoc) },
+
+static const struct {
+	u8 prefix; // 0 if it can't start an operand
+	u8 left;   // How hard it pulls on the operand before it, 0 if it isn't an infix or postfix operator
+	u8 right;  // Operators that don't pull harder than this end the operand after it
+} binding[TT_ERROR + 1] = { PRECEDENCES(BINDING) };
+
+#undef BINDING
+
+// Call arguments are frozen into an arena vec once the call closes, so nothing about a tree needs freeing by itself
+static RS_Expr** arena_args(struct RS_ParserState* st, u32 from) {
+	u32 n = vlen(st->args) - from;
+	struct vecdata_* v = arena_alloc(&st->arena, sizeof(struct vecdata_) + n * sizeof(RS_Expr*));
+	*v = (struct vecdata_) { .used = n * sizeof(RS_Expr*), .cap = n * sizeof(RS_Expr*), .alloc = &st->arena.alloc };
+	memcpy(v->data, st->args + from, n * sizeof(RS_Expr*));
+	vpopto(st->args, from);
+	return (RS_Expr**) v->data;
+}
 
 /*
- * Parsing algorithm made using unrolled Recursive Descent Parsing
- * Example: 1 + 1
- *      EX_REG… --→  +
- *             ┌─────┴─────┐
- * EX_PRIM --→ 1           1
- *
+ * Pratt parser, with the recursion for each operand turned into an explicit stack so nesting is only bounded by memory.
+ * Every token gets looked at once and every frame gets pushed and popped once, so it's linear in the expression.
  * Example: 1 + 1 * -2 * (3 + 4)
  *         +
  *     ┌───┴───┐
@@ -137,154 +569,500 @@ struct {
  *       1   -   3   4
  *           |
  *           2
+ * Prefix operators have their operand in params[0] and paramnum 0, binary and postfix ones have paramnum 1. The
+ * ternary has all three params. Parentheses only group, they don't make a node.
  */
-static RS_Expr* parse_expr(struct RS_ParserState* st, enum RS_OpClass highest) {
-	int parens = 0;
-	int depth = 0;
-	static RS_Expr* curexpr[1000] = {};
-
-primary:
-	curexpr[depth] = new_expr(&(RS_Expr) {});
-	curexpr[depth]->tok = st->toks + st->ind;
-	if(depth) curexpr[depth - 1]->params[curexpr[depth - 1]->paramnum] = curexpr[depth];
-	switch(st->toks[st->ind++].type) {
-	case TT_IDENT:
+static RS_Expr* parse_expr(struct RS_ParserState* st) {
+	RS_Expr* lhs;
+	RS_TokenType type;
+	u32 tok;
+	u32 base = vlen(st->exprs), argbase = vlen(st->args);
+	#define push(...) (*(struct RS_ExprFrame*) vprealloc(st->exprs, 1) = (struct RS_ExprFrame) { __VA_ARGS__ })
+	#define fail(...) do { error(__VA_ARGS__); vpopto(st->exprs, base); vpopto(st->args, argbase); return NULL; } while(0)
+
+operand:
+	type = st->toks.tt[st->ind];
+	tok = st->ind++;
+	switch(type) {
+	case TT_IDENT: {
+		struct RS_Variable* var = lookup(st, toks_data(&st->toks, tok));
+		if(var) lhs = new_expr(st, &(RS_Expr) { .type = EX_VAR, .tok = tok, .var = var });
+		else lhs = new_expr(st, &(RS_Expr) { .type = EX_PRIM, .tok = tok });
+		parse_check(st, lhs);
+		break;
+	}
 	case TT_FLOAT:
 	case TT_STRING:
 	case TT_INT:
-		curexpr[depth]->type = EX_PRIM;
+		lhs = new_expr(st, &(RS_Expr) { .type = EX_PRIM, .tok = tok });
+		parse_check(st, lhs);
 		break;
 	case TT_POPENPAR:
-		parens ++;
-	case TT_OPBNOT:
-	case TT_OPSUB:
-	case TT_OPADD:
-		curexpr[depth]->type = EX_REGULAR;
-		depth ++;
-		curexpr[depth] = new_expr(&(RS_Expr) {});
-		curexpr[depth - 1]->params[0] = curexpr[depth];
-		goto primary;
+		push(.bp = 0);
+		goto operand;
 	case TT_PSEMICOLON:
 	case TT_EOF:
 	case TT_PCLOSEPAR:
-		error("Expected an expression here (got %s) (debug: resolving %s)", toktostr[st->toks[st->ind - 1].type], toktostr[curexpr[depth - 1]->tok->type]);
-		return NULL;
-	default: error("Unexpected token(got %s)", toktostr[st->toks[st->ind - 1].type]); return NULL;
+		st->ind --; // Might be where the statement ends, which recovery still needs to see
+		fail("Expected an expression here (got %s)", toktostr[type]);
+	default:
+		if(!binding[type].prefix) {
+			st->ind --;
+			fail("Unexpected token (got %s)", toktostr[type]);
+		}
+		push(.ex = new_expr(st, &(RS_Expr) { .type = EX_REGULAR, .tok = tok }), .bp = binding[type].prefix);
+		goto operand;
 	}
 
-	RS_Token* op = st->toks + st->ind;
-
-detectparens:
-	if (op->type == TT_PSEMICOLON ||
-			op->type == TT_EOF) {
-		
-		if(parens) {
-			error("Statement ended in the middle of an expression.");
-			return NULL;
+infix:
+	type = st->toks.tt[st->ind];
+	tok = st->ind;
+	if(binding[type].left > (vlen(st->exprs) > base ? vlast(st->exprs)->bp : 0)) {
+		st->ind ++;
+		RS_Expr* ex = new_expr(st, &(RS_Expr) { .type = EX_REGULAR, .tok = tok, .paramnum = 1, .params = { lhs } });
+		switch(type) {
+		case TT_OPINCR:
+		case TT_OPDECR:
+			parse_check(st, ex);
+			lhs = ex;
+			goto infix;
+		case TT_OPDOT:
+		case TT_OPQUESDOT:
+			if(st->toks.tt[st->ind] != TT_IDENT) fail("Expected a field name after %s", toktostr[type]);
+			ex->params[1] = new_expr(st, &(RS_Expr) { .type = EX_PRIM, .tok = st->ind++ });
+			parse_check(st, ex);
+			lhs = ex;
+			goto infix;
+		case TT_POPENPAR:
+			*ex = (RS_Expr) { .type = EX_CALL, .tok = tok, .func = lhs };
+			if(st->toks.tt[st->ind] == TT_PCLOSEPAR) {
+				st->ind ++;
+				ex->args = arena_args(st, vlen(st->args));
+				parse_check(st, ex);
+				lhs = ex;
+				goto infix;
+			}
+			push(.ex = ex, .args = vlen(st->args), .bp = 0);
+			goto operand;
+		case TT_OPQUES:
+			push(.ex = ex, .bp = 0); // The middle runs up to the colon
+			goto operand;
+		default:
+			push(.ex = ex, .bp = binding[type].right);
+			goto operand;
 		}
+	}
 
-		return curexpr[0];
-	} else if (op->type == TT_PCLOSEPAR) {
-		if(parens) {
-
-			while(depth > 1 && curexpr[depth - 1]->tok->type != TT_POPENPAR) depth --;
-			depth --;
-			parens --;
-			op = st->toks + ++st->ind;
-			
-			if(depth > 0)
-				curexpr[depth - 1]->params[curexpr[depth - 1]->paramnum] = curexpr[depth]->params[0];
-			
-			goto detectparens;
-		}
-		
-		error("Unexpected closing parenthesis");
-		return NULL;
+	// Nothing pulls on `lhs` harder than the innermost unfinished operator, so it gets finished
+	if(vlen(st->exprs) == base) return lhs;
+	struct RS_ExprFrame* top = vlast(st->exprs);
+	RS_Expr* ex = top->ex;
+	if(!ex) {
+		if(type == TT_PSEMICOLON || type == TT_EOF) fail("Statement ended in the middle of an expression.");
+		if(type != TT_PCLOSEPAR) fail("Expected a closing parenthesis (got %s)", toktostr[type]);
+		st->ind ++;
+	} else if(ex->type == EX_CALL) {
+		vpush(st->args, lhs);
+		if(type == TT_PCOMMA) { st->ind ++; goto operand; }
+		if(type != TT_PCLOSEPAR) fail("Expected a comma or closing parenthesis after an argument (got %s)", toktostr[type]);
+		st->ind ++;
+		ex->args = arena_args(st, top->args);
+		parse_check(st, ex);
+		lhs = ex;
+	} else if(st->toks.tt[ex->tok] == TT_OPQUES && !ex->params[1]) {
+		if(type != TT_PCOLON) fail("Expected the colon of a ?: (got %s)", toktostr[type]);
+		st->ind ++;
+		ex->params[1] = lhs;
+		top->bp = binding[TT_OPQUES].right;
+		goto operand;
+	} else {
+		ex->params[st->toks.tt[ex->tok] == TT_OPQUES ? 2 : ex->paramnum] = lhs;
+		parse_check(st, ex);
+		lhs = ex;
 	}
+	vpop(st->exprs);
+	goto infix;
 
-	// if(highest && precedences[op->type].prec[1] > highest) {
-	// 	st->ind--;
-	// 	return curexpr[0];
-	// }
+	#undef push
+	#undef fail
+}
 
-	// Go up the operator hierarchy chain, and swap the operator that has the higher precedence with the one that has lower precedence
-	if(precedences[op->type].prec[1]) {
-		st->ind++;
+// A node flatten_expr is in, and which of its children it goes down next
+struct RS_FlatFrame {
+	RS_Expr* ex;
+	u32 child;
+};
 
-		RS_Expr* opexpr = new_expr(&(RS_Expr) {
-			.type = EX_REGULAR,
-			.tok = op,
-			.paramnum = 1,
-		});
+// The node's children in order: a call's function then its arguments, everyone else's params
+static inline u32 children(RS_Expr* ex) {
+	if(ex->type == EX_CALL) return 1 + (ex->args ? vlen(ex->args) : 0);
+	return ex->type == EX_VAR ? 0 : 3;
+}
+
+static inline RS_Expr* child(RS_Expr* ex, u32 i) {
+	if(ex->type == EX_CALL) return i ? ex->args[i - 1] : ex->func;
+	return ex->params[i];
+}
 
+/*
+ * Children first, then the node itself, off explicit stacks since trees can nest as deep as they're long. A finished
+ * node leaves its index on `done`, so a node's children are the last few there once it gets back to it. Returns where
+ * the root ended up.
+ */
+static u32 flatten_expr(RS_FlatAST* ast, RS_Expr* root, struct RS_FlatFrame** stack, u32** done) {
+	if(!root) return RS_NONE;
+	vpush(*stack, { .ex = root });
+	while(vlen(*stack)) {
+		struct RS_FlatFrame* top = vlast(*stack);
+		RS_Expr* ex = top->ex;
+		u32 n = children(ex);
+		if(top->child < n) {
+			RS_Expr* next = child(ex, top->child ++);
+			if(next) vpush(*stack, { .ex = next });
+			else vpush(*done, RS_NONE);
+			continue;
+		}
+		vpop(*stack);
 
-		// If the operator is of a higher order than the current top operator, make it the new top operator
-		if(!depth || (!parens && precedences[curexpr[0]->tok->type].prec[curexpr[0]->paramnum] <= precedences[op->type].prec[curexpr[0]->paramnum])) {
-			opexpr->params[0] = curexpr[0];
-			depth = 1;
-			curexpr[0] = opexpr;
-			goto primary;
+		RS_FlatExpr node;
+		memset(&node, 0, sizeof(node)); // Padding included, the AST cache writes these out byte for byte
+		node.tok = ex->tok;
+		node.type = ex->type;
+		node.paramnum = ex->paramnum;
+		node.ty = ex->ty;
+		u32* params = *done + vlen(*done) - n;
+		if(ex->type == EX_CALL) {
+			node.params[0] = params[0];
+			node.params[1] = vlen(ast->args);
+			node.params[2] = n - 1;
+			if(n > 1) memcpy(vprealloc(ast->args, n - 1), params + 1, (n - 1) * sizeof(u32));
 		}
+		else if(ex->type == EX_VAR) node.params[0] = ex->var->depth, node.params[1] = ex->var->slot, node.params[2] = RS_NONE;
+		else memcpy(node.params, params, sizeof(node.params));
+		vpopn(*done, n);
+
+		memcpy(vprealloc(ast->nodes, 1), &node, sizeof(node));
+		vpush(*done, vlen(ast->nodes) - 1);
+	}
+	u32 at = **done;
+	vpop(*done);
+	return at;
+}
 
-		// Already checked curexpr[0]
-		while(depth > 1 &&
-					precedences[curexpr[depth - 1]->tok->type].prec[curexpr[depth - 1]->paramnum] &&
-					precedences[curexpr[depth - 1]->tok->type].prec[curexpr[depth - 1]->paramnum] <= precedences[op->type].prec[curexpr[depth - 1]->paramnum])
-			depth --;
-		
-		opexpr->params[0] = curexpr[depth - 1]->params[curexpr[depth - 1]->paramnum];
-		curexpr[depth - 1]->params[curexpr[depth - 1]->paramnum] = opexpr;
-
-		curexpr[depth++] = opexpr;
-		goto primary;
+RS_FlatAST flatten(struct RS_ParserState* st) {
+	close_gap(st);
+	RS_FlatAST ast = { .stmts = vnew(), .nodes = vnew(), .args = vnew() };
+	struct RS_FlatFrame* stack = vnew();
+	u32* done = vnew();
+	vreserve(ast.stmts, vlen(st->ast)); // One each
+	vfor(st->ast, stmt) {
+		RS_Expr* ex = NULL;
+		switch(stmt->type) {
+			case ST_EXPR: case ST_RETURN: ex = stmt->expr; break;
+			case ST_IF: case ST_ELSE: case ST_WHILE: ex = stmt->cond; break;
+			case ST_DECLARE: ex = stmt->var->value; break;
+			default: break;
+		}
+		RS_FlatStmt flat = {
+			.type = stmt->type, .expr = flatten_expr(&ast, ex, &stack, &done), .depth = RS_NONE, .slot = RS_NONE,
+		};
+		if(stmt->type == ST_DECLARE) flat.depth = stmt->var->depth, flat.slot = stmt->var->slot;
+		vpush_unsafe(ast.stmts, flat);
 	}
+	vfree(stack);
+	vfree(done);
+	return ast;
+}
 
-	return curexpr[0];
+void free_flat(RS_FlatAST* ast) {
+	vfree(ast->stmts);
+	vfree(ast->nodes);
+	vfree(ast->args);
 }
 
 // Prints out the tree for the expression.
-void debug_expr(RS_Expr* ex) {
+void debug_expr(struct RS_ParserState* st, RS_Expr* ex) {
 	if(!ex) return;
 	if(ex->type == EX_REGULAR) {
 		if(!ex->params[1]) {
-			printf("(%s ", toktostr[ex->tok->type]);
-			debug_expr(ex->params[0]);
+			printf("(%s ", toktostr[st->toks.tt[ex->tok]]);
+			debug_expr(st, ex->params[0]);
 			printf(")");
 			return;
 		}
 		printf("(");
-		debug_expr(ex->params[0]);
-		printf(" %s ", toktostr[ex->tok->type]);
-		debug_expr(ex->params[1]);
+		debug_expr(st, ex->params[0]);
+		printf(" %s ", toktostr[st->toks.tt[ex->tok]]);
+		debug_expr(st, ex->params[1]);
 		printf(")");
 	} else {
-		printf("%lld", ex->tok->intv);
+		printf("%lld", toks_val(&st->toks, ex->tok).intv);
+	}
+}
+
+// Type errors point at the start of the node's token, the parser's long past it by then
+#define error_on(ex, ...) (st->errors ++, error_at(st->src, &st->lines, st->toks.place[(ex)->tok] - st->toks.len[(ex)->tok], st->file, __VA_ARGS__))
+
+static u32 intern_type(struct RS_ParserState* st, RS_Type ty) {
+	u32* id = hget(st->typeids, ty);
+	if(id) return *id;
+	*(RS_Type*) vprealloc(st->types, 1) = ty;
+	hset(st->typeids, ty) = vlen(st->types) - 1;
+	return vlen(st->types) - 1;
+}
+
+// The types that are their own kind, so their ids can be written down as constants
+static void init_types(struct RS_ParserState* st) {
+	for(RS_TypeT kind = TY_UNKNOWN; kind <= TY_FLOATLIT; kind ++)
+		intern_type(st, (RS_Type) { .kind = kind, .inner = RS_NONE, .name = RS_NONE, .field = RS_NONE });
+}
+
+static const char* tynames[] = {
+	[TY_UNKNOWN] = "something unknown",
+	[TY_U8] = "u8", [TY_U16] = "u16", [TY_U32] = "u32", [TY_U64] = "u64",
+	[TY_I8] = "i8", [TY_I16] = "i16", [TY_I32] = "i32", [TY_I64] = "i64",
+	[TY_F32] = "f32", [TY_F64] = "f64", [TY_BOOL] = "bool", [TY_STRING] = "string",
+	[TY_INTLIT] = "an integer", [TY_FLOATLIT] = "a float", [TY_PTR] = "a pointer", [TY_RECORD] = "a record",
+};
+#define tyname(id) tynames[st->types[id].kind]
+
+static inline bool isint(u32 ty) { return (ty >= TY_U8 && ty <= TY_I64) || ty == TY_INTLIT; }
+static inline bool isfloat(u32 ty) { return ty == TY_F32 || ty == TY_F64 || ty == TY_FLOATLIT; }
+
+// Whether a literal of type `lit` can just become a `ty`
+static inline bool fits(u32 lit, u32 ty) {
+	return (lit == TY_INTLIT && (isint(ty) || isfloat(ty))) || (lit == TY_FLOATLIT && isfloat(ty));
+}
+
+/*
+ * Gives `ex` the sized type `ty`, along with everything under it that still has its literal type, so the backend can
+ * pick widths off any node. A node only goes from literal to sized once (or from an integer to a float literal first),
+ * so this stays one step per node over the whole parse. Off a stack instead of recursing, chains nest as deep as
+ * they're long on either side.
+ */
+static u32 give(struct RS_ParserState* st, RS_Expr* ex, u32 ty) {
+	u32 lit = ex->ty;
+	vpush(st->walk, ex);
+	while(vlen(st->walk)) {
+		RS_Expr* at = *vlast(st->walk);
+		vpop(st->walk);
+		at->ty = ty;
+		if(at->type == EX_REGULAR)
+			for(u32 i = 0; i < 3; i ++) if(at->params[i] && at->params[i]->ty == lit) vpush(st->walk, at->params[i]);
 	}
+	return ty;
 }
 
-// Checks types and assigns them to the expression.
+// What `a` and `b` have to both be for `at` to work on them. A literal takes the other side's type.
+static u32 unify(struct RS_ParserState* st, RS_Expr* at, RS_Expr* a, RS_Expr* b) {
+	if(a->ty == b->ty) return a->ty;
+	if(a->ty == TY_UNKNOWN || b->ty == TY_UNKNOWN) return TY_UNKNOWN;
+	if(fits(a->ty, b->ty)) return give(st, a, b->ty);
+	if(fits(b->ty, a->ty)) return give(st, b, a->ty);
+	error_on(at, "Mismatched types %s and %s", tyname(a->ty), tyname(b->ty));
+	return TY_UNKNOWN;
+}
+
+// Same, but `value` is the only side that can give
+static u32 assign(struct RS_ParserState* st, u32 to, RS_Expr* value) {
+	if(value->ty == to || to == TY_UNKNOWN || value->ty == TY_UNKNOWN) return to;
+	if(fits(value->ty, to)) return give(st, value, to);
+	error_on(value, "Can't use %s as %s", tyname(value->ty), tyname(to));
+	return TY_UNKNOWN;
+}
+
+// Literals nothing gave a size to get the default one, along with whatever they were worked out of
+static u32 settle(struct RS_ParserState* st, RS_Expr* ex) {
+	if(ex->ty != TY_INTLIT && ex->ty != TY_FLOATLIT) return ex->ty;
+	return give(st, ex, ex->ty == TY_INTLIT ? TY_I64 : TY_F64);
+}
+
+#define want(ok, ex, what) ((ok) || (ex)->ty == TY_UNKNOWN || (error_on(ex, "Expected " what " (got %s)", tyname((ex)->ty)), false))
+
+/*
+ * Gives `ex` its type. parse_expr calls this on every node as it finishes it, so the operands already have theirs and
+ * checking is one step per node, with no walk over the tree afterwards.
+ */
 static void parse_check(struct RS_ParserState* st, RS_Expr* ex) {
+	switch(ex->type) {
+		case EX_PRIM:
+			switch(st->toks.tt[ex->tok]) {
+				case TT_INT: ex->ty = TY_INTLIT; break;
+				case TT_FLOAT: ex->ty = TY_FLOATLIT; break;
+				case TT_STRING: ex->ty = TY_STRING; break;
+				default: ex->ty = TY_UNKNOWN; break;
+			}
+			return;
+		case EX_VAR: ex->ty = ex->var->type; return;
+		case EX_CALL: ex->ty = TY_UNKNOWN; return; // Nothing has a function type yet
+		default: break;
+	}
+
+	RS_Expr* a = ex->params[0], * b = ex->params[1];
+	RS_TokenType op = st->toks.tt[ex->tok];
+	ex->ty = TY_UNKNOWN;
+	switch(op) {
+		case TT_OPDOT:
+		case TT_OPQUESDOT: {
+			b->ty = TY_UNKNOWN;
+			if(a->ty == TY_UNKNOWN) return;
+			u32* sym = hgets(st->symbols, toks_data(&st->toks, b->tok));
+			u32* field = sym && st->types[a->ty].kind == TY_RECORD ? hget(st->fields, (u64) { (u64) a->ty << 32 | *sym }) : NULL;
+			if(field) ex->ty = b->ty = *field;
+			else error_on(b, "No field %s in %s", toks_data(&st->toks, b->tok), tyname(a->ty));
+			return;
+		}
+		case TT_OPQUES:
+			want(a->ty == TY_BOOL, a, "a bool");
+			ex->ty = unify(st, ex, b, ex->params[2]);
+			return;
+		case TT_LNOT:
+			if(want(a->ty == TY_BOOL, a, "a bool")) ex->ty = TY_BOOL;
+			return;
+		case TT_LAND:
+		case TT_LOR: {
+			// Both sides get checked, left first, so each reports its own error
+			bool left = want(a->ty == TY_BOOL, a, "a bool");
+			bool right = want(b->ty == TY_BOOL, b, "a bool");
+			if(left && right) ex->ty = TY_BOOL;
+			return;
+		}
+		case TT_OPBNOT:
+			if(want(isint(a->ty), a, "an integer")) ex->ty = a->ty;
+			return;
+		case TT_OPINCR:
+		case TT_OPDECR:
+			if(want(isint(a->ty) || isfloat(a->ty), a, "a number")) ex->ty = a->ty;
+			return;
+		case TT_OPBSHL:
+		case TT_OPBSHR: {
+			bool left = want(isint(a->ty), a, "an integer");
+			bool right = want(isint(b->ty), b, "an integer");
+			if(left && right) ex->ty = a->ty;
+			// The count doesn't meet the shifted side, so a literal one gets its own size here
+			if(a->ty != TY_INTLIT) settle(st, b);
+			return;
+		}
+		default: break;
+	}
+
+	// Assignments take the left side's type, the rest have both sides meet
+	bool sets = op == TT_OPSET || (op >= TT_OPADDSET && op <= TT_OPBSHLSET);
+	if(sets) {
+		bool constant = a->type == EX_VAR && a->var->vcons;
+		if(constant) error_on(a, "Can't assign to the constant %s", a->var->vname);
+		else if(a->type != EX_VAR && !(a->type == EX_PRIM && st->toks.tt[a->tok] == TT_IDENT) &&
+			!(a->type == EX_REGULAR && (st->toks.tt[a->tok] == TT_OPDOT || st->toks.tt[a->tok] == TT_OPQUESDOT)))
+			error_on(a, "Can only assign to a variable or field");
+		ex->ty = assign(st, a->ty, b);
+		if(op == TT_OPSET) return;
+	} else ex->ty = ex->paramnum ? unify(st, ex, a, b) : a->ty;
+
+	if(ex->ty == TY_UNKNOWN) return;
+	switch(op) {
+		case TT_OPADD: case TT_OPADDSET:
+			if(ex->paramnum && ex->ty == TY_STRING) return;
+			// fallthrough
+		case TT_OPSUB: case TT_OPMUL: case TT_OPDIV: case TT_OPMOD: case TT_OPPOW:
+		case TT_OPSUBSET: case TT_OPMULSET: case TT_OPDIVSET: case TT_OPMODSET: case TT_OPPOWSET:
+			if(!want(isint(ex->ty) || isfloat(ex->ty), ex, "numbers")) ex->ty = TY_UNKNOWN;
+			return;
+		default:
+			if(!want(isint(ex->ty), ex, "integers")) ex->ty = TY_UNKNOWN;
+			return;
+	}
 }
 
+#undef want
 
+static int by_symbol(const void* a, const void* b) {
+	u64 x = *(const u64*) a, y = *(const u64*) b;
+	return (x >> 32 > y >> 32) - (x >> 32 < y >> 32);
+}
 
-static RS_Type* parse_type(struct RS_ParserState* st) {
-	switch(st->toks[st->ind++].type) {
-		default: error("Unexpected token"); return NULL;
+/*
+ * `{ name: type, ... }`, commas or newlines between fields. Interning a record with k fields is k lookups plus sorting
+ * them, so big literal-shaped types cost about what reading them does. A record whose fields haven't been indexed yet
+ * gets them put in `fields` once.
+ */
+static u32 parse_record(struct RS_ParserState* st) {
+	u32 base = vlen(st->fieldstack);
+	for(;;) {
+		// Fields on their own lines end statements as far as pull knows
+		if(st->ind + TOK_LOOKAHEAD >= vlen(st->toks.tt)) pull(st);
+		if(st->toks.tt[st->ind] == TT_PCLOSECBR) { st->ind ++; break; }
+		u32 name = st->ind;
+		u32 field = expect(st, TT_IDENT) != RS_NONE && expect(st, TT_PCOLON) != RS_NONE ? parse_type(st) : RS_NONE;
+		if(field == RS_NONE) { vpopto(st->fieldstack, base); return RS_NONE; }
+		vpush(st->fieldstack, (u64) intern(st, toks_data(&st->toks, name)) << 32 | field);
+
+		RS_TokenType next = st->toks.tt[st->ind];
+		if(next == TT_PCOMMA || next == TT_PSEMICOLON) st->ind ++;
+		else if(next != TT_PCLOSECBR) {
+			error("Expected a comma or closing brace after a field (got %s)", toktostr[next]);
+			vpopto(st->fieldstack, base);
+			return RS_NONE;
+		}
 	}
+
+	u64* fields = st->fieldstack + base;
+	u32 n = vlen(st->fieldstack) - base;
+	qsort(fields, n, sizeof(u64), by_symbol);
+	u32 id = intern_type(st, (RS_Type) { .kind = TY_RECORD, .inner = RS_NONE, .name = RS_NONE, .field = RS_NONE });
+	for(u32 i = 0; i < n; i ++) {
+		if(i && fields[i] >> 32 == fields[i - 1] >> 32) {
+			st->ind --;
+			error("The same field is in the record twice");
+			st->ind ++;
+			vpopto(st->fieldstack, base);
+			return RS_NONE;
+		}
+		id = intern_type(st, (RS_Type) { .kind = TY_RECORD, .inner = id, .name = fields[i] >> 32, .field = (u32) fields[i] });
+	}
+	if(n && !hget(st->fields, (u64) { (u64) id << 32 | fields[0] >> 32 }))
+		for(u32 i = 0; i < n; i ++) hset(st->fields, (u64) { (u64) id << 32 | fields[i] >> 32 }) = (u32) fields[i];
+	vpopto(st->fieldstack, base);
+	return id;
 }
 
+static const u8 primtypes[TT_ERROR + 1] = {
+	[TT_TU8] = TY_U8, [TT_TU16] = TY_U16, [TT_TU32] = TY_U32, [TT_TU64] = TY_U64,
+	[TT_TI8] = TY_I8, [TT_TI16] = TY_I16, [TT_TI32] = TY_I32, [TT_TI64] = TY_I64,
+	[TT_TF32] = TY_F32, [TT_TF64] = TY_F64, [TT_TBOOL] = TY_BOOL, [TT_TSTRING] = TY_STRING,
+};
 
-static RS_Token* expect(struct RS_ParserState* st, enum RS_TokenType type) {
-	if(st->toks[st->ind].type != type) {
-		error("Expected %s, got %s", toktostr[type], toktostr[st->toks[st->ind].type]);
-		return NULL;
+// A type annotation, interned. RS_NONE after an error.
+static u32 parse_type(struct RS_ParserState* st) {
+	if(st->ind + TOK_LOOKAHEAD >= vlen(st->toks.tt)) pull(st); // Pointers and records can go on past what got pulled
+	RS_TokenType type = st->toks.tt[st->ind++];
+	if(primtypes[type]) return primtypes[type];
+	switch(type) {
+		case TT_OPMUL: {
+			u32 to = parse_type(st);
+			if(to == RS_NONE) return RS_NONE;
+			return intern_type(st, (RS_Type) { .kind = TY_PTR, .inner = to, .name = RS_NONE, .field = RS_NONE });
+		}
+		case TT_POPENCBR:
+			return parse_record(st);
+		default:
+			st->ind --;
+			error("Expected a type (got %s)", toktostr[type]);
+			return RS_NONE;
+	}
+}
+
+
+// Index of the token, RS_NONE if it isn't a `type`
+static u32 expect(struct RS_ParserState* st, enum RS_TokenType type) {
+	if(st->toks.tt[st->ind] != type) {
+		error("Expected %s, got %s", toktostr[type], toktostr[st->toks.tt[st->ind]]);
+		return RS_NONE;
 	}
-	return st->toks + st->ind++;
+	return st->ind++;
 }
 
 static RS_FuncArg* parse_funcarg(struct RS_ParserState* st) {
-	switch(st->toks[st->ind++].type) {
+	switch(st->toks.tt[st->ind++]) {
 		default: error("Unexpected token"); return NULL;
 	}
 }
@@ -1,24 +1,49 @@
 #pragma once
 #include "util.h"
 #include <hash.h>
+#include <vec.h>
 #include <stdbool.h>
 #include "tok.h"
+#include "arena.h"
 typedef struct RS_Stmt RS_Stmt;
 typedef struct RS_Type RS_Type;
 typedef struct RS_Expr RS_Expr;
 
 enum RS_TypeT {
+	TY_UNKNOWN, // Anything the checker can't see into yet (names that were never declared, calls), goes with everything
 	TY_U8, TY_U16, TY_U32, TY_U64,
 	TY_I8, TY_I16, TY_I32, TY_I64,
-	TY_BOOL
+	TY_F32, TY_F64,
+	TY_BOOL, TY_STRING,
+	TY_INTLIT, TY_FLOATLIT, // Literals, until they end up next to something that says what size they are
+	TY_PTR, TY_RECORD
 };
+typedef enum RS_TypeT RS_TypeT;
 
+/*
+ * Types are hash-consed into the parser's `types`, so each distinct type is there exactly once and two types are the same
+ * exactly when their ids are. Everything up to TY_FLOATLIT is its own id. A record is its last field on top of the
+ * record with the rest, with fields sorted by symbol, so field order doesn't make a new type.
+ */
 struct RS_Type {
-	bool isptr;
-	bool signedness;
+	RS_TypeT kind;
+	u32 inner; // TY_PTR: what it points to. TY_RECORD: the record without the last field, RS_NONE for {}
+	u32 name;  // TY_RECORD: symbol of the last field
+	u32 field; // TY_RECORD: its type
 };
 
-struct RS_FuncArg { RS_Type type; char* name; };
+// Bytes a value of a primitive type takes, 0 for the rest
+static inline u32 type_size(RS_TypeT kind) {
+	switch(kind) {
+		case TY_U8: case TY_I8: case TY_BOOL: return 1;
+		case TY_U16: case TY_I16: return 2;
+		case TY_U32: case TY_I32: case TY_F32: return 4;
+		case TY_U64: case TY_I64: case TY_F64: case TY_PTR: return 8;
+		default: return 0;
+	}
+}
+
+struct RS_FuncArg { u32 type; char* name; };
 typedef struct RS_FuncArg RS_FuncArg;
 
 enum RS_ExprT { EX_CALL = 1, EX_REGULAR, EX_PRIM, EX_VAR };
@@ -29,27 +54,40 @@ typedef enum RS_StmtT RS_StmtT;
 
 
 
+/*
+ * Where a variable lives gets settled while parsing, so nothing has to look names up after. `depth` is how many blocks
+ * it's inside of, 0 for globals. Globals are numbered in the order they're declared, and deeper ones count up from the
+ * outermost block, with a closed block's slots getting reused, so `slot` is a fixed offset into the frame.
+ */
 struct RS_Variable {
 	bool vcons;
 	char* vname;
 	RS_Expr* value;
+	u32 sym;   // Interned `vname`, see RS_ParserState.symbols
+	u32 depth;
+	u32 slot;
+	u32 type;  // What it was declared as, or what its value was
 }; // RS_Declare
 
-struct RS_Scope {
-	ht(char*, struct RS_Variable*) vars;
+// A variable in scope, and the one with the same name it hides until its block closes
+struct RS_Binding {
+	struct RS_Variable* var;
+	u32 shadows; // What `bound` had for the name before, 0 if nothing
 };
 
 
 struct RS_Expr {
-	RS_Token* tok; // TT_OPX
-	RS_ExprT type;
-	u8 paramnum;
+	u32 tok; // Index into the parser's `toks`, TT_OPX
+	RS_ExprT type : 8;
+	u8 paramnum; // How many operands come before `tok`, 0 for prefix operators, 1 for binary and postfix ones
+	u32 ty;      // Index into the parser's `types`, set as soon as the node's done
 	union {
 		RS_Expr* params[3];
 		struct {
 			RS_Expr* func;
 			RS_Expr** args;
 		}; // Call
+		struct RS_Variable* var; // EX_VAR, identifiers that were in scope. The rest stay EX_PRIM.
 	};
 };
 
@@ -63,6 +101,9 @@ struct RS_Stmt {
 		struct {
 			RS_Expr* expr;
 		}; // RS_Expr
+		struct {
+			struct RS_Variable* var;
+		}; // RS_Declare
 		struct {
 			RS_Expr* cond;
 			RS_Stmt* body;
@@ -76,16 +117,87 @@ struct RS_Stmt {
 	};
 };
 
+/*
+ * The same tree flattened into one vec per kind of thing, in post-order: every node comes after its children, and a
+ * statement's expression is the run of nodes ending at its root. Children and tokens are indices instead of pointers, so
+ * backends can walk an expression front to back, and the whole thing can be copied or written out as is.
+ */
+#define RS_NONE UINT32_MAX
+
+struct RS_FlatExpr {
+	u32 tok; // Index into the parser's `toks`
+	RS_ExprT type : 8;
+	u8 paramnum;
+	u32 ty;
+	u32 params[3]; // RS_NONE if missing. EX_CALL has the function in [0], and [1]/[2] are the start/count of its `args`.
+	               // EX_VAR has its variable's depth and slot in [0]/[1].
+};
+typedef struct RS_FlatExpr RS_FlatExpr;
+
+struct RS_FlatStmt {
+	RS_StmtT type;
+	u32 expr;  // Root node of `ret`, `expr`, `cond` or a declaration's value, RS_NONE if there isn't one
+	u32 depth; // ST_DECLARE: where the variable lives
+	u32 slot;
+};
+typedef struct RS_FlatStmt RS_FlatStmt;
+
+struct RS_FlatAST {
+	RS_FlatStmt* stmts;
+	RS_FlatExpr* nodes;
+	u32* args; // Node indices of call arguments, each call's are next to each other
+};
+typedef struct RS_FlatAST RS_FlatAST;
+
+// An operator parse_expr is still waiting on an operand for
+struct RS_ExprFrame {
+	RS_Expr* ex; // NULL for a parenthesis, those only group
+	u32 args;    // Calls: where their arguments start in `args`
+	u8 bp;       // Operators that don't bind harder than this end the operand
+};
+
+// Where a statement of `ast` starts, and what the parser had counted up to it. Lets reparse find what an edit touched.
+struct RS_StmtMark {
+	u32 tok;
+	u32 errors;
+	u32 warnings;
+	u32 binds; // Variables in scope
+	u32 depth; // Blocks it's in
+};
+
 struct RS_ParserState {
 	RS_Stmt* ast;
+	struct RS_StmtMark* marks; // One per statement in `ast`
+	// Statements past the gap reparse leaves where the last edit was, nearest one last, see close_gap
+	struct { RS_Stmt* ast; struct RS_StmtMark* marks; } after;
 	// RS_Expr* expressions; // they're kinda trees so it doesn't work
-	RS_Type* types;
+	RS_Type* types;            // Every type any node has, by id
+	ht(RS_Type, u32) typeids;  // And the other way around
+	ht(u64, u32) fields;       // Record id << 32 | field symbol, to the field's type
+	u64* fieldstack;           // Symbol << 32 | type of the fields of records parse_type is still in
 
-	RS_Stmt* scope;
 
 	char* file;
-	char* src;
-	RS_Token* toks;
+	char* src; // NULL when streaming, there's no whole source to point at
+	u32* lines; // line_starts of src, built by the first message about it
+	RS_TokList toks;  // Every token pulled so far, the parser walks `toks.tt` and exprs point in by index
+	RS_TokState* lex; // Where tokens get pulled from while parsing
+	RS_Arena arena;   // Owns every RS_Expr, goes away with the rest of the state
+	struct RS_ExprFrame* exprs; // parse_expr's stack of unfinished operators, as deep as expressions nest
+	RS_Expr** args;   // Arguments of calls that haven't closed yet
+	ht(char*, u32) symbols;   // Every name a variable was declared with, ids count up from 0
+	struct RS_Binding* binds; // Variables in scope, innermost last
+	u32* bound;               // Per symbol, 1 + its innermost binding in `binds`, 0 if it isn't in scope
+	u32* scopes;              // Where each open block's variables start in `binds`
+	RS_Expr** walk;           // Nodes left to get to when going over a finished tree, trees nest too deep to recurse
+	// What exprs, args, scopes, walk and fieldstack start out in, only deeply nested code needs the heap for them
+	struct {
+		vsmall(struct RS_ExprFrame, 16) exprs;
+		vsmall(RS_Expr*, 16) args;
+		vsmall(RS_Expr*, 16) walk;
+		vsmall(u32, 16) scopes;
+		vsmall(u64, 8) fieldstack;
+	} small;
 	u32 ind;
 	u32 errors;
 	u32 warnings;
@@ -94,5 +206,10 @@ struct RS_ParserState {
 typedef RS_Stmt* AST;
 
 struct RS_ParserState* parse(char* file, char* str);
-void debug_expr(RS_Expr* ex);
-// void free_ast(AST ast);
+struct RS_ParserState* parse_stream(char* file, RS_TokState* lex);
+struct RS_ParserState* reparse(struct RS_ParserState* st, char* str, u32 offset, u32 deleted, u32 inserted);
+void close_gap(struct RS_ParserState* st);
+void debug_expr(struct RS_ParserState* st, RS_Expr* ex);
+void free_parser(struct RS_ParserState* st);
+RS_FlatAST flatten(struct RS_ParserState* st);
+void free_flat(RS_FlatAST* ast);
@@ -1,8 +1,11 @@
 #include <stdlib.h>
-
-/**
- * TODO: ASI: https://stackoverflow.com/questions/2846283/what-are-the-rules-for-javascripts-automatic-semicolon-insertion-asi
- */
+#include <threads.h>
+#ifndef _WIN32
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 #define VEC_H_STATIC_INLINE
 #include <vec.h>
@@ -78,7 +81,10 @@ char* toktostr[] = {
 	[TT_TI16] = "i16",
 	[TT_TI32] = "i32",
 	[TT_TI64] = "i64",
+	[TT_TF32] = "f32",
+	[TT_TF64] = "f64",
 	[TT_TBOOL] = "bool",
+	[TT_TSTRING] = "string",
 	[TT_IDENT] = "an identifier",
 	[TT_INT] = "a number",
 	[TT_FLOAT] = "a number",
@@ -107,22 +113,32 @@ hentry(keywords) keywordinit[] = {
 	{ "i32",    TT_TI32    },
 	{ "i16",    TT_TI16    },
 	{ "i8",     TT_TI8     },
+	{ "f32",    TT_TF32    },
+	{ "f64",    TT_TF64    },
 	{ "bool",   TT_TBOOL   },
+	{ "string", TT_TSTRING },
 };
 
-static inline u32 utf8(u8** str) {
-	if(**str == 0) return 0;
+// Size of the window used when reading from files and pipes
+#define TOK_CHUNK 65536
+// NUL bytes kept after the end of the window, so a multibyte point at the edge never reads garbage
+#define TOK_PAD 4
+
+// Takes a char** instead of a u8** so the cursor isn't accessed through an incompatible pointer type (breaks at -O2)
+static inline u32 utf8(char** str) {
+	u8 lead = **str;
+	if(lead == 0) return 0;
 
 	int len =
-		**str > 0x80 ? // 0b10000000
-			(**str & 0xF0) == 0xF0 ? 3 : // 0b11110000
-				(**str & 0xE0) == 0xE0 ? 2 : // 0b11100000
-					(**str & 0xC0) == 0xC0 ? 1 : 3 // 0b11000000
+		lead > 0x80 ? // 0b10000000
+			(lead & 0xF0) == 0xF0 ? 3 : // 0b11110000
+				(lead & 0xE0) == 0xE0 ? 2 : // 0b11100000
+					(lead & 0xC0) == 0xC0 ? 1 : 3 // 0b11000000
 		: 0;
 
-	if(len > 0) **str &= (4 << (4 - len)) - 1;
-	else return *(*str)++;
-	u32 code_point = *(*str)++;
+	(*str)++;
+	if(!len) return lead;
+	u32 code_point = lead & ((4 << (4 - len)) - 1); // Don't write the mask back, the source might be read only
 	while (len--) code_point = code_point << 6 | (*(*str)++ & 0x3F);
 	return code_point;
 }
@@ -130,31 +146,66 @@ static inline u32 utf8(u8** str) {
 static inline bool num   (u32 point) { return point >= '0' && point <= '9'; }
 static inline bool alpha (u32 point) { return (point >= 'a' && point <='z') || (point >= 'A' && point <= 'Z'); }
 
-RS_Token* tokenize(char* str) {
-	
-	// Sets up keyword search
-	if(!keywords.n)
-		hmerge_entries(keywords, keywordinit);
-	
-	char* start = str;
-	RS_Token* ret = vnew();
+// Reads a point, but remembers if we got too close to the end of a window that isn't the last one
+#define next() (!st->eof && st->end - str < TOK_PAD ? starved = true : 0, utf8(&str))
+
+/*
+ * Automatic semicolon insertion, like Go's or JS's but without looking back: a newline ends the statement when the
+ * token before it can end one, and the token after it can't carry on the last line (an operator, an opening bracket, a
+ * comma...). Both only depend on the two tokens around the newline, so it's decided as tokens come out.
+ * The token after the semicolon is held back in the state and handed out on the next call.
+ */
+static const bool asi_end[TT_ERROR + 1] = {
+	[TT_IDENT] = true, [TT_INT] = true, [TT_FLOAT] = true, [TT_STRING] = true,
+	[TT_PCLOSEPAR] = true, [TT_PCLOSESQBR] = true, [TT_PCLOSECBR] = true,
+	[TT_OPINCR] = true, [TT_OPDECR] = true, [TT_KRETURN] = true,
+	[TT_TU8] = true, [TT_TU16] = true, [TT_TU32] = true, [TT_TU64] = true, [TT_TI8] = true, [TT_TI16] = true,
+	[TT_TI32] = true, [TT_TI64] = true, [TT_TF32] = true, [TT_TF64] = true, [TT_TBOOL] = true, [TT_TSTRING] = true,
+	[TT_TNUMBER] = true, [TT_TOBJECT] = true,
+};
+
+// Lines starting with these carry on the last one. Unary + and - do too, since they're the same tokens as binary ones.
+static const bool asi_continue[TT_ERROR + 1] = {
+	[TT_OPSET] = true, [TT_OPADD] = true, [TT_OPSUB] = true, [TT_OPMUL] = true, [TT_OPDIV] = true, [TT_OPMOD] = true,
+	[TT_OPPOW] = true, [TT_OPBXOR] = true, [TT_OPBOR] = true, [TT_OPBAND] = true, [TT_OPBSHR] = true, [TT_OPBSHL] = true,
+	[TT_OPADDSET] = true, [TT_OPSUBSET] = true, [TT_OPMULSET] = true, [TT_OPDIVSET] = true, [TT_OPMODSET] = true,
+	[TT_OPPOWSET] = true, [TT_OPBXORSET] = true, [TT_OPBORSET] = true, [TT_OPBANDSET] = true, [TT_OPBSHRSET] = true,
+	[TT_OPBSHLSET] = true, [TT_OPDOT] = true, [TT_OPQUESDOT] = true, [TT_OPQUES] = true,
+	[TT_POPENCBR] = true, [TT_POPENPAR] = true, [TT_POPENSQBR] = true, [TT_PCLOSEPAR] = true, [TT_PCLOSESQBR] = true,
+	[TT_PARROW] = true, [TT_PCOMMA] = true, [TT_PCOLON] = true, [TT_PSEMICOLON] = true,
+	[TT_LAND] = true, [TT_LOR] = true, [TT_LTERNARY] = true,
+	[TT_CGREATER] = true, [TT_CLESS] = true, [TT_CEQ] = true, [TT_CGREATEQ] = true, [TT_CLESSEQ] = true, [TT_CNOTEQ] = true,
+	[TT_EOF] = true, [TT_ERROR] = true,
+};
+
+static inline bool asi(RS_TokenType last, RS_TokenType next) {
+	return asi_end[last] && !asi_continue[next];
+}
 
-	#define op(t, l) vpush(ret, { .type = t, .len = l, .data = NULL, .place = str - start })//, printf("Op %s, %d\n", str, t)
-	#define error(str) { vpush(ret, { .type = TT_ERROR, .len = 0, .data = str, .place = str - start }); return ret; }
+// Zero length semicolon right where the last token ended
+static inline RS_Token virtual_semicolon(RS_Token* next) {
+	return (RS_Token) { .type = TT_PSEMICOLON, .place = next->from, .from = next->from };
+}
+
+// Lexes one token from `st->cur`. Returns false without touching the state if it ran into the end of the window.
+static bool lex(RS_TokState* st, RS_Token* tok) {
+	char* str = st->cur;
+	bool dot = st->dot, plus = st->plus, minus = st->minus;
+	bool starved = false, emitted = false, nl = false;
 
-	bool dot = false;
-	bool plus = false;
-	bool minus = false;
-	int prev = 0;
+	#define op(t, l) (*tok = (RS_Token) { .type = t, .len = l, .data = NULL, .place = str - st->buf + st->base }, emitted = true)
+	#define error(msg) { if(starved) return false; *tok = (RS_Token) { .type = TT_ERROR, .len = 0, .data = msg, .place = str - st->buf + st->base }; emitted = true; break; }
 
 	u32 point = 0;
-	while ((point = utf8((u8**) &str))) {
+	char* ptstart = str;
+	while (!emitted && (ptstart = str, point = next())) {
 		char* tokstart = str;
 		
-		if(point == ' ' || point == '\n' || point == '\t' || point == '\r') continue;
+		if(point == ' ' || point == '\n' || point == '\t' || point == '\r') { nl |= point == '\n'; continue; }
 
 		if(num(point)) {
 			int64_t intv = point - '0';
+			char* lasttok = str;
 			if(plus) plus = false;
 			if(dot) {
 				if(minus) intv = -intv;
@@ -163,8 +214,7 @@ RS_Token* tokenize(char* str) {
 			}
 
 			// Read in integer/front part of float
-			char* lasttok = str;
-			while (num((point = utf8((u8**) &str))))
+			while (num((point = next())))
 				lasttok = str, intv = intv * 10 + (point - '0');
 			
 			if(minus) intv = -intv;
@@ -174,26 +224,30 @@ RS_Token* tokenize(char* str) {
 				double floatv = (double) intv;
 				double dec = intv < 0 ? -0.1 : 0.1;
 
-				while (num((point = utf8((u8**) &str))))
+				while (num((point = next())))
 					lasttok = str, floatv += (point - '0') * (dec *= 0.1);
 
 				if(lasttok == str) error("Expected digit after decimal point");
-				vpush(ret, { .floatv = floatv, .type = TT_FLOAT, .place = str - start, .len = str - tokstart + !point });
+				*tok = (RS_Token) { .floatv = floatv, .type = TT_FLOAT, .place = str - st->buf + st->base, .len = str - tokstart + !point };
 			}
-			else vpush(ret, { .intv = intv, .type = TT_INT, .place = str - start, .len = str - tokstart + !point });
+			else *tok = (RS_Token) { .intv = intv, .type = TT_INT, .place = str - st->buf + st->base, .len = str - tokstart + !point };
+			emitted = true;
 			str = lasttok;
 			minus = false;
 			dot = false;
 			continue;
 		}
-		else if(dot) { dot = false; op(TT_OPDOT, 1); }
-		else if(plus) { plus = false; op(TT_OPADD, 1); }
-		else if(minus) { minus = false; op(TT_OPSUB, 1); }
+
+		// Pending operators get their own token, and the current point is lexed again next time
+		else if(dot) { dot = false; op(TT_OPDOT, 1); str = ptstart; continue; }
+		else if(plus) { plus = false; op(TT_OPADD, 1); str = ptstart; continue; }
+		else if(minus) { minus = false; op(TT_OPSUB, 1); str = ptstart; continue; }
 		
 
 		if(alpha(point)) {
 			char* lasttok = str;
-			while (alpha((point = utf8((u8**) &str))) || num(point)) lasttok = str;
+			while (alpha((point = next())) || num(point)) lasttok = str;
+			if(starved) return false;
 
 			u32 len = str - tokstart + !point; // Weird behavior at the end of strings
 			char* data;
@@ -202,25 +256,28 @@ RS_Token* tokenize(char* str) {
 			memcpy(data, str - len - !!point, len);
 
 			RS_TokenType* res = hgets(keywords, data);
-			if(res) //printf("whoa got a keyword\n"),
-				vpush(ret, { .type = *res, .data = data, .len = len, .place = str - start });
-			else vpush(ret, { .type = TT_IDENT, .data = data, .len = len, .place = str - start });
+			*tok = (RS_Token) { .type = res ? *res : TT_IDENT, .data = data, .len = len, .place = str - st->buf + st->base };
+			emitted = true;
 			str = lasttok;
 			continue;
 		}
 
 		if(point == '"') {
-			while ((point = utf8((u8**) &str)) && point != '"');
+			while ((point = next()) && point != '"');
 			if(point != '"') error("Unterminated string!");
 
-			point = utf8((u8**) &str);
+			char* lasttok = str;
+			point = next();
+			if(starved) return false;
 
 			u32 len = str - tokstart + !point; // Weird behavior at the end of strings
 			char* data = malloc(len + 1);
 			data[len] = 0;
 			memcpy(data, str - len - !!point, len);
 			
-			vpush(ret, { .type = TT_STRING, .data = data, .len = len, .place = str - start });
+			*tok = (RS_Token) { .type = TT_STRING, .data = data, .len = len, .place = str - st->buf + st->base };
+			emitted = true;
+			str = lasttok; // The point after the quote is the next token's
 			continue;
 		}
 
@@ -239,7 +296,7 @@ RS_Token* tokenize(char* str) {
 		}
 
 		char* tokstart2 = str;
-		u32 peek = utf8((u8**) &str);
+		u32 peek = next();
 		RS_TokenType t = 0;
 		switch(point) {
 		case '*': if (peek == '*') { op(TT_OPPOW, 2); continue; } else t = TT_OPMUL; break;
@@ -253,13 +310,13 @@ RS_Token* tokenize(char* str) {
 		case '+':
 			if (peek == '+') op(TT_OPINCR, 2);
 			else if(peek == '=') op(TT_OPADDSET, 2);
-			else if(vlen(ret) && isop(vlast(ret)->type)) { plus = true; str = tokstart2; }
+			else if(isop(st->last)) { plus = true; str = tokstart2; }
 			else { op(TT_OPADD, 1); str = tokstart2; }
 			continue;
 		case '-':
 			if (peek == '-') op(TT_OPDECR, 2);
 			else if(peek == '=') op(TT_OPSUBSET, 2);
-			else if(vlen(ret) && isop(vlast(ret)->type)) { minus = true; str = tokstart2; }
+			else if(isop(st->last)) { minus = true; str = tokstart2; }
 			else { op(TT_OPSUB, 1); str = tokstart2; }
 			continue;
 		case '!':
@@ -277,7 +334,7 @@ RS_Token* tokenize(char* str) {
 		else if(t) { op(t, 1); str = tokstart2; continue; }
 
 		char* tokstart3 = str;
-		u32 peek2 = utf8((u8**) &str);
+		u32 peek2 = next();
 		switch(point) {
 		case '<':
 			if (peek == '=') { op(TT_CLESSEQ, 2); str = tokstart3; }
@@ -304,16 +361,495 @@ RS_Token* tokenize(char* str) {
 		str = tokstart;
 	}
 
-	op(TT_EOF, 0);
+	if(starved) return false;
+	if(!emitted) op(TT_EOF, 0);
 
 	#undef op
 	#undef error
+	tok->from = st->cur - st->buf + st->base;
+	tok->nl = nl;
+	if(nl && asi(st->last, tok->type)) {
+		st->held = true;
+		st->next = *tok;
+		*tok = virtual_semicolon(tok);
+	}
+	st->cur = str;
+	st->dot = dot, st->plus = plus, st->minus = minus;
+	return true;
+}
+#undef next
+
+// Moves the unlexed tail of the window to the front and reads more after it, growing the window if a token won't fit.
+static void refill(RS_TokState* st) {
+	u32 keep = st->end - st->cur;
+	st->base += st->cur - st->buf;
+	if(st->cap - keep < TOK_CHUNK / 4) {
+		char* buf = malloc(st->cap * 2 + TOK_PAD);
+		memcpy(buf, st->cur, keep);
+		free(st->buf);
+		st->buf = buf;
+		st->cap *= 2;
+	} else memmove(st->buf, st->cur, keep);
+	st->cur = st->buf;
+	// Pipes hand out whatever they have, so keep going until the window is full. Otherwise a long token would get
+	// re-lexed once per tiny read.
+	st->end = st->buf + keep;
+	u32 got;
+	while(st->end < st->buf + st->cap && (got = st->read(st->ctx, st->end, st->buf + st->cap - st->end))) st->end += got;
+	if(st->end < st->buf + st->cap) st->eof = true;
+	memset(st->end, 0, TOK_PAD);
+}
+
+// Sets up keyword search, once, even with tokenizers starting up on several threads at the same time
+static once_flag keywords_once = ONCE_FLAG_INIT;
+static void keywords_setup(void) {
+	hmerge_entries(keywords, keywordinit);
+}
+
+static inline void tok_setup(RS_TokState* st) {
+	call_once(&keywords_once, keywords_setup);
+	*st = (RS_TokState) {};
+}
+
+// Tokenizes a NUL terminated string that's already in memory, without copying it.
+void tok_init(RS_TokState* st, char* source) {
+	tok_setup(st);
+	st->buf = st->cur = source;
+	st->end = NULL; // Strings just stop at their NUL, only windows need an end
+	st->eof = true;
+}
+
+// Tokenizes anything that can be read in chunks, like pipes.
+void tok_init_reader(RS_TokState* st, RS_TokReader read, void* ctx) {
+	tok_setup(st);
+	st->cap = TOK_CHUNK;
+	st->buf = st->cur = st->end = calloc(1, TOK_CHUNK + TOK_PAD);
+	st->read = read;
+	st->ctx = ctx;
+}
+
+u32 tok_fread(void* fp, char* buf, u32 cap) {
+	return fread(buf, 1, cap, fp);
+}
+
+/*
+ * Maps the file and lexes it in place, like a string. The mapping runs a few bytes past the end of the file, into
+ * zeroes, so the source ends in a NUL the same way and nothing of it is ever copied or read up front.
+ */
+bool tok_init_file(RS_TokState* st, char* path) {
+#ifdef _WIN32
+	FILE* fp = fopen(path, "rb");
+	if(!fp) return false;
+	tok_init_reader(st, tok_fread, fp);
+	return true;
+#else
+	int fd = open(path, O_RDONLY);
+	if(fd < 0) return false;
+	struct stat info;
+	if(fstat(fd, &info)) { close(fd); return false; }
+
+	// Zeroed anonymous pages, with the file mapped over the start of them
+	u64 page = sysconf(_SC_PAGESIZE);
+	u64 size = (info.st_size + TOK_PAD + page - 1) & ~(page - 1);
+	char* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if(map == MAP_FAILED) { close(fd); return false; }
+	if(info.st_size && mmap(map, info.st_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+		munmap(map, size);
+		close(fd);
+		return false;
+	}
+	close(fd);
+	if(info.st_size) madvise(map, info.st_size, MADV_SEQUENTIAL);
+
+	tok_init(st, map);
+	st->map = map;
+	st->mapsize = size;
+	return true;
+#endif
+}
+
+RS_Token tok_next(RS_TokState* st) {
+	if(st->held) {
+		st->held = false;
+		return st->next;
+	}
+	if(st->done) return (RS_Token) { .type = TT_EOF, .place = st->cur - st->buf + st->base };
+
+	RS_Token tok;
+	while(!lex(st, &tok)) refill(st);
+
+	st->last = st->held ? st->next.type : tok.type;
+	if(st->last == TT_EOF || st->last == TT_ERROR) st->done = true;
+	return tok;
+}
+
+void tok_free(RS_TokState* st) {
+#ifndef _WIN32
+	if(st->map) munmap(st->map, st->mapsize);
+#endif
+	if(!st->read) return; // Strings aren't ours
+	free(st->buf);
+#ifdef _WIN32
+	if(st->read == tok_fread) fclose(st->ctx);
+#endif
+}
+
+RS_Token* tokenize(char* str) {
+	RS_TokState st;
+	tok_init(&st, str);
+
+	RS_Token* ret = vnew();
+	RS_Token tok;
+	do *(RS_Token*) vprealloc(ret, 1) = tok = tok_next(&st);
+	while(tok.type != TT_EOF && tok.type != TT_ERROR);
+	return ret;
+}
+
+
+// Sources smaller than this per thread aren't worth splitting
+#define TOK_PARALLEL_MIN 65536
+
+struct tok_chunk {
+	RS_TokState st; // Starts out as the guess for the state at `from`, ends up as the state at the end of the chunk
+	char* from;     // First token in the chunk, past any whitespace
+	char* to;       // Tokens starting at or after this belong to the next chunk
+	RS_Token* toks;
+};
+
+static inline char* skipws(char* str) {
+	while(*str == ' ' || *str == '\n' || *str == '\t' || *str == '\r') str ++;
+	return str;
+}
+
+// Lexes every token that starts in the chunk. The last chunk runs all the way to TT_EOF.
+static int lex_chunk(void* arg) {
+	struct tok_chunk* c = arg;
+	c->toks = vnew();
+	c->st.cur = c->from;
+	RS_Token tok;
+	for(char* next; c->st.held || (*(next = skipws(c->st.cur)) ? next < c->to : !c->st.done);) {
+		*(RS_Token*) vprealloc(c->toks, 1) = tok = tok_next(&c->st);
+		if(tok.type == TT_ERROR) break;
+	}
+	return 0;
+}
+
+/*
+ * Splits the source at newlines that aren't inside strings and lexes each piece on its own thread. Strings can't escape
+ * quotes, so the number of quotes before a newline tells whether it's inside of one.
+ * Every chunk but the first starts from a guessed lexer state (no previous token or pending operator). When stitching,
+ * the real state at the end of the previous chunk is checked against that guess, and the chunk gets lexed again if it
+ * was wrong (lines ending in `.`, or a `-` starting a line after an operator). Places come out absolute since every
+ * chunk lexes straight out of the original string. A chunk can't know what came before its first token, so whether a
+ * semicolon goes in front of it is decided while stitching.
+ */
+RS_Token* tokenize_parallel(char* source, u32 threads) {
+	u32 len = strlen(source);
+	if(threads > len / TOK_PARALLEL_MIN) threads = len / TOK_PARALLEL_MIN;
+	if(threads < 2) return tokenize(source);
+
+	struct tok_chunk* chunks = calloc(threads, sizeof(struct tok_chunk));
+	char* p = source;
+	bool instr = false;
+	for(u32 i = 0; i < threads; i ++) {
+		tok_init(&chunks[i].st, source);
+		chunks[i].from = skipws(p);
+
+		char* target = source + (u64) len * (i + 1) / threads;
+		if(i == threads - 1 || target <= p) { chunks[i].to = i == threads - 1 ? source + len : p; continue; }
+
+		// Quote parity up to the even split, then on to the next newline outside of a string
+		for(char* q; p < target && (q = memchr(p, '"', target - p)); p = q + 1) instr = !instr;
+		for(p = target; *p; p ++)
+			if(*p == '"') instr = !instr;
+			else if(*p == '\n' && !instr) { p ++; break; }
+		chunks[i].to = p;
+	}
+
+	thrd_t* workers = malloc(threads * sizeof(thrd_t));
+	for(u32 i = 1; i < threads; i ++) thrd_create(workers + i, lex_chunk, chunks + i);
+	lex_chunk(chunks);
+	for(u32 i = 1; i < threads; i ++) thrd_join(workers[i], NULL);
+	free(workers);
+
+	RS_Token* ret = chunks[0].toks;
+	for(u32 i = 1; i < threads; i ++) {
+		struct tok_chunk* prev = chunks + i - 1, * c = chunks + i;
+		if(vlen(ret) && (vlast(ret)->type == TT_ERROR || vlast(ret)->type == TT_EOF)) { freetoks(c->toks); continue; }
+
+		// The previous token only matters if the chunk starts with a + or -
+		bool guessed = skipws(prev->st.cur) == c->from && !prev->st.dot && !prev->st.plus && !prev->st.minus &&
+			(!isop(prev->st.last) || (*c->from != '+' && *c->from != '-'));
+		if(!guessed) {
+			freetoks(c->toks);
+			c->st = prev->st;
+			c->from = prev->st.cur;
+			lex_chunk(c);
+		} else if(vlen(c->toks)) {
+			// The chunk started past the whitespace, which has the newline it was split at
+			RS_Token* first = c->toks;
+			first->from = prev->st.cur - source;
+			first->nl = memchr(prev->st.cur, '\n', c->from - prev->st.cur) != NULL;
+			if(first->nl && asi(prev->st.last, first->type)) vpush(ret, virtual_semicolon(first));
+		} else c->st = prev->st;
+		vpushv(ret, c->toks);
+		vfree(c->toks);
+	}
+
+	free(chunks);
 	return ret;
 }
 
+// How far past the start of the next token lexing a token can look (two points of peeking)
+#define TOK_LOOKAHEAD_BYTES 8
+
+/*
+ * Updates `toks` after an edit replaced `deleted` bytes at `offset` with `inserted` new ones. `source` is the whole
+ * source after the edit. Lexing restarts at the last token that couldn't have seen the edit, and stops as soon as the
+ * tokenizer lands where an old token past the edit started, with the same previous token. Between tokens that's all of
+ * the lexer's state, so everything from there on would come out the same, just shifted over. retokenize_edit also says
+ * which tokens those were.
+ */
+RS_Token* retokenize(RS_Token* toks, char* source, u32 offset, u32 deleted, u32 inserted) {
+	return retokenize_edit(toks, source, offset, deleted, inserted, NULL);
+}
+
+RS_Token* retokenize_edit(RS_Token* toks, char* source, u32 offset, u32 deleted, u32 inserted, RS_TokEdit* edit) {
+	u32 n = vlen(toks);
+	i64 delta = (i64) inserted - deleted;
+
+	// Last token that starts far enough before the edit that nothing before it could've peeked into it
+	u32 lo = 0, hi = n;
+	while(lo + 1 < hi) {
+		u32 mid = (lo + hi) / 2;
+		if(toks[mid].from + TOK_LOOKAHEAD_BYTES <= offset) lo = mid;
+		else hi = mid;
+	}
+	u32 restart = lo;
+	if(restart && isvirtual(toks + restart - 1)) restart --; // Keep inserted semicolons with the token after them
+
+	RS_TokState st;
+	tok_init(&st, source);
+	st.cur = source + toks[restart].from;
+	st.last = restart ? toks[restart - 1].type : 0;
+
+	RS_Token* fresh = vnew();
+	u32 resync = restart;
+	for(;;) {
+		u32 at = st.cur - st.buf;
+		while(resync < n && (toks[resync].from < offset + deleted || toks[resync].from + delta < at)) resync ++;
+		if(resync < n && resync > restart && !st.held && toks[resync].from + delta == at && toks[resync - 1].type == st.last)
+			break;
+
+		RS_Token tok = tok_next(&st);
+		*(RS_Token*) vprealloc(fresh, 1) = tok;
+		if(tok.type == TT_EOF || tok.type == TT_ERROR) { resync = n; break; }
+	}
+
+	// Splice the new tokens in place of the old ones in [restart, resync)
+	for(u32 i = restart; i < resync; i ++)
+		if(toks[i].type == TT_STRING || toks[i].type == TT_IDENT) free(toks[i].data);
+	u32 tail = n - resync, count = vlen(fresh);
+	if(count > resync - restart) vprealloc(toks, count - (resync - restart));
+	memmove(toks + restart + count, toks + resync, tail * sizeof(RS_Token));
+	if(count < resync - restart) vpopn(toks, resync - restart - count);
+	memcpy(toks + restart, fresh, count * sizeof(RS_Token));
+	vfree(fresh);
+
+	if(delta) for(RS_Token* tok = toks + restart + count, * end = tok + tail; tok < end; tok ++)
+		tok->place += delta, tok->from += delta;
+	if(edit) *edit = (RS_TokEdit) { .start = restart, .end = resync, .count = count };
+	return toks;
+}
 
 void freetoks(RS_Token* tok) {
 	for(u32 i = 0; i < vlen(tok); i ++)
 		if(tok[i].type == TT_STRING || tok[i].type == TT_IDENT) free(tok[i].data);
 	vfree(tok);
 }
+
+
+void toks_init(RS_TokList* t) {
+	*t = (RS_TokList) {
+		.tt = vnew(), .place = vnew(), .len = vnew(), .from = vnew(), .val = vnew(), .vals = vnew(), .holes = TOK_NOVAL,
+		.after = { .tt = vnew(), .place = vnew(), .len = vnew(), .from = vnew(), .val = vnew() },
+	};
+}
+
+// Keywords come out of the lexer spelled out like identifiers, but their type already says all of it
+static inline bool spelled(RS_TokenType type) {
+	return type >= TT_KRETURN && type <= TT_TOBJECT;
+}
+
+static inline bool hasval(RS_TokenType type) {
+	return type == TT_IDENT || type == TT_STRING || type == TT_INT || type == TT_FLOAT || type == TT_ERROR;
+}
+
+static u32 toks_newval(RS_TokList* t, RS_Token* tok) {
+	if(spelled(tok->type)) free(tok->data);
+	if(!hasval(tok->type)) return TOK_NOVAL;
+	u32 at = t->holes;
+	if(at == TOK_NOVAL) vpush(t->vals, { .intv = tok->intv });
+	else t->holes = t->vals[at].intv, t->vals[at].intv = tok->intv;
+	return at == TOK_NOVAL ? vlen(t->vals) - 1 : at;
+}
+
+// Takes ownership of the token's text. The vecs grow together, so a push is one check for room and five stores.
+void toks_push(RS_TokList* t, RS_Token tok) {
+	#define room(v) (_DATA(v)->cap - _DATA(v)->used >= sizeof(*(v)))
+	if(!room(t->tt) || !room(t->place) || !room(t->len) || !room(t->from) || !room(t->val)) {
+		u32 n = vlen(t->tt);
+		vreserve(t->tt, n / 4 + 16);
+		vreserve(t->place, n / 4 + 16);
+		vreserve(t->len, n / 4 + 16);
+		vreserve(t->from, n / 4 + 16);
+		vreserve(t->val, n / 4 + 16);
+	}
+	#undef room
+	vpush_unsafe(t->tt, tok.type);
+	vpush_unsafe(t->place, tok.place);
+	vpush_unsafe(t->len, tok.len);
+	vpush_unsafe(t->from, tok.from | (tok.nl ? TOK_NL : 0));
+	vpush_unsafe(t->val, toks_newval(t, &tok));
+	if(tok.type == TT_EOF) t->end = tok.place;
+}
+
+// The token put back together, its text still belongs to the list
+RS_Token toks_at(RS_TokList* t, u32 i) {
+	RS_Token tok = { .place = t->place[i], .len = t->len[i], .type = t->tt[i], .nl = toks_nl(t, i), .from = toks_from(t, i) };
+	if(t->val[i] != TOK_NOVAL) tok.intv = t->vals[t->val[i]].intv;
+	return tok;
+}
+
+// Tokens on both sides of the gap
+u32 toks_count(RS_TokList* t) {
+	return vlen(t->tt) + vlen(t->after.tt);
+}
+
+// Where token `i` starts, wherever the gap is
+static inline u32 from_at(RS_TokList* t, u32 i) {
+	u32 n = vlen(t->tt);
+	return i < n ? toks_from(t, i) : t->end - (t->after.from[vlen(t->after.from) - 1 - (i - n)] & ~TOK_NL);
+}
+
+// The five vecs of one side of the gap, `*t` or `t->after`, at once
+#define side_reserve(side, n) \
+	(vreserve((side).tt, n), vreserve((side).place, n), vreserve((side).len, n), vreserve((side).from, n), vreserve((side).val, n))
+#define side_popto(side, n) \
+	(vpopto((side).tt, n), vpopto((side).place, n), vpopto((side).len, n), vpopto((side).from, n), vpopto((side).val, n))
+
+// Moves tokens over the gap until the vecs hold the first `i`, or all of them if there aren't that many
+void toks_seek(RS_TokList* t, u32 i) {
+	u32 n = vlen(t->tt), k = vlen(t->after.tt);
+	if(i < n) {
+		side_reserve(t->after, n - i);
+		for(u32 j = n; j -- > i;) {
+			vpush_unsafe(t->after.tt, t->tt[j]);
+			vpush_unsafe(t->after.place, t->end - t->place[j]);
+			vpush_unsafe(t->after.len, t->len[j]);
+			vpush_unsafe(t->after.from, (t->end - toks_from(t, j)) | (t->from[j] & TOK_NL));
+			vpush_unsafe(t->after.val, t->val[j]);
+		}
+		side_popto(*t, i);
+		return;
+	}
+	u32 left = i - n < k ? k - (i - n) : 0; // What stays past the gap
+	side_reserve(*t, k - left);
+	for(u32 j = k; j -- > left;) {
+		vpush_unsafe(t->tt, t->after.tt[j]);
+		vpush_unsafe(t->place, t->end - t->after.place[j]);
+		vpush_unsafe(t->len, t->after.len[j]);
+		vpush_unsafe(t->from, (t->end - (t->after.from[j] & ~TOK_NL)) | (t->after.from[j] & TOK_NL));
+		vpush_unsafe(t->val, t->after.val[j]);
+	}
+	side_popto(t->after, left);
+}
+
+#undef side_reserve
+#undef side_popto
+
+// Throws away the token right after the gap, its slot in `vals` goes to whatever gets pushed next
+static void drop(RS_TokList* t) {
+	u32 val = *vlast(t->after.val);
+	if(val != TOK_NOVAL) {
+		RS_TokenType type = *vlast(t->after.tt);
+		if(type == TT_STRING || type == TT_IDENT) free(t->vals[val].data);
+		t->vals[val].intv = t->holes;
+		t->holes = val;
+	}
+	vpop(t->after.tt), vpop(t->after.place), vpop(t->after.len), vpop(t->after.from), vpop(t->after.val);
+}
+
+/*
+ * The first token an edit at `offset` could change: the last one starting far enough before it that nothing before it
+ * could've peeked into the edit, or the inserted semicolon in front of that one. Leaves the gap right before it.
+ */
+u32 toks_restart(RS_TokList* t, u32 offset) {
+	u32 lo = 0, hi = toks_count(t);
+	while(lo + 1 < hi) {
+		u32 mid = (lo + hi) / 2;
+		if(from_at(t, mid) + TOK_LOOKAHEAD_BYTES <= offset) lo = mid;
+		else hi = mid;
+	}
+	toks_seek(t, lo);
+	if(lo && t->tt[lo - 1] == TT_PSEMICOLON && !t->len[lo - 1]) toks_seek(t, -- lo);
+	return lo;
+}
+
+/*
+ * retokenize_edit for a list, the same way: lexing restarts at the last token that couldn't have seen the edit and stops
+ * once it lands on an old token's start with the same token before it. New tokens get pushed at the gap while the old
+ * ones come off the other side of it, so the tokens past the edit stay where they are and the gap ends up right after
+ * the new ones. The old tokens give their slots in `vals` to the new ones, or keep them for later.
+ */
+void toks_retokenize(RS_TokList* t, char* source, u32 offset, u32 deleted, u32 inserted, RS_TokEdit* edit) {
+	u32 restart = toks_restart(t, offset), end = t->end;
+	i64 delta = (i64) inserted - deleted;
+
+	RS_TokState st;
+	tok_init(&st, source);
+	st.cur = source + from_at(t, restart);
+	st.last = restart ? t->tt[restart - 1] : 0;
+	t->end += delta;
+
+	u32 removed = 0, count = 0;
+	RS_TokenType gone = 0; // The last old token that came off
+	#define oldfrom() (end - (*vlast(t->after.from) & ~TOK_NL))
+	for(;;) {
+		u32 at = st.cur - st.buf;
+		while(vlen(t->after.tt) && (oldfrom() < offset + deleted || oldfrom() + delta < at)) {
+			gone = *vlast(t->after.tt);
+			drop(t);
+			removed ++;
+		}
+		if(vlen(t->after.tt) && removed && !st.held && oldfrom() + delta == at && gone == st.last) break;
+
+		RS_Token tok = tok_next(&st);
+		toks_push(t, tok);
+		count ++;
+		if(tok.type == TT_EOF || tok.type == TT_ERROR) {
+			for(; vlen(t->after.tt); removed ++) drop(t);
+			break;
+		}
+	}
+	#undef oldfrom
+	if(edit) *edit = (RS_TokEdit) { .start = restart, .end = restart + removed, .count = count };
+}
+
+void toks_free(RS_TokList* t) {
+	for(u32 i = 0; i < vlen(t->tt); i ++)
+		if(t->tt[i] == TT_STRING || t->tt[i] == TT_IDENT) free(toks_data(t, i));
+	for(u32 i = 0; i < vlen(t->after.tt); i ++)
+		if(t->after.tt[i] == TT_STRING || t->after.tt[i] == TT_IDENT) free(t->vals[t->after.val[i]].data);
+	vfree(t->tt);
+	vfree(t->place);
+	vfree(t->len);
+	vfree(t->from);
+	vfree(t->val);
+	vfree(t->after.tt);
+	vfree(t->after.place);
+	vfree(t->after.len);
+	vfree(t->after.from);
+	vfree(t->after.val);
+	vfree(t->vals);
+}
@@ -1,5 +1,6 @@
 #pragma once
 #include <stdbool.h>
+#include <stdio.h>
 #include "util.h"
 
 
@@ -7,7 +8,7 @@ enum RS_TokenType {
 
 	TT_DNUOPSTART = 1, // DO NOT USE, this represents the start of operator tokens to make it easy to check if a taken is an operator!
 
-	// Places that depend on operator order: parse.c:precedences
+	// Places that depend on operator order: parse.c:PRECEDENCES, parse.c:parse_check
 
 	// THESE MUST BE KEPT IN ORDER
 	TT_OPSET, TT_OPADD, TT_OPSUB, TT_OPMUL, TT_OPDIV, TT_OPMOD, TT_OPPOW, // basic operations
@@ -48,18 +49,120 @@ struct RS_Token {
 	};
 	u32 place;
 	u32 len;
-	RS_TokenType type;
+	RS_TokenType type : 8;
+	bool nl : 1; // There was a newline between this and the last token, for semicolon insertion
+	u32 from; // Where the tokenizer started looking for this token (the end of the last one), so it can pick up from here
 };
 typedef struct RS_Token RS_Token;
 
+// What a token has besides where it is: identifiers and strings their text, numbers their value
+union RS_TokVal {
+	char* data;
+	u64 intv;
+	double floatv;
+};
+typedef union RS_TokVal RS_TokVal;
+
+#define TOK_NL (1u << 31) // In RS_TokList.from, the token's `nl`. Sources past 2 GiB don't fit anyway.
+#define TOK_NOVAL UINT32_MAX
+
+/*
+ * Tokens split up by field, one vec each, for keeping lots of them around. Walking through tokens only ever looks at
+ * `tt`, so that's one byte a token to go through, and the rest only get touched for the odd token something needs more
+ * of. Only identifiers, strings, numbers and errors have a value, the others don't take up any room in `vals`.
+ * An edit leaves a gap where it was: the vecs hold the tokens before it and `after` the rest, nearest one last, with
+ * their `place` and `from` counted back from `end`. So an edit never touches the tokens past it, and moving the gap
+ * along with toks_seek costs as many tokens as it moves over.
+ */
+struct RS_TokList {
+	u8* tt;
+	u32* place;
+	u32* len;
+	u32* from; // | TOK_NL
+	u32* val;  // Index into `vals`, TOK_NOVAL for tokens without one
+	RS_TokVal* vals;
+	u32 holes; // Slots of `vals` whose tokens got edited away, chained through their `intv`, TOK_NOVAL ends it
+	struct { u8* tt; u32* place; u32* len; u32* from; u32* val; } after;
+	u32 end;   // Where TT_EOF is, so past every token. Moves along with edits.
+};
+typedef struct RS_TokList RS_TokList;
+
+static inline u32 toks_from(RS_TokList* t, u32 i) { return t->from[i] & ~TOK_NL; }
+static inline bool toks_nl(RS_TokList* t, u32 i) { return t->from[i] & TOK_NL; }
+static inline RS_TokVal toks_val(RS_TokList* t, u32 i) { return t->vals[t->val[i]]; }
+static inline char* toks_data(RS_TokList* t, u32 i) { return t->val[i] == TOK_NOVAL ? NULL : t->vals[t->val[i]].data; }
+
 static inline const bool isop(RS_TokenType type) {
 	return type > TT_DNUOPSTART && type < TT_DNUOPEND;
 }
 
+// Inserted semicolons are the only ones with no length
+static inline const bool isvirtual(RS_Token* tok) {
+	return tok->type == TT_PSEMICOLON && !tok->len;
+}
+
 static inline const bool iskeyword(RS_TokenType type) {
-	return type > TT_KRETURN && type < TT_KTRAIT;
+	return type >= TT_KRETURN && type <= TT_KTRAIT;
 }
 
+// Fills `buf` with at most `cap` bytes of source, returns 0 once there is nothing left.
+typedef u32 (*RS_TokReader)(void* ctx, char* buf, u32 cap);
+
+/*
+ * Pull based tokenizer state. The source is either a whole string in memory, mapped files included, or a window that
+ * gets refilled from `read` whenever a token runs into the end of it. Tokens straddling two chunks are re-lexed after the
+ * refill, so the window only ever has to hold the longest token, not the whole file.
+ */
+struct RS_TokState {
+	char* buf; // Start of the current window
+	char* cur; // Where the next token starts
+	char* end; // End of the valid data in the window, always followed by some NUL padding. NULL for strings
+	u32 cap;
+	u32 base;  // Offset of `buf` in the whole source, so `place` stays absolute
+
+	RS_TokReader read;
+	void* ctx;
+
+	// mmap'd files, lexed in place like strings
+	void* map;
+	u64 mapsize;
+
+	RS_TokenType last;
+	bool dot, plus, minus;
+	bool held; // `next` comes after a semicolon that was inserted in front of it, and goes out on the next call
+	RS_Token next;
+	bool eof;  // `read` has nothing left
+	bool done; // Already gave out TT_EOF or TT_ERROR
+};
+typedef struct RS_TokState RS_TokState;
+
+// What a retokenize replaced: tokens [start, end) of the old list are now [start, start + count), the rest just moved
+struct RS_TokEdit {
+	u32 start;
+	u32 end;
+	u32 count;
+};
+typedef struct RS_TokEdit RS_TokEdit;
+
+void tok_init(RS_TokState* st, char* source);
+void tok_init_reader(RS_TokState* st, RS_TokReader read, void* ctx);
+bool tok_init_file(RS_TokState* st, char* path);
+RS_Token tok_next(RS_TokState* st);
+void tok_free(RS_TokState* st);
+u32 tok_fread(void* fp, char* buf, u32 cap);
+
 RS_Token* tokenize(char* source);
+RS_Token* tokenize_parallel(char* source, u32 threads);
+RS_Token* retokenize(RS_Token* toks, char* source, u32 offset, u32 deleted, u32 inserted);
+RS_Token* retokenize_edit(RS_Token* toks, char* source, u32 offset, u32 deleted, u32 inserted, RS_TokEdit* edit);
 void freetoks(RS_Token* tok);
+
+void toks_init(RS_TokList* t);
+void toks_push(RS_TokList* t, RS_Token tok);
+RS_Token toks_at(RS_TokList* t, u32 i);
+u32 toks_count(RS_TokList* t);
+void toks_seek(RS_TokList* t, u32 i);
+u32 toks_restart(RS_TokList* t, u32 offset);
+void toks_retokenize(RS_TokList* t, char* source, u32 offset, u32 deleted, u32 inserted, RS_TokEdit* edit);
+void toks_free(RS_TokList* t);
 extern char* toktostr[];
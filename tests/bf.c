@@ -39,7 +39,9 @@ x64Ins* bf_compile(char* in) {
 	x64Ins* ret = vnew();
 
 	// Keeps track of loops in a tree structure where we can rewind and pop to the parent node when needed.
-	struct { int start, end, parent_idx; }* loops = vnew();
+	struct bfloop { int start, end, parent_idx; };
+	vsmall(struct bfloop, 16) loopbuf; // Most programs have fewer loops than that
+	struct bfloop* loops = vsmallinit(loopbuf);
 	int parentloop = -1;
 	
 #ifdef _WIN32
@@ -132,6 +134,7 @@ x64Ins* bf_compile(char* in) {
 
 		ret[start].params[0] = rel(end - start); // Filling in that first argument that was needed before
 	}
+	vfree(loops);
 	return ret;
 }
 
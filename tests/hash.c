@@ -0,0 +1,357 @@
+#include "tests.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_H_IMPLEMENTATION
+#include <hash.h>
+#define VEC_H_STATIC_INLINE
+#include <vec.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <threads.h>
+
+uint32_t hash(const char* data, uint32_t len); // deps/hashfunc.c, what tables hashed with before
+
+#if defined(__linux__)
+// Bytes the heap has handed out, so a table can be measured with everything it allocated
+static size_t heap_used(void) { struct mallinfo2 m = mallinfo2(); return m.uordblks + m.hblkhd; }
+#else
+static size_t heap_used(void) { return 0; }
+#endif
+
+static uint64_t rng = 0x9E3779B97F4A7C15;
+static inline uint64_t next_rand(void) {
+	rng ^= rng << 13, rng ^= rng >> 7, rng ^= rng << 17;
+	return rng;
+}
+
+#define N 1000000
+static uint64_t* keys;
+static uint64_t* misses;
+static char** names;
+
+INIT() {
+	keys = malloc(N * sizeof(uint64_t));
+	misses = malloc(N * sizeof(uint64_t));
+	names = malloc(N / 10 * sizeof(char*));
+	for(uint32_t i = 0; i < N; i ++) keys[i] = next_rand() | 1, misses[i] = next_rand() & ~1ull;
+	for(uint32_t i = 0; i < N / 10; i ++) {
+		names[i] = malloc(24);
+		sprintf(names[i], "name_%u_%llx", i, (unsigned long long) (keys[i] & 0xFFFF));
+	}
+}
+
+TEST("Get back what was set, for keys of every size") {
+	ht(uint32_t, uint32_t) small = {};
+	ht(uint64_t, uint64_t) big = {};
+	struct triple { uint32_t a, b, c; };
+	ht(struct triple, int) odd = {};
+	ht(char*, uint32_t) strs = {};
+
+	expect(!hget(small, (uint32_t) { 5 }));
+	expect(!hgets(strs, "nothing"));
+	for(uint32_t i = 0; i < 100000; i ++) {
+		hset(small, (uint32_t) { i * 7 }) = i;
+		hset(big, keys[i]) = ~keys[i];
+		hset(odd, (struct triple) { i, i + 1, i + 2 }) = -(int) i;
+	}
+	for(uint32_t i = 0; i < N / 10; i ++) hsets(strs, names[i]) = i;
+	asserteq(small.n, 100000);
+	asserteq(big.n, 100000);
+	asserteq(odd.n, 100000);
+	asserteq(strs.n, N / 10);
+
+	uint32_t wrong = 0;
+	for(uint32_t i = 0; i < 100000; i ++) {
+		uint32_t* s = hget(small, (uint32_t) { i * 7 });
+		uint64_t* b = hget(big, keys[i]);
+		int* o = hget(odd, (struct triple) { i, i + 1, i + 2 });
+		wrong += !s || *s != i || !b || *b != ~keys[i] || !o || *o != -(int) i;
+		wrong += hget(small, (uint32_t) { i * 7 + 1 }) != NULL || hget(big, misses[i]) != NULL;
+	}
+	for(uint32_t i = 0; i < N / 10; i ++) {
+		uint32_t* s = hgets(strs, names[i]);
+		wrong += !s || *s != i;
+	}
+	expecteq(wrong, 0);
+
+	// Setting a key that's there already just overwrites it
+	hset(big, keys[0]) = 1;
+	hsets(strs, "name_0") = 2;
+	char copy[32];
+	strcpy(copy, names[1]);
+	hsets(strs, copy) = 3;
+	copy[0] = 0; // Keys are copied in
+	expecteq(big.n, 100000);
+	expecteq(*hget(big, keys[0]), 1);
+	expecteq(*hgets(strs, names[1]), 3);
+	expecteq(strs.n, N / 10 + 1);
+
+	hfree(small);
+	hfree(big);
+	hfree(odd);
+	hfree(strs);
+}
+
+TEST("Lookups, inserts and memory") {
+	ht(uint64_t, uint64_t) table = {};
+	size_t before = heap_used();
+	for(uint32_t i = 0; i < N; i ++) hset(table, keys[i]) = i;
+	size_t used = heap_used() - before;
+	if(used) printf("\n" SUBTESTINDENT TERMGRAY "1M u64 -> u64 entries take %.1f bytes each" TERMRESET, (double) used / N);
+
+	benchiters(5);
+	uint64_t found = 0;
+	BENCH("Insert 1M u64 keys") {
+		ht(uint64_t, uint64_t) fresh = {};
+		for(uint32_t i = 0; i < N; i ++) hset(fresh, keys[i]) = i;
+		hfree(fresh);
+	}
+	BENCH("Look up 1M u64 keys that are there") for(uint32_t i = 0; i < N; i ++) found += *hget(table, keys[i]);
+	uint64_t lookups = benchran();
+	BENCH("Look up 1M u64 keys that aren't") for(uint32_t i = 0; i < N; i ++) found += hget(table, misses[i]) != NULL;
+	expecteq(found, lookups * N * (N - 1) / 2);
+	hfree(table);
+
+	ht(char*, uint32_t) strs = {};
+	before = heap_used();
+	for(uint32_t i = 0; i < N / 10; i ++) hsets(strs, names[i]) = i;
+	used = heap_used() - before;
+	if(used) printf("\n" SUBTESTINDENT TERMGRAY "100k string -> u32 entries take %.1f bytes each" TERMRESET, (double) used / (N / 10));
+	found = 0;
+	BENCH("Insert 100k string keys") {
+		ht(char*, uint32_t) fresh = {};
+		for(uint32_t i = 0; i < N / 10; i ++) hsets(fresh, names[i]) = i;
+		hfree(fresh);
+	}
+	BENCH("Look up 100k string keys") for(uint32_t i = 0; i < N / 10; i ++) found += *hgets(strs, names[i]);
+	expecteq(found, benchran() * (N / 10) * (N / 10 - 1) / 2);
+	hfree(strs);
+	benchiters(1000);
+}
+
+TEST("Grow incrementally") {
+	ht(uint64_t, uint64_t) table = { .incremental = true };
+	ht(char*, uint32_t) strs = { .incremental = true };
+
+	// Check everything at a few points while old slots are still being moved out of
+	uint32_t wrong = 0, checked = 0;
+	for(uint32_t i = 0; i < N; i ++) {
+		hset(table, keys[i]) = ~keys[i];
+		if(!table.oldcap || table.moved || checked > 8) continue;
+		checked ++;
+		for(uint32_t j = 0; j <= i; j ++) {
+			uint64_t* v = hget(table, keys[j]);
+			wrong += !v || *v != ~keys[j] || hget(table, misses[j]);
+		}
+	}
+	expect(checked);
+	expecteq(wrong, 0);
+	asserteq(table.n, N);
+
+	uint32_t seen = 0;
+	hfor(table, e) seen ++, wrong += e->v != ~e->k;
+	expecteq(seen, N);
+	expecteq(wrong, 0);
+	expecteq(table.oldcap, 0);
+
+	// Strings in the old slots belong to them until they're moved, freeing halfway through gets both halves
+	for(uint32_t i = 0; i < N / 10; i ++) hsets(strs, names[i]) = i;
+	for(uint32_t i = 0; i < N / 10; i ++) wrong += *hgets(strs, names[i]) != i;
+	expecteq(wrong, 0);
+	char extra[32];
+	for(uint32_t i = 0; !strs.oldcap; i ++) sprintf(extra, "extra_%u", i), hsets(strs, extra) = i;
+	for(uint32_t i = 0; i < N / 10; i ++) wrong += *hgets(strs, names[i]) != i;
+	expecteq(wrong, 0);
+	hfree(strs);
+	hfree(table);
+}
+
+static int by_value(const void* a, const void* b) {
+	return (*(uint32_t*) a > *(uint32_t*) b) - (*(uint32_t*) a < *(uint32_t*) b);
+}
+
+// Times every insert on its own, growing in one go and incrementally
+TEST("Insert latency") {
+	uint32_t* took = malloc(N * sizeof(uint32_t));
+	for(int incremental = 0; incremental < 2; incremental ++) {
+		ht(uint64_t, uint32_t) table = { .incremental = incremental };
+		for(uint32_t i = 0; i < N; i ++) {
+			unsigned long long start = get_precise_time();
+			hset(table, keys[i]) = i;
+			took[i] = get_precise_time() - start;
+		}
+		hfree(table);
+		qsort(took, N, sizeof(uint32_t), by_value);
+		printf("\n" SUBTESTINDENT TERMGRAY "Inserting 1M u64 keys, %s: p50 %u ns, p99 %u ns, p99.99 %u ns, max %u ns" TERMRESET,
+			incremental ? "incrementally" : "all at once", took[N / 2], took[N / 100 * 99], took[N / 10000 * 9999], took[N - 1]);
+	}
+	free(took);
+}
+
+// Keeps count of what goes through it
+struct counting {
+	struct allocator base;
+	size_t live;
+	uint32_t calls;
+};
+
+static void* counting_resize(struct allocator* a, void* ptr, size_t old, size_t size) {
+	struct counting* c = (struct counting*) a;
+	c->live += size - old;
+	c->calls ++;
+	if(size) return realloc(ptr, size);
+	free(ptr);
+	return NULL;
+}
+
+TEST("Vecs and tables get memory from their allocator") {
+	struct counting c = { { counting_resize } };
+	ht(char*, uint32_t) strs = { .alloc = &c.base };
+	ht(uint64_t, uint64_t) nums = { .alloc = &c.base };
+	for(uint32_t i = 0; i < N / 10; i ++) hsets(strs, names[i]) = i, hset(nums, keys[i]) = i;
+	expect(c.live);
+	uint32_t wrong = 0;
+	for(uint32_t i = 0; i < N / 10; i ++) wrong += *hgets(strs, names[i]) != i || *hget(nums, keys[i]) != i;
+	expecteq(wrong, 0);
+	hfree(strs);
+	hfree(nums);
+	expecteq(c.live, 0);
+	expect(nums.alloc == &c.base); // Still there for the next use
+
+	uint32_t* v = vnewin(&c.base);
+	for(uint32_t i = 0; i < 100000; i ++) vpush(v, i);
+	for(uint32_t i = 0; i < 100000; i ++) wrong += v[i] != i;
+	expecteq(wrong, 0);
+	expect(c.live >= 100000 * sizeof(uint32_t));
+	uint32_t calls = c.calls;
+	vfree(v);
+	expecteq(c.live, 0);
+	expecteq(c.calls, calls + 1);
+
+	// The default is still malloc
+	uint32_t* plain = vnew();
+	vpush(plain, 1);
+	vfree(plain);
+	expecteq(c.calls, calls + 1);
+}
+
+#define THREADS 8
+static ht(uint64_t, uint64_t) shared = { .concurrent = true };
+static ht(char*, uint32_t) interned = { .concurrent = true };
+static uint32_t* interned_as; // What each thread got back for each name
+static _Atomic uint32_t shared_wrong;
+
+static int share_work(void* arg) {
+	uint32_t self = (uintptr_t) arg, wrong = 0;
+	// Every thread adds its own share of keys while looking up everyone's, which might or might not be there yet
+	for(uint32_t i = self; i < N; i += THREADS) {
+		wrong += *hput(shared, keys[i], ~keys[i]) != ~keys[i];
+		wrong += !hget(shared, keys[i]);
+		uint64_t* other = hget(shared, keys[i / 2]);
+		wrong += other && *other != ~keys[i / 2];
+	}
+	// All of them intern the same names, only one thread's id can stick for each
+	for(uint32_t i = 0; i < N / 10; i ++) interned_as[self * (N / 10) + i] = *hputs(interned, names[i], self);
+	atomic_fetch_add(&shared_wrong, wrong);
+	return 0;
+}
+
+static int share_lookups(void* arg) {
+	uint64_t found = 0;
+	for(uint32_t i = 0; i < N; i ++) found += *hget(shared, keys[i]);
+	*(uint64_t*) arg = found;
+	return 0;
+}
+
+TEST("Share a table between threads") {
+	interned_as = malloc(THREADS * (N / 10) * sizeof(uint32_t));
+	thrd_t threads[THREADS];
+	for(uintptr_t i = 0; i < THREADS; i ++) thrd_create(threads + i, share_work, (void*) i);
+	for(uint32_t i = 0; i < THREADS; i ++) thrd_join(threads[i], NULL);
+	expecteq(shared_wrong, 0);
+	asserteq(shared.n, N);
+	asserteq(interned.n, N / 10);
+
+	uint32_t wrong = 0;
+	for(uint32_t i = 0; i < N; i ++) wrong += *hget(shared, keys[i]) != ~keys[i];
+	for(uint32_t i = 0; i < N / 10; i ++) {
+		uint32_t id = *hgets(interned, names[i]);
+		for(uint32_t t = 0; t < THREADS; t ++) wrong += interned_as[t * (N / 10) + i] != id;
+	}
+	expecteq(wrong, 0);
+
+	benchiters(5);
+	uint64_t found[THREADS];
+	BENCH("Look up 1M u64 keys on 1 thread") share_lookups(found);
+	BENCH("Look up 1M u64 keys on 8 threads each") {
+		for(uintptr_t i = 0; i < THREADS; i ++) thrd_create(threads + i, share_lookups, found + i);
+		for(uint32_t i = 0; i < THREADS; i ++) thrd_join(threads[i], NULL);
+	}
+	BENCH("Insert 1M u64 keys on 8 threads") {
+		hfree(shared);
+		for(uintptr_t i = 0; i < THREADS; i ++) thrd_create(threads + i, share_work, (void*) i);
+		for(uint32_t i = 0; i < THREADS; i ++) thrd_join(threads[i], NULL);
+	}
+	benchiters(1000);
+	expecteq(shared_wrong, 0);
+	hfree(shared);
+	hfree(interned);
+	free(interned_as);
+}
+
+// How far `n` hashes are from landing evenly in `buckets` buckets. Chi-square with buckets - 1 degrees of freedom.
+static double chi2(uint32_t* counts, uint32_t buckets, uint32_t n) {
+	double want = (double) n / buckets, sum = 0;
+	for(uint32_t i = 0; i < buckets; i ++) sum += (counts[i] - want) * (counts[i] - want) / want;
+	return sum;
+}
+
+// Both halves of the hash get used: the low bits pick the group, the top 7 the control byte
+static uint32_t skewed_halves(uint64_t (*key_hash)(uint32_t), uint32_t n) {
+	enum { LOW = 1 << 16, TOP = 128 };
+	static uint32_t low[LOW], top[TOP];
+	memset(low, 0, sizeof(low)), memset(top, 0, sizeof(top));
+	for(uint32_t i = 0; i < n; i ++) {
+		uint64_t h = key_hash(i);
+		low[h & (LOW - 1)] ++, top[ht_tag(h)] ++;
+	}
+	// Off by more than 6 standard deviations from what a random hash would do
+	return (chi2(low, LOW, n) > LOW + 6 * sqrt(2.0 * LOW)) + (chi2(top, TOP, n) > TOP + 6 * sqrt(2.0 * TOP));
+}
+
+static uint64_t hash_seq(uint32_t i) { return ht_hash(&(uint64_t) { i }, 8, HT_KEY_8); }
+static uint64_t hash_strided(uint32_t i) { return ht_hash(&(uint64_t) { (uint64_t) i << 16 }, 8, HT_KEY_8); }
+static uint64_t hash_small(uint32_t i) { return ht_hash(&(uint32_t) { i * 1024 }, 4, HT_KEY_4); }
+static uint64_t hash_name(uint32_t i) { return ht_hash(names[i], strlen(names[i]) + 1, HT_KEY_STR); }
+
+TEST("Hashes spread keys out, and quickly") {
+	expecteq(skewed_halves(hash_seq, N), 0);
+	expecteq(skewed_halves(hash_strided, N), 0);
+	expecteq(skewed_halves(hash_small, N), 0);
+	expecteq(skewed_halves(hash_name, N / 10), 0);
+
+	// A seed changes every hash, and the table still works under it
+	uint64_t unseeded = hash_seq(1);
+	hseed(0xC0FFEE);
+	expect(hash_seq(1) != unseeded);
+	ht(uint64_t, uint32_t) seeded = {};
+	for(uint32_t i = 0; i < 1000; i ++) hset(seeded, keys[i]) = i;
+	uint32_t wrong = 0;
+	for(uint32_t i = 0; i < 1000; i ++) wrong += *hget(seeded, keys[i]) != i;
+	expecteq(wrong, 0);
+	hfree(seeded);
+	hseed(0);
+
+	benchiters(5);
+	uint64_t sum = 0;
+	BENCH("Hash 1M u64 keys") for(uint32_t i = 0; i < N; i ++) sum += ht_hash(keys + i, 8, HT_KEY_8);
+	BENCH("Hash 1M u64 keys, old hash") for(uint32_t i = 0; i < N; i ++) sum += hash((char*) (keys + i), 8);
+	BENCH("Hash 100k strings") for(uint32_t i = 0; i < N / 10; i ++) sum += ht_hash(names[i], strlen(names[i]) + 1, HT_KEY_STR);
+	BENCH("Hash 100k strings, old hash") for(uint32_t i = 0; i < N / 10; i ++) sum += hash(names[i], strlen(names[i]) + 1);
+	expect(sum);
+	benchiters(1000);
+}
+
+#include "tests_end.h"
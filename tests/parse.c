@@ -1,5 +1,13 @@
 #include "tests.h"
+#define VEC_H_STATIC_INLINE
+#include <vec.h>
 #include "parse.h"
+#include "driver.h"
+#include "cache.h"
+#include "error.h"
+#include <threads.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #define HASH_H_IMPLEMENTATION
 #include <hash.h>
@@ -9,10 +17,10 @@ TEST("Parse a number?") {
 	assert(state != NULL);
 	expecteq(state->ast[0].type, ST_EXPR);
 	expecteq(state->ast[0].expr->type, EX_PRIM);
-	assert(state->ast[0].expr->tok != NULL);
-	expecteq(state->ast[0].expr->tok->type, TT_INT);
-	expecteq(state->ast[0].expr->tok->intv, 123);
-	expecteq(state->ast[0].expr->tok->len, 3);
+	assert(state->ast[0].expr->tok < vlen(state->toks.tt));
+	expecteq(state->toks.tt[state->ast[0].expr->tok], TT_INT);
+	expecteq(toks_val(&state->toks, state->ast[0].expr->tok).intv, 123);
+	expecteq(state->toks.len[state->ast[0].expr->tok], 3);
 	expecteq(state->ast[1].type, ST_EOF);
 }
 
@@ -21,10 +29,10 @@ TEST("Parse \"return 0;\"") {
 	assert(state != NULL);
 	expecteq(state->ast[0].type, ST_RETURN);
 	expecteq(state->ast[0].ret->type, EX_PRIM);
-	expecteq(state->ast[0].ret->tok - state->toks, 1);
-	expecteq(state->ast[0].ret->tok->type, TT_INT);
-	expecteq(state->ast[0].ret->tok->intv, 0);
-	expecteq(state->ast[0].ret->tok->len, 1);
+	expecteq(state->ast[0].ret->tok, 1);
+	expecteq(state->toks.tt[state->ast[0].ret->tok], TT_INT);
+	expecteq(toks_val(&state->toks, state->ast[0].ret->tok).intv, 0);
+	expecteq(state->toks.len[state->ast[0].ret->tok], 1);
 	expecteq(state->ast[1].type, ST_EOF);
 }
 
@@ -37,16 +45,16 @@ TEST("Parse \"return 1 + -2;\"") {
 	// puts("");
 	expecteq(stmt->type, ST_RETURN);
 	expecteq(stmt->ret->type, EX_REGULAR);
-	expecteq(stmt->ret->tok - state->toks, 2);
-	expecteq(stmt->ret->tok->type, TT_OPADD);
+	expecteq(stmt->ret->tok, 2);
+	expecteq(state->toks.tt[stmt->ret->tok], TT_OPADD);
 	expecteq(stmt->ret->params[0]->type, EX_PRIM);
-	expecteq(stmt->ret->params[0]->tok - state->toks, 1);
-	expecteq(stmt->ret->params[0]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[0]->tok->intv, 1);
+	expecteq(stmt->ret->params[0]->tok, 1);
+	expecteq(state->toks.tt[stmt->ret->params[0]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[0]->tok).intv, 1);
 	expecteq(stmt->ret->params[1]->type, EX_PRIM);
-	expecteq(stmt->ret->params[1]->tok - state->toks, 3);
-	expecteq(stmt->ret->params[1]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[1]->tok->intv, -2);
+	expecteq(stmt->ret->params[1]->tok, 3);
+	expecteq(state->toks.tt[stmt->ret->params[1]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->tok).intv, -2);
 	expecteq(state->ast[1].type, ST_EOF);
 }
 
@@ -59,73 +67,74 @@ TEST("Parse \"return 1 - 2 * 0;\"") {
 	// puts("");
 	expecteq(stmt->type, ST_RETURN);
 	expecteq(stmt->ret->type, EX_REGULAR);
-	expecteq(stmt->ret->tok - state->toks, 2);
-	expecteq(stmt->ret->tok->type, TT_OPSUB);
+	expecteq(stmt->ret->tok, 2);
+	expecteq(state->toks.tt[stmt->ret->tok], TT_OPSUB);
 	expecteq(stmt->ret->params[0]->type, EX_PRIM);
-	expecteq(stmt->ret->params[0]->tok - state->toks, 1);
-	expecteq(stmt->ret->params[0]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[0]->tok->intv, 1);
+	expecteq(stmt->ret->params[0]->tok, 1);
+	expecteq(state->toks.tt[stmt->ret->params[0]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[0]->tok).intv, 1);
 	expecteq(stmt->ret->params[1]->type, EX_REGULAR);
-	expecteq(stmt->ret->params[1]->tok - state->toks, 4);
-	expecteq(stmt->ret->params[1]->tok->type, TT_OPMUL);
+	expecteq(stmt->ret->params[1]->tok, 4);
+	expecteq(state->toks.tt[stmt->ret->params[1]->tok], TT_OPMUL);
 	expecteq(stmt->ret->params[1]->params[0]->type, EX_PRIM);
-	expecteq(stmt->ret->params[1]->params[0]->tok - state->toks, 3);
-	expecteq(stmt->ret->params[1]->params[0]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[1]->params[0]->tok->intv, 2);
+	expecteq(stmt->ret->params[1]->params[0]->tok, 3);
+	expecteq(state->toks.tt[stmt->ret->params[1]->params[0]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->params[0]->tok).intv, 2);
 	expecteq(stmt->ret->params[1]->params[1]->type, EX_PRIM);
-	expecteq(stmt->ret->params[1]->params[1]->tok - state->toks, 5);
-	expecteq(stmt->ret->params[1]->params[1]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[1]->params[1]->tok->intv, 0);
+	expecteq(stmt->ret->params[1]->params[1]->tok, 5);
+	expecteq(state->toks.tt[stmt->ret->params[1]->params[1]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->params[1]->tok).intv, 0);
 	expecteq(state->ast[1].type, ST_EOF);
 }
 
 TEST("Parse Problematic \"return 1 - 2 * 3 + 4 ^ 5 = 4\"") {
 	struct RS_ParserState* state = parse("test2.rc", "return 1 - 2 * 3 + 4 ^ 5 = 6;");
 	assert(state != NULL);
+	expecteq(state->errors, 1); // Parses fine, but there's nothing there to assign to
 	RS_Stmt* stmt = &state->ast[0];
 	// printf("\ndebug: ");
 	// debug_expr(stmt->ret);
 	// puts("");
 	expecteq(stmt->type, ST_RETURN);
 	expecteq(stmt->ret->type, EX_REGULAR);
-	expecteq(stmt->ret->tok - state->toks, 10);
-	expecteq(stmt->ret->tok->type, TT_OPSET);
+	expecteq(stmt->ret->tok, 10);
+	expecteq(state->toks.tt[stmt->ret->tok], TT_OPSET);
 	expecteq(stmt->ret->params[0]->type, EX_REGULAR);
-	expecteq(stmt->ret->params[0]->tok - state->toks, 6);
-	expecteq(stmt->ret->params[0]->tok->type, TT_OPADD);
+	expecteq(stmt->ret->params[0]->tok, 6);
+	expecteq(state->toks.tt[stmt->ret->params[0]->tok], TT_OPADD);
 	expecteq(stmt->ret->params[0]->params[0]->type, EX_REGULAR);
-	expecteq(stmt->ret->params[0]->params[0]->tok - state->toks, 2);
-	expecteq(stmt->ret->params[0]->params[0]->tok->type, TT_OPSUB);
+	expecteq(stmt->ret->params[0]->params[0]->tok, 2);
+	expecteq(state->toks.tt[stmt->ret->params[0]->params[0]->tok], TT_OPSUB);
 	expecteq(stmt->ret->params[0]->params[0]->params[0]->type, EX_PRIM);
-	expecteq(stmt->ret->params[0]->params[0]->params[0]->tok - state->toks, 1);
-	expecteq(stmt->ret->params[0]->params[0]->params[0]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[0]->params[0]->params[0]->tok->intv, 1);
+	expecteq(stmt->ret->params[0]->params[0]->params[0]->tok, 1);
+	expecteq(state->toks.tt[stmt->ret->params[0]->params[0]->params[0]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[0]->params[0]->params[0]->tok).intv, 1);
 	expecteq(stmt->ret->params[0]->params[0]->params[1]->type, EX_REGULAR);
-	expecteq(stmt->ret->params[0]->params[0]->params[1]->tok - state->toks, 4);
-	expecteq(stmt->ret->params[0]->params[0]->params[1]->tok->type, TT_OPMUL);
+	expecteq(stmt->ret->params[0]->params[0]->params[1]->tok, 4);
+	expecteq(state->toks.tt[stmt->ret->params[0]->params[0]->params[1]->tok], TT_OPMUL);
 	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[0]->type, EX_PRIM);
-	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[0]->tok - state->toks, 3);
-	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[0]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[0]->tok->intv, 2);
+	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[0]->tok, 3);
+	expecteq(state->toks.tt[stmt->ret->params[0]->params[0]->params[1]->params[0]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[0]->params[0]->params[1]->params[0]->tok).intv, 2);
 	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[1]->type, EX_PRIM);
-	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[1]->tok - state->toks, 5);
-	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[1]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[1]->tok->intv, 3);
+	expecteq(stmt->ret->params[0]->params[0]->params[1]->params[1]->tok, 5);
+	expecteq(state->toks.tt[stmt->ret->params[0]->params[0]->params[1]->params[1]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[0]->params[0]->params[1]->params[1]->tok).intv, 3);
 	expecteq(stmt->ret->params[0]->params[1]->type, EX_REGULAR);
-	expecteq(stmt->ret->params[0]->params[1]->tok - state->toks, 8);
-	expecteq(stmt->ret->params[0]->params[1]->tok->type, TT_OPBXOR);
+	expecteq(stmt->ret->params[0]->params[1]->tok, 8);
+	expecteq(state->toks.tt[stmt->ret->params[0]->params[1]->tok], TT_OPBXOR);
 	expecteq(stmt->ret->params[0]->params[1]->params[0]->type, EX_PRIM);
-	expecteq(stmt->ret->params[0]->params[1]->params[0]->tok - state->toks, 7);
-	expecteq(stmt->ret->params[0]->params[1]->params[0]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[0]->params[1]->params[0]->tok->intv, 4);
+	expecteq(stmt->ret->params[0]->params[1]->params[0]->tok, 7);
+	expecteq(state->toks.tt[stmt->ret->params[0]->params[1]->params[0]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[0]->params[1]->params[0]->tok).intv, 4);
 	expecteq(stmt->ret->params[0]->params[1]->params[1]->type, EX_PRIM);
-	expecteq(stmt->ret->params[0]->params[1]->params[1]->tok - state->toks, 9);
-	expecteq(stmt->ret->params[0]->params[1]->params[1]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[0]->params[1]->params[1]->tok->intv, 5);
+	expecteq(stmt->ret->params[0]->params[1]->params[1]->tok, 9);
+	expecteq(state->toks.tt[stmt->ret->params[0]->params[1]->params[1]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[0]->params[1]->params[1]->tok).intv, 5);
 	expecteq(stmt->ret->params[1]->type, EX_PRIM);
-	expecteq(stmt->ret->params[1]->tok - state->toks, 11);
-	expecteq(stmt->ret->params[1]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[1]->tok->intv, 6);
+	expecteq(stmt->ret->params[1]->tok, 11);
+	expecteq(state->toks.tt[stmt->ret->params[1]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->tok).intv, 6);
 	expecteq(state->ast[1].type, ST_EOF);
 }
 
@@ -139,43 +148,1114 @@ TEST("Parse Parenthesis \"return 1 + (2 - (3 >> (4) + 5))\"") {
 	// puts("");
 	expecteq(stmt->type, ST_RETURN);
 	expecteq(stmt->ret->type, EX_REGULAR);
-	expecteq(stmt->ret->tok - state->toks, 2);
-	expecteq(stmt->ret->tok->type, TT_OPADD);
+	expecteq(stmt->ret->tok, 2);
+	expecteq(state->toks.tt[stmt->ret->tok], TT_OPADD);
 	expecteq(stmt->ret->params[0]->type, EX_PRIM);
-	expecteq(stmt->ret->params[0]->tok - state->toks, 1);
-	expecteq(stmt->ret->params[0]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[0]->tok->intv, 1);
+	expecteq(stmt->ret->params[0]->tok, 1);
+	expecteq(state->toks.tt[stmt->ret->params[0]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[0]->tok).intv, 1);
 	expecteq(stmt->ret->params[1]->type, EX_REGULAR);
-	expecteq(stmt->ret->params[1]->tok - state->toks, 5);
-	expecteq(stmt->ret->params[1]->tok->type, TT_OPSUB);
+	expecteq(stmt->ret->params[1]->tok, 5);
+	expecteq(state->toks.tt[stmt->ret->params[1]->tok], TT_OPSUB);
 	expecteq(stmt->ret->params[1]->params[0]->type, EX_PRIM);
-	expecteq(stmt->ret->params[1]->params[0]->tok - state->toks, 4);
-	expecteq(stmt->ret->params[1]->params[0]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[1]->params[0]->tok->intv, 2);
+	expecteq(stmt->ret->params[1]->params[0]->tok, 4);
+	expecteq(state->toks.tt[stmt->ret->params[1]->params[0]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->params[0]->tok).intv, 2);
 	expecteq(stmt->ret->params[1]->params[1]->type, EX_REGULAR);
-	expecteq(stmt->ret->params[1]->params[1]->tok - state->toks, 12);
-	expecteq(stmt->ret->params[1]->params[1]->tok->type, TT_OPADD);
+	expecteq(stmt->ret->params[1]->params[1]->tok, 12);
+	expecteq(state->toks.tt[stmt->ret->params[1]->params[1]->tok], TT_OPADD);
 	expecteq(stmt->ret->params[1]->params[1]->params[0]->type, EX_REGULAR);
-	expecteq(stmt->ret->params[1]->params[1]->params[0]->tok - state->toks, 8);
-	expecteq(stmt->ret->params[1]->params[1]->params[0]->tok->type, TT_OPBSHR);
+	expecteq(stmt->ret->params[1]->params[1]->params[0]->tok, 8);
+	expecteq(state->toks.tt[stmt->ret->params[1]->params[1]->params[0]->tok], TT_OPBSHR);
 	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[0]->type, EX_PRIM);
-	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[0]->tok - state->toks, 7);
-	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[0]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[0]->tok->intv, 3);
+	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[0]->tok, 7);
+	expecteq(state->toks.tt[stmt->ret->params[1]->params[1]->params[0]->params[0]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->params[1]->params[0]->params[0]->tok).intv, 3);
 	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[1]->type, EX_PRIM);
-	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[1]->tok - state->toks, 10);
-	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[1]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[1]->tok->intv, 4);
+	expecteq(stmt->ret->params[1]->params[1]->params[0]->params[1]->tok, 10);
+	expecteq(state->toks.tt[stmt->ret->params[1]->params[1]->params[0]->params[1]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->params[1]->params[0]->params[1]->tok).intv, 4);
 	expecteq(stmt->ret->params[1]->params[1]->params[1]->type, EX_PRIM);
-	expecteq(stmt->ret->params[1]->params[1]->params[1]->tok - state->toks, 13);
-	expecteq(stmt->ret->params[1]->params[1]->params[1]->tok->type, TT_INT);
-	expecteq(stmt->ret->params[1]->params[1]->params[1]->tok->intv, 5);
+	expecteq(stmt->ret->params[1]->params[1]->params[1]->tok, 13);
+	expecteq(state->toks.tt[stmt->ret->params[1]->params[1]->params[1]->tok], TT_INT);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->params[1]->params[1]->tok).intv, 5);
 	expecteq(state->ast[1].type, ST_EOF);
 
 	BENCH("Parse Parenthesis \"return 1 + (2 - (3 >> (4) + 5))\"") {
-		parse("test2.rc", "return 1 + (2 - (3 >> (4) + 5));");
-		
+		free_parser(parse("test2.rc", "return 1 + (2 - (3 >> (4) + 5));"));
 	}
 }
 
+TEST("Parse a stream \"return 1 - 2 * 0;\"") {
+	FILE* fp = fmemopen("return 1 - 2 * 0;", 17, "r");
+	RS_TokState lex;
+	tok_init_reader(&lex, tok_fread, fp);
+	struct RS_ParserState* state = parse_stream("test3.rc", &lex);
+	assert(state != NULL);
+	RS_Stmt* stmt = &state->ast[0];
+	expecteq(stmt->type, ST_RETURN);
+	expecteq(stmt->ret->tok, 2);
+	expecteq(state->toks.tt[stmt->ret->tok], TT_OPSUB);
+	expecteq(toks_val(&state->toks, stmt->ret->params[0]->tok).intv, 1);
+	expecteq(state->toks.tt[stmt->ret->params[1]->tok], TT_OPMUL);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->params[0]->tok).intv, 2);
+	expecteq(toks_val(&state->toks, stmt->ret->params[1]->params[1]->tok).intv, 0);
+	expecteq(state->ast[1].type, ST_EOF);
+	tok_free(&lex);
+	fclose(fp);
+}
+
+TEST("Parse newline terminated statements") {
+	struct RS_ParserState* state = parse("test5.rc", "return 1 +\n\t2\nreturn 3\n");
+	assert(state != NULL);
+	expecteq(state->ast[0].type, ST_RETURN);
+	expecteq(state->toks.tt[state->ast[0].ret->tok], TT_OPADD);
+	expecteq(toks_val(&state->toks, state->ast[0].ret->params[1]->tok).intv, 2);
+	expecteq(state->ast[1].type, ST_RETURN);
+	expecteq(toks_val(&state->toks, state->ast[1].ret->tok).intv, 3);
+	expecteq(state->ast[2].type, ST_EOF);
+}
+
+TEST("Flatten \"return 1 + (2 - -3) * 4;\" into post-order") {
+	struct RS_ParserState* state = parse("test6.rc", "return 1 + (2 - -3) * 4;");
+	assert(state != NULL);
+	RS_FlatAST ast = flatten(state);
+	asserteq(vlen(ast.stmts), 2);
+	expecteq(ast.stmts[0].type, ST_RETURN);
+	expecteq(ast.stmts[1].type, ST_EOF);
+	expecteq(ast.stmts[1].expr, RS_NONE);
+
+	// Every child comes before its parent, and the root is last
+	expecteq(ast.stmts[0].expr, vlen(ast.nodes) - 1);
+	for(u32 i = 0; i < vlen(ast.nodes); i ++)
+		for(u32 p = 0; p < 3; p ++)
+			if(ast.nodes[i].params[p] != RS_NONE) expect(ast.nodes[i].params[p] < i);
+
+	// Same tree as the pointer one
+	RS_FlatExpr* root = ast.nodes + ast.stmts[0].expr;
+	RS_Expr* ex = state->ast[0].ret;
+	expecteq(state->toks.tt[root->tok], TT_OPADD);
+	expecteq(root->tok, ex->tok);
+	expecteq(ast.nodes[root->params[0]].tok, ex->params[0]->tok);
+	expecteq(ast.nodes[root->params[1]].tok, ex->params[1]->tok);
+	expecteq(state->toks.tt[ast.nodes[root->params[1]].tok], TT_OPMUL);
+	free_flat(&ast);
+	free_parser(state);
+}
+
+TEST("Parse an expression nested 5000 deep") {
+	char* str = malloc(5000 * 4 + 32);
+	char* end = stpcpy(str, "return ");
+	for(u32 i = 0; i < 5000; i ++) end = stpcpy(end, "(1+");
+	end = stpcpy(end, "1");
+	for(u32 i = 0; i < 5000; i ++) *end++ = ')';
+	strcpy(end, ";");
+
+	struct RS_ParserState* state = parse("test7.rc", str);
+	assert(state != NULL);
+	RS_Expr* ex = state->ast[0].ret;
+	u32 depth = 0;
+	while(ex->type == EX_REGULAR) ex = ex->params[1], depth ++;
+	expecteq(depth, 5000);
+	expecteq(toks_val(&state->toks, ex->tok).intv, 1);
+	free_parser(state);
+	free(str);
+}
+
+TEST("Parse prefix, postfix, ternary and call operators") {
+	struct RS_ParserState* state = parse("test8.rc",
+		"return ~x * 2;"
+		"return x++ * 2;"
+		"return c ? 1 : d ? 2 : 3;"
+		"a = b += 3;"
+		"return 2 ** 3 ** 4;"
+		"return a.b.c;"
+		"return f(1, x + 2, g()) * 2;");
+	assert(state != NULL);
+
+	RS_Expr* ex = state->ast[0].ret;
+	expecteq(state->toks.tt[ex->tok], TT_OPMUL);
+	expecteq(state->toks.tt[ex->params[0]->tok], TT_OPBNOT);
+	expecteq(ex->params[0]->paramnum, 0);
+	expecteq(state->toks.tt[ex->params[0]->params[0]->tok], TT_IDENT);
+
+	ex = state->ast[1].ret;
+	expecteq(state->toks.tt[ex->tok], TT_OPMUL);
+	expecteq(state->toks.tt[ex->params[0]->tok], TT_OPINCR);
+	expecteq(ex->params[0]->paramnum, 1);
+	expecteq(state->toks.tt[ex->params[0]->params[0]->tok], TT_IDENT);
+	expect(ex->params[0]->params[1] == NULL);
+
+	// Ternaries group to the right
+	ex = state->ast[2].ret;
+	expecteq(state->toks.tt[ex->tok], TT_OPQUES);
+	expecteq(state->toks.tt[ex->params[0]->tok], TT_IDENT);
+	expecteq(toks_val(&state->toks, ex->params[1]->tok).intv, 1);
+	expecteq(state->toks.tt[ex->params[2]->tok], TT_OPQUES);
+	expecteq(toks_val(&state->toks, ex->params[2]->params[1]->tok).intv, 2);
+	expecteq(toks_val(&state->toks, ex->params[2]->params[2]->tok).intv, 3);
+
+	// So do assignments and powers
+	ex = state->ast[3].expr;
+	expecteq(state->toks.tt[ex->tok], TT_OPSET);
+	expecteq(state->toks.tt[ex->params[0]->tok], TT_IDENT);
+	expecteq(state->toks.tt[ex->params[1]->tok], TT_OPADDSET);
+	ex = state->ast[4].ret;
+	expecteq(state->toks.tt[ex->tok], TT_OPPOW);
+	expecteq(toks_val(&state->toks, ex->params[0]->tok).intv, 2);
+	expecteq(state->toks.tt[ex->params[1]->tok], TT_OPPOW);
+
+	ex = state->ast[5].ret;
+	expecteq(state->toks.tt[ex->tok], TT_OPDOT);
+	expecteq(state->toks.tt[ex->params[0]->tok], TT_OPDOT);
+	expecteq(state->toks.tt[ex->params[1]->tok], TT_IDENT);
+
+	ex = state->ast[6].ret;
+	expecteq(state->toks.tt[ex->tok], TT_OPMUL);
+	ex = ex->params[0];
+	asserteq(ex->type, EX_CALL);
+	expecteq(state->toks.tt[ex->func->tok], TT_IDENT);
+	asserteq(vlen(ex->args), 3);
+	expecteq(toks_val(&state->toks, ex->args[0]->tok).intv, 1);
+	expecteq(state->toks.tt[ex->args[1]->tok], TT_OPADD);
+	expecteq(ex->args[2]->type, EX_CALL);
+	expecteq(vlen(ex->args[2]->args), 0);
+	expecteq(state->ast[7].type, ST_EOF);
+	free_parser(state);
+
+	char* broken[] = { "return (1 + 2;", "return f(1 2);", "return c ? 1;" };
+	for(u32 i = 0; i < 3; i ++) {
+		state = parse("test9.rc", broken[i]);
+		assert(state != NULL);
+		expecteq(state->errors, 1);
+		expecteq(state->ast[0].type, ST_EOF);
+		expecteq(vlen(state->exprs), 0);
+		expecteq(vlen(state->args), 0);
+		free_parser(state);
+	}
+}
+
+// `head`, then `open` n times, `mid`, and `close` n times
+static char* repeat(const char* head, const char* open, const char* mid, const char* close, u32 n) {
+	char* str = malloc(strlen(head) + n * strlen(open) + strlen(mid) + n * strlen(close) + 2);
+	char* end = stpcpy(str, head);
+	for(u32 i = 0; i < n; i ++) end = stpcpy(end, open);
+	end = stpcpy(end, mid);
+	for(u32 i = 0; i < n; i ++) end = stpcpy(end, close);
+	strcpy(end, ";");
+	return str;
+}
+
+static void parse_flatten(char* src) {
+	struct RS_ParserState* state = parse("test10.rc", src);
+	RS_FlatAST ast = flatten(state);
+	free_flat(&ast);
+	free_parser(state);
+}
+
+TEST("Expressions parse in linear time") {
+	char* chain[2] = { repeat("return 1", " * 2 ^ 3 ** ~4", "", "", 10000), repeat("return 1", " * 2 ^ 3 ** ~4", "", "", 100000) };
+	char* nest[2] = { repeat("return ", "(1 + f(", "2", "))", 10000), repeat("return ", "(1 + f(", "2", "))", 100000) };
+	for(u32 i = 0; i < 2; i ++) {
+		struct RS_ParserState* state = parse("test10.rc", nest[i]);
+		assert(state != NULL);
+		expecteq(state->toks.tt[state->ast[0].ret->tok], TT_OPADD);
+		free_parser(state);
+	}
+
+	// Nesting on the right, with literals to settle, and a long run of prefix operators. Settling and flattening go as
+	// deep as the tree does, so they can't recurse either.
+	char* right[2] = { repeat("return 1", " ** 2", "", "", 10000), repeat("return 1", " ** 2", "", "", 100000) };
+	char* prefix = repeat("return ", "- ", "1", "", 300000);
+	char* assigns = repeat("let x = 1", " =\n1", "", "", 100000); // One line each, so the messages don't all quote all of it
+	RS_Diags d = {};
+	diags_collect(&d);
+	for(u32 i = 0; i < 3; i ++) {
+		struct RS_ParserState* state = parse("test10.rc", i == 0 ? right[1] : i == 1 ? prefix : assigns);
+		assert(state != NULL);
+		expecteq(state->errors, i == 2 ? 100000 : 0); // Literals can't be assigned to
+		RS_FlatAST ast = flatten(state);
+		u32 root = ast.stmts[0].expr;
+		expecteq(root, vlen(ast.nodes) - 1);
+		expecteq(vlen(ast.nodes), i == 1 ? 300000 : 200001); // The last `- 1` is a negative literal
+		expecteq(ast.nodes[root].ty, TY_I64);
+		expecteq(ast.nodes[0].ty, TY_I64);
+		free_flat(&ast);
+		free_parser(state);
+	}
+	diags_collect(NULL);
+	diags_free(&d);
+
+	// Ten times the input should take about ten times as long
+	benchiters(10);
+	BENCH("10k operator chain") free_parser(parse("test10.rc", chain[0]));
+	BENCH("100k operator chain") free_parser(parse("test10.rc", chain[1]));
+	BENCH("10k deep parens and calls") free_parser(parse("test10.rc", nest[0]));
+	BENCH("100k deep parens and calls") free_parser(parse("test10.rc", nest[1]));
+	BENCH("10k deep right nesting, flattened") parse_flatten(right[0]);
+	BENCH("100k deep right nesting, flattened") parse_flatten(right[1]);
+	BENCH("300k prefix operators, flattened") parse_flatten(prefix);
+	benchiters(1000);
+	for(u32 i = 0; i < 2; i ++) free(chain[i]), free(nest[i]), free(right[i]);
+	free(prefix), free(assigns);
+}
+
+TEST("Recover from errors at the next statement") {
+	struct RS_ParserState* state = parse("test11.rc",
+		"return (1 + ;\n"
+		"return 2;\n"
+		"return f(1 2) + 3;\n"
+		"x = 4 5 6;\n"
+		"return 7;;\n"
+		"}\n"
+		"return 8\n");
+	assert(state != NULL);
+	expecteq(state->errors, 4);
+	expecteq(state->warnings, 1);
+	asserteq(vlen(state->ast), 4);
+	expecteq(toks_val(&state->toks, state->ast[0].ret->tok).intv, 2);
+	expecteq(toks_val(&state->toks, state->ast[1].ret->tok).intv, 7);
+	expecteq(toks_val(&state->toks, state->ast[2].ret->tok).intv, 8);
+	expecteq(state->ast[3].type, ST_EOF);
+	free_parser(state);
+}
+
+TEST("Resolve variables to a depth and slot while parsing") {
+	struct RS_ParserState* state = parse("test16.rc",
+		"let a = 1\n"
+		"const b = a + 2\n"
+		"{\n"
+		"	let c = a * b\n"
+		"	{ let a = c; a = a + b }\n"
+		"	let d = a\n"
+		"}\n"
+		"let e = 5\n"
+		"return a + e + z\n");
+	assert(state != NULL);
+	expecteq(state->errors, 0);
+	asserteq(vlen(state->ast), 9);
+	for(u32 i = 0; i < 8; i ++) expecteq(state->ast[i].type, i == 7 ? ST_RETURN : i == 4 ? ST_EXPR : ST_DECLARE);
+
+	struct RS_Variable* a = state->ast[0].var, * b = state->ast[1].var, * c = state->ast[2].var;
+	struct RS_Variable* inner = state->ast[3].var, * d = state->ast[5].var, * e = state->ast[6].var;
+	expect(!strcmp(a->vname, "a") && !a->vcons && b->vcons);
+	expect(a->depth == 0 && a->slot == 0 && b->depth == 0 && b->slot == 1 && e->depth == 0 && e->slot == 2);
+	expect(c->depth == 1 && c->slot == 0 && inner->depth == 2 && inner->slot == 1);
+	expect(d->depth == 1 && d->slot == 1); // The inner block closed, so its slot is free again
+	expecteq(inner->sym, a->sym);
+
+	expect(b->value->params[0]->type == EX_VAR && b->value->params[0]->var == a);
+	RS_Expr* set = state->ast[4].expr;
+	expect(set->params[0]->var == inner && set->params[1]->params[0]->var == inner && set->params[1]->params[1]->var == b);
+	expect(d->value->var == a);
+	RS_Expr* ret = state->ast[7].ret;
+	expect(ret->params[0]->params[0]->var == a && ret->params[0]->params[1]->var == e);
+	expecteq(ret->params[1]->type, EX_PRIM); // Never declared
+
+	RS_FlatAST ast = flatten(state);
+	expect(ast.stmts[3].depth == 2 && ast.stmts[3].slot == 1);
+	RS_FlatExpr* use = ast.nodes + ast.stmts[5].expr; // `let d = a`, the global
+	expect(use->type == EX_VAR && use->params[0] == 0 && use->params[1] == 0);
+	free_flat(&ast);
+	free_parser(state);
+
+	// Not in scope before it's declared or after its block, and braces have to match up
+	state = parse("test16.rc", "let x = x\n{ let y = 1 }\nreturn y\n}\n{ let w = 2\n");
+	assert(state != NULL);
+	expecteq(state->errors, 2);
+	expecteq(state->ast[0].var->value->type, EX_PRIM);
+	expecteq(state->ast[2].ret->type, EX_PRIM);
+	expecteq(vlen(state->scopes), 0);
+	free_parser(state);
+
+	// Resolving doesn't care how many blocks are open or how many names are in scope
+	char* src = malloc(1 << 20);
+	char* end = src;
+	for(u32 i = 0; i < 1000; i ++) end += sprintf(end, "{ let v%u = %u\n", i, i);
+	for(u32 i = 0; i < 10000; i ++) end += sprintf(end, "x = v0 + v%u * v999\n", i % 1000);
+	for(u32 i = 0; i < 1000; i ++) *end++ = '}';
+	*end = 0;
+	state = parse("test16.rc", src);
+	assert(state != NULL);
+	expecteq(state->errors, 0);
+	expect(state->ast[1000].expr->params[1]->params[0]->var == state->ast[0].var);
+	expecteq(state->ast[1000].expr->params[1]->params[0]->var->slot, 0);
+	expecteq(state->ast[999].var->depth, 1000);
+	free_parser(state);
+	benchiters(20);
+	BENCH("Parse 10k lines using names 1000 blocks deep") free_parser(parse("test16.rc", src));
+	benchiters(1000);
+	free(src);
+}
+
+TEST("Type check and intern types") {
+	struct RS_ParserState* state = parse("test18.rc",
+		"let a: u8 = 5\n"
+		"let b: i32 = 1\n"
+		"let c = a + b\n"
+		"let n = 1 + 2 * 3\n"
+		"const k = 2.5\n"
+		"k = 1.0\n"
+		"let r: {x: u8, y: string} = q\n"
+		"let s: {\n"
+		"	y: string\n"
+		"	x: u8\n"
+		"} = r\n"
+		"let f = s.x + 1\n"
+		"s.z\n"
+		"let w: u8 = 2.5\n"
+		"let t = \"a\" + \"b\"\n"
+		"let p: *u8 = q\n"
+		"let p2: *u8 = p\n"
+		"return -a\n");
+	assert(state != NULL);
+	expecteq(state->errors, 4); // a + b, k = 1.0, s.z, w
+	asserteq(vlen(state->ast), 16);
+	RS_Stmt* ast = state->ast;
+
+	expecteq(ast[0].var->type, TY_U8);
+	expecteq(ast[0].var->value->ty, TY_U8); // The literal takes the declared type
+	expecteq(ast[2].var->type, TY_UNKNOWN);
+	expecteq(ast[3].var->type, TY_I64);
+	expecteq(ast[3].var->value->params[1]->params[0]->ty, TY_I64);
+	expecteq(ast[4].var->type, TY_F64);
+
+	u32 rec = ast[6].var->type;
+	expecteq(state->types[rec].kind, TY_RECORD);
+	expecteq(ast[7].var->type, rec); // Same fields in another order are the same type
+	expecteq(ast[8].var->type, TY_U8);
+	expecteq(ast[8].var->value->params[0]->params[1]->ty, TY_U8);
+	expecteq(ast[11].var->type, TY_STRING);
+	expecteq(ast[12].var->type, ast[13].var->type);
+	expect(state->types[ast[12].var->type].kind == TY_PTR && state->types[ast[12].var->type].inner == TY_U8);
+	expecteq(ast[14].ret->ty, TY_U8);
+	expecteq(type_size(state->types[ast[12].var->type].kind), 8);
+	expecteq(type_size(TY_U8), 1);
+
+	RS_FlatAST flat = flatten(state);
+	expecteq(flat.nodes[flat.stmts[0].expr].ty, TY_U8);
+	free_flat(&flat);
+	free_parser(state);
+
+	// A size reaches every literal under the node that meets it, not just the top one
+	state = parse("test18.rc",
+		"let a: u8 = 1\n"
+		"let c = a + (1 + 2)\n"
+		"let x: u16 = -(3 * 4)\n"
+		"let g: f32 = 1 + 2.5 * 2\n"
+		"let h = a << 1\n");
+	assert(state != NULL);
+	expecteq(state->errors, 0);
+	ast = state->ast;
+	RS_Expr* sum = ast[1].var->value->params[1];
+	expect(sum->ty == TY_U8 && sum->params[0]->ty == TY_U8 && sum->params[1]->ty == TY_U8);
+	RS_Expr* product = ast[2].var->value->params[0];
+	expect(product->ty == TY_U16 && product->params[0]->ty == TY_U16 && product->params[1]->ty == TY_U16);
+	RS_Expr* mixed = ast[3].var->value;
+	expect(mixed->params[0]->ty == TY_F32 && mixed->params[1]->params[0]->ty == TY_F32 && mixed->params[1]->params[1]->ty == TY_F32);
+	expecteq(ast[4].var->value->params[1]->ty, TY_I64); // A shift count doesn't meet the other side
+	free_parser(state);
+
+	// A record type costs about what reading it does, however many fields it has
+	char* src[2];
+	for(u32 i = 0; i < 2; i ++) {
+		u32 fields = i ? 100000 : 10000;
+		src[i] = malloc(fields * 32 + 64);
+		char* end = src[i] + sprintf(src[i], "let big: {");
+		for(u32 j = 0; j < fields; j ++) end += sprintf(end, "v%u: %s, ", j, j % 2 ? "u8" : "*i32");
+		end += sprintf(end, "} = q\nlet same: {");
+		for(u32 j = fields; j --;) end += sprintf(end, "v%u: %s, ", j, j % 2 ? "u8" : "*i32");
+		sprintf(end, "} = big\nlet last = same.v%u\n", fields - 1);
+	}
+	state = parse("test18.rc", src[0]);
+	assert(state != NULL);
+	expecteq(state->errors, 0);
+	expecteq(state->ast[1].var->type, state->ast[0].var->type);
+	expecteq(state->ast[2].var->type, TY_U8);
+	free_parser(state);
+	benchiters(5);
+	BENCH("Parse a 10k field record type twice") free_parser(parse("test18.rc", src[0]));
+	BENCH("Parse a 100k field record type twice") free_parser(parse("test18.rc", src[1]));
+	benchiters(1000);
+	free(src[0]);
+	free(src[1]);
+}
+
+TEST("Error recovery stays linear") {
+	char* src[2];
+	for(u32 i = 0; i < 2; i ++) {
+		u32 lines = i ? 100000 : 10000;
+		src[i] = malloc(lines * 32 + 1);
+		char* end = src[i];
+		for(u32 j = 0; j < lines; j ++) end = stpcpy(end, j & 1 ? "return ((f(1 2 3 4 5 + ;\n" : "x = 1 + 2 ) ) 3;\n");
+	}
+
+	// Every one of those lines is a diagnostic, nobody needs to see 110k of them
+	fflush(stderr);
+	int err = dup(2), null = open("/dev/null", O_WRONLY);
+	dup2(null, 2);
+
+	struct RS_ParserState* state = parse("test12.rc", src[1]);
+	benchiters(10);
+	BENCH("10k broken lines") free_parser(parse("test12.rc", src[0]));
+	BENCH("100k broken lines") free_parser(parse("test12.rc", src[1]));
+	benchiters(1000);
+
+	fflush(stderr);
+	dup2(err, 2);
+	close(err), close(null);
+
+	assert(state != NULL);
+	expecteq(state->errors, 100000);
+	expecteq(vlen(state->ast), 1);
+	free_parser(state);
+	free(src[0]), free(src[1]);
+}
+
+TEST("Find where a message is from a table of line starts") {
+	// 1 MB, with two-byte characters in every line
+	char* src = malloc(1 << 21), * end = src;
+	while(end - src < 1 << 20) end += sprintf(end, "let s%u = \"héllo wörld\" + %u\n", (u32) (end - src), (u32) (end - src));
+	u32 len = end - src;
+
+	u32* lines = line_starts(src);
+	u32 wrong = 0, seed = 1;
+	for(u32 i = 0; i < 500; i ++) {
+		u32 place = (seed = seed * 1664525 + 1013904223) % len, line = 1, col = 1;
+		for(u32 j = 0; j < place; j ++) {
+			if(src[j] == '\n') line ++, col = 1;
+			else col += ((u8) src[j] & 0xC0) != 0x80;
+		}
+		u32 got;
+		wrong += line_col(src, lines, place, &got) != line || got != col;
+	}
+	expecteq(wrong, 0);
+	u32 col;
+	expecteq(line_col(src, lines, strstr(src, "wörld") - src + 3, &col), 1);
+	expecteq(col, 19); // The r, with é and ö counting once each
+	expecteq(line_col(src, lines, len, NULL), vlen(lines) - 1); // The end is on the empty line after the last newline
+	vfree(lines);
+
+	// The table gets built once, then every message only has to search it
+	fflush(stderr);
+	int err = dup(2), null = open("/dev/null", O_WRONLY);
+	dup2(null, 2);
+	lines = NULL;
+	benchiters(1);
+	BENCH("10k messages at random places of a 1 MB file")
+		for(u32 i = 0; i < 10000; i ++) error_at(src, &lines, (seed = seed * 1664525 + 1013904223) % len, "test.rc", "Oops");
+	benchiters(1000);
+	fflush(stderr);
+	dup2(err, 2);
+	close(err), close(null);
+
+	expect(lines != NULL);
+	vfree(lines);
+	free(src);
+}
+
+TEST("Save a parse to the AST cache and map it back") {
+	char* src = malloc(1 << 20);
+	char* end = src;
+	for(u32 i = 0; i < 10000; i ++) end += sprintf(end, "x%u = y + %u * f(z, %u.5, \"s\" )\n", i, i, i);
+	struct RS_ParserState* state = parse("test13.rc", src);
+	assert(state != NULL);
+	u64 key = cache_key(src, end - src);
+	char* path = "parse_test.rcache";
+	assert(cache_save(path, state, key));
+
+	RS_ASTCache cache;
+	assert(cache_load(&cache, path, key));
+	RS_FlatAST ast = flatten(state);
+	asserteq(vlen(cache.ast.stmts), vlen(ast.stmts));
+	asserteq(vlen(cache.ast.nodes), vlen(ast.nodes));
+	asserteq(vlen(cache.ast.args), vlen(ast.args));
+	expect(!memcmp(cache.ast.stmts, ast.stmts, vlen(ast.stmts) * sizeof(*ast.stmts)));
+	expect(!memcmp(cache.ast.nodes, ast.nodes, vlen(ast.nodes) * sizeof(*ast.nodes)));
+	expect(!memcmp(cache.ast.args, ast.args, vlen(ast.args) * sizeof(*ast.args)));
+
+	asserteq(vlen(cache.toks), vlen(state->toks.tt));
+	bool same = true;
+	for(u32 i = 0; i < vlen(cache.toks) && same; i ++) {
+		RS_Token tok = toks_at(&state->toks, i);
+		RS_CacheTok* ctok = cache.toks + i;
+		same = ctok->type == tok.type && ctok->place == tok.place && ctok->len == tok.len && ctok->nl == tok.nl;
+		if(tok.type == TT_INT) same = same && ctok->intv == tok.intv;
+		else if(tok.type == TT_FLOAT) same = same && ctok->floatv == tok.floatv;
+		else same = same && !strcmp(cache_name(&cache, ctok), toks_data(&state->toks, i) ? tok.data : "");
+	}
+	expect(same);
+	// Names only go in once, `y` is the third token of every line
+	expecteq(state->toks.tt[2], TT_IDENT);
+	expecteq(cache.toks[2].name, cache.toks[2 + vlen(state->toks.tt) / 10000].name);
+	cache_free(&cache);
+	free_flat(&ast);
+
+	// Anything off about the file means it's stale
+	expect(!cache_load(&cache, path, key ^ 1));
+	expect(!cache_load(&cache, "does/not/exist.rcache", key));
+	FILE* fp = fopen(path, "r+b");
+	fseek(fp, 0, SEEK_END);
+	long size = ftell(fp);
+	fclose(fp);
+	assert(!truncate(path, size - 8));
+	expect(!cache_load(&cache, path, key));
+	assert(cache_save(path, state, key));
+
+	// So does an index that points out of its section, even with the key and size still right
+	assert(cache_load(&cache, path, key));
+	u32 call = 0;
+	while(cache.ast.nodes[call].type != EX_CALL) call ++; // The first line's `f(z, 0.5, "s")`
+	long spots[] = {
+		(char*) &cache.ast.stmts[0].expr - (char*) cache.map,
+		(char*) &cache.ast.nodes[5].tok - (char*) cache.map,
+		(char*) &cache.ast.nodes[call].params[2] - (char*) cache.map,
+		(char*) &cache.ast.args[1] - (char*) cache.map,
+		(char*) &cache.toks[2].name - (char*) cache.map,
+	};
+	cache_free(&cache);
+	u32 corrupt = 0;
+	for(u32 i = 0; i < sizeof(spots) / sizeof(*spots); i ++) {
+		u32 bad = UINT32_MAX - 1;
+		fp = fopen(path, "r+b");
+		fseek(fp, spots[i], SEEK_SET);
+		fwrite(&bad, sizeof(bad), 1, fp);
+		fclose(fp);
+		corrupt += !cache_load(&cache, path, key);
+		assert(cache_save(path, state, key));
+	}
+	expecteq(corrupt, 5);
+
+	benchiters(50);
+	BENCH("Parse 10k statements") free_parser(parse("test13.rc", src));
+	BENCH("Hash and map 10k statements from the cache") {
+		cache_load(&cache, path, cache_key(src, end - src));
+		cache_free(&cache);
+	}
+	benchiters(1000);
+	remove(path);
+	free_parser(state);
+	free(src);
+}
+
+// `src` with `deleted` bytes at `offset` replaced by `ins`
+static char* splice(char* src, u32 offset, u32 deleted, const char* ins) {
+	u32 len = strlen(src), n = strlen(ins);
+	char* out = malloc(len - deleted + n + 1);
+	memcpy(out, src, offset);
+	memcpy(out + offset, ins, n);
+	strcpy(out + offset + n, src + offset + deleted);
+	return out;
+}
+
+// Everything a parse made, down to which token every node points at
+static bool same_parse(struct RS_ParserState* a, struct RS_ParserState* b) {
+	close_gap(a), close_gap(b);
+	if(vlen(a->toks.tt) != vlen(b->toks.tt) || vlen(a->ast) != vlen(b->ast) || a->errors != b->errors ||
+		a->warnings != b->warnings) return false;
+	for(u32 i = 0; i < vlen(a->toks.tt); i ++) {
+		RS_Token x = toks_at(&a->toks, i), y = toks_at(&b->toks, i);
+		if(x.type != y.type || x.place != y.place || x.len != y.len || x.from != y.from || x.nl != y.nl) return false;
+		if(x.type == TT_IDENT || x.type == TT_STRING ? strcmp(x.data, y.data) : x.intv != y.intv) return false;
+	}
+	for(u32 i = 0; i < vlen(a->ast); i ++)
+		if(memcmp(a->marks + i, b->marks + i, sizeof(*a->marks))) return false;
+	RS_FlatAST x = flatten(a), y = flatten(b);
+	bool same = vlen(x.stmts) == vlen(y.stmts) && vlen(x.nodes) == vlen(y.nodes) && vlen(x.args) == vlen(y.args) &&
+		!memcmp(x.stmts, y.stmts, vlen(x.stmts) * sizeof(*x.stmts)) &&
+		!memcmp(x.nodes, y.nodes, vlen(x.nodes) * sizeof(*x.nodes)) && !memcmp(x.args, y.args, vlen(x.args) * sizeof(*x.args));
+	free_flat(&x), free_flat(&y);
+	return same;
+}
+
+TEST("Reparse only the statements an edit touched") {
+	char* src = malloc(1 << 20);
+	char* end = src;
+	for(u32 i = 0; i < 2000; i ++) end += sprintf(end, "x%u = y + %u * f(z, %u)\n", i, i, i);
+	u32 mid = strstr(src, "x1000 ") - src;
+	struct RS_ParserState* state = parse("test14.rc", src);
+	assert(state != NULL);
+	RS_Expr* second = state->ast[1].expr, * last = state->ast[1998].expr;
+
+	// Each edit applies to the source the one before it left, and after each the state has to match a fresh parse
+	struct { u32 offset, deleted; const char* ins; u32 errors; } edits[] = {
+		{ mid + 9, 4, "12345", 0 },                 // A number in the middle
+		{ mid, 0, "return (a - b) * c\n", 0 },      // A whole new statement
+		{ mid, 19, "", 0 },                         // And gone again
+		{ mid + 5, 0, ")", 1 },                     // An error
+		{ mid + 5, 1, "", 0 },                      // Fixed
+		{ mid - 1, 1, " ", 1 },                     // Two statements run together
+		{ mid - 1, 1, "\n", 0 },
+		{ 0, 0, "return 0;\n", 0 },                 // Both ends
+		{ 0, 10, "", 0 },
+		{ end - src - 1, 0, " + 1", 0 },
+	};
+	bool ok = true;
+	for(u32 i = 0; i < sizeof(edits) / sizeof(*edits) && ok; i ++) {
+		char* next = splice(src, edits[i].offset, edits[i].deleted, edits[i].ins);
+		fflush(stderr);
+		int err = dup(2), null = open("/dev/null", O_WRONLY);
+		dup2(null, 2);
+		state = reparse(state, next, edits[i].offset, edits[i].deleted, strlen(edits[i].ins));
+		struct RS_ParserState* full = parse("test14.rc", next);
+		fflush(stderr);
+		dup2(err, 2);
+		close(err), close(null);
+
+		ok = state && full && state->errors == edits[i].errors && same_parse(state, full);
+		if(!ok) expecteq(i, -1);
+		if(full) free_parser(full);
+		free(src);
+		src = next;
+	}
+	// The edits at either end only reparsed the first and last statement, the ones next to those are the very same nodes
+	if(ok) {
+		expect(state->ast[1].expr == second);
+		expect(state->ast[1998].expr == last);
+	}
+
+	// One that doesn't lex drops the state, same as parse
+	char* bad = splice(src, mid, 0, "\"");
+	fflush(stderr);
+	int err = dup(2), null = open("/dev/null", O_WRONLY);
+	dup2(null, 2);
+	expect(reparse(state, bad, mid, 0, 1) == NULL);
+	fflush(stderr);
+	dup2(err, 2);
+	close(err), close(null);
+	free(bad);
+	free(src);
+}
+
+TEST("Reparse keeps names resolved") {
+	char* src = malloc(1 << 16);
+	char* end = stpcpy(src, "let g = 1\n");
+	for(u32 i = 0; i < 200; i ++) end += sprintf(end, i % 20 ? "x = g + h%u\n" : "{ let h%u = g\nx = h%u + g }\n", i, i);
+	u32 mid = strstr(src, "x = g + h101") - src;
+	struct RS_ParserState* state = parse("test17.rc", src);
+	assert(state != NULL);
+	RS_Expr* last = state->ast[vlen(state->ast) - 2].expr;
+
+	struct { u32 offset, deleted; const char* ins; } edits[] = {
+		{ mid + 4, 1, "g2" },               // No declarations touched, tail stays
+		{ mid, 0, "let h102 = 3\n" },       // Now the uses after it resolve
+		{ mid, 13, "" },                    // And not anymore
+		{ mid, 0, "{\n" },                  // Everything after is in a block now
+		{ mid, 2, "" },
+		{ 0, 9, "let q = 1" },              // The global everything uses
+		{ 0, 9, "let g = 1" },
+	};
+	bool ok = true;
+	for(u32 i = 0; i < sizeof(edits) / sizeof(*edits) && ok; i ++) {
+		char* next = splice(src, edits[i].offset, edits[i].deleted, edits[i].ins);
+		fflush(stderr);
+		int err = dup(2), null = open("/dev/null", O_WRONLY);
+		dup2(null, 2);
+		state = reparse(state, next, edits[i].offset, edits[i].deleted, strlen(edits[i].ins));
+		struct RS_ParserState* full = parse("test17.rc", next);
+		fflush(stderr);
+		dup2(err, 2);
+		close(err), close(null);
+
+		// Symbol ids depend on what got declared first, so the globals left in scope get compared by name
+		ok = state && full && same_parse(state, full) && vlen(state->binds) == vlen(full->binds);
+		for(u32 j = 0; ok && j < vlen(full->binds); j ++)
+			ok = !strcmp(state->binds[j].var->vname, full->binds[j].var->vname) &&
+				state->bound[state->binds[j].var->sym] == full->bound[full->binds[j].var->sym];
+		if(!ok) expecteq(i, -1);
+		if(!i && ok) expect(state->ast[vlen(state->ast) - 2].expr == last);
+		if(full) free_parser(full);
+		free(src);
+		src = next;
+	}
+	free_parser(state);
+	free(src);
+}
+
+static u64 rng = 0x9E3779B97F4A7C15;
+static inline u64 next_rand(void) {
+	rng ^= rng << 13, rng ^= rng >> 7, rng ^= rng << 17;
+	return rng;
+}
+
+TEST("Reparse matches a full parse under random edits") {
+	// Lines with type errors, syntax errors, blocks and records, so counts and scopes all get carried across edits
+	const char* lines[] = {
+		"let a%u = %u\n", "x = a%u + %u\n", "{ let b = %u\ny = b + a%u }\n", "let s: u8 = %u + a%u\n", "+x=x%u%u\n",
+		"z = \"str\" - %u * %u\n", "let r: {f: u8\ng: i32} = %u%u\n", "q = (%u + %u\n", "c = a%u && %u;;\n",
+	};
+	const char* bits[] = {
+		"", ")", "(", "+", "x", "1", ";", "\n", "{", "}", "let ", "\"", ": u8", "= ", "a0", "&&", "{f: u8\n", " ",
+	};
+	u32 nlines = sizeof(lines) / sizeof(*lines), nbits = sizeof(bits) / sizeof(*bits);
+	RS_Diags d = {};
+	diags_collect(&d);
+
+	bool ok = true;
+	for(u64 seed = 1; seed <= 8 && ok; seed ++) {
+		rng = seed * 0x9E3779B97F4A7C15;
+		char* src = malloc(1 << 16);
+		char* end = src;
+		for(u32 i = 0; i < 80; i ++) end += sprintf(end, lines[next_rand() % nlines], i % 7, i);
+		struct RS_ParserState* state = parse("test25.rc", src);
+		assert(state != NULL);
+
+		for(u32 i = 0; i < 300 && ok; i ++) {
+			u32 len = strlen(src), offset = next_rand() % (len + 1), deleted = next_rand() % 6;
+			if(deleted > len - offset) deleted = len - offset;
+			const char* ins = bits[next_rand() % nbits];
+			char* next = splice(src, offset, deleted, ins);
+			struct RS_ParserState* full = parse("test25.rc", next);
+			if(!full) { free(next); continue; } // Doesn't lex, reparse would drop the state
+			state = reparse(state, next, offset, deleted, strlen(ins));
+			ok = state && same_parse(state, full);
+			if(!ok) expecteq(seed * 1000 + i, -1);
+			free_parser(full);
+			free(src);
+			src = next;
+		}
+		if(state) free_parser(state);
+		free(src);
+	}
+	diags_collect(NULL);
+	diags_free(&d);
+
+	// Errors reported while a statement was being checked belong to it, and come back when it's parsed again
+	diags_collect(&d);
+	struct RS_ParserState* state = parse("test25.rc", "+x=x");
+	state = reparse(state, "+x=)x", 3, 0, 1);
+	struct RS_ParserState* full = parse("test25.rc", "+x=)x");
+	diags_collect(NULL);
+	diags_free(&d);
+	expecteq(state->errors, full->errors);
+	expect(same_parse(state, full));
+	free_parser(state), free_parser(full);
+
+	// A record's fields end lines, so what errored after one is past where the statement got pulled up to
+	diags_collect(&d);
+	state = parse("test25.rc", "}let\nx:{b:u8\n})-l");
+	diags_collect(NULL);
+	diags_free(&d);
+	expect(state && state->errors == 2);
+	if(state) free_parser(state);
+}
+
+TEST("Reparse time follows the edit, not the file") {
+	char* src = malloc(1 << 22), * edited = malloc(1 << 22), * small = malloc(1 << 22);
+	char* end = src;
+	for(u32 i = 0; i < 50000; i ++) end += sprintf(end, "x%u = y + %u * f(z, %u)\n", i, i, i);
+	u32 mid = strstr(src, "x25000 ") - src;
+	memcpy(edited, src, mid + 10);
+	strcpy(stpcpy(edited + mid + 10, " + 1"), src + mid + 10);
+	// The same edit at the same statement of a tenth of the file
+	u32 cut = strstr(src, "x27500 ") - src, from = strstr(src, "x22500 ") - src;
+	memcpy(small, src + from, cut - from);
+	small[cut - from] = 0;
+
+	struct RS_ParserState* state = parse("test15.rc", src), * part = parse("test15.rc", small);
+	assert(state != NULL && part != NULL);
+	u32 toks = vlen(state->toks.tt);
+	benchiters(20);
+	BENCH("Parse 50k statements") free_parser(parse("test15.rc", src));
+	// The first edit moves the gap over from the end of the file, the benches time the ones after it
+	state = reparse(state, src, mid + 10, 0, 0);
+	part = reparse(part, small, mid - from + 10, 0, 0);
+	benchiters(200);
+	BENCH("Reparse 50k statements after typing and deleting 4 bytes") {
+		state = reparse(state, edited, mid + 10, 0, 4);
+		state = reparse(state, src, mid + 10, 4, 0);
+	}
+	memcpy(edited, small, mid - from + 10);
+	strcpy(stpcpy(edited + mid - from + 10, " + 1"), small + mid - from + 10);
+	BENCH("Reparse 5k statements after typing and deleting 4 bytes") {
+		part = reparse(part, edited, mid - from + 10, 0, 4);
+		part = reparse(part, small, mid - from + 10, 4, 0);
+	}
+	// Same tokens after, just a different number, so nothing past the edit has to be pointed anywhere else
+	memcpy(edited, src, strlen(src) + 1);
+	edited[mid + 14] = '7';
+	BENCH("Reparse 50k statements after changing a digit and back") {
+		state = reparse(state, edited, mid + 14, 1, 1);
+		state = reparse(state, src, mid + 14, 1, 1);
+	}
+	benchiters(1000);
+	assert(state != NULL && part != NULL);
+	close_gap(state);
+	expecteq(state->errors, 0);
+	expecteq(vlen(state->ast), 50001);
+	expecteq(vlen(state->toks.tt), toks);
+	close_gap(part);
+	expecteq(vlen(part->ast), 5001);
+	free_parser(state), free_parser(part);
+	free(src), free(edited), free(small);
+}
+
+struct parse_job {
+	char* src;
+	RS_FlatAST ast;
+	RS_TokenType* types;
+};
+
+// Keeps what came out as plain data, so it can be compared after the parser state is gone
+static int run_parse_job(void* arg) {
+	struct parse_job* job = arg;
+	struct RS_ParserState* state = parse("job.rc", job->src);
+	job->ast = flatten(state);
+	job->types = vnew();
+	vfor(job->ast.nodes, node) vpush(job->types, state->toks.tt[node->tok]);
+	free_parser(state);
+	return 0;
+}
+
+static bool same_flat(struct parse_job* a, struct parse_job* b) {
+	if(vlen(a->ast.nodes) != vlen(b->ast.nodes) || vlen(a->ast.stmts) != vlen(b->ast.stmts)) return false;
+	for(u32 i = 0; i < vlen(a->ast.stmts); i ++)
+		if(a->ast.stmts[i].type != b->ast.stmts[i].type || a->ast.stmts[i].expr != b->ast.stmts[i].expr) return false;
+	for(u32 i = 0; i < vlen(a->ast.nodes); i ++) {
+		RS_FlatExpr* x = a->ast.nodes + i, * y = b->ast.nodes + i;
+		if(x->tok != y->tok || x->type != y->type || a->types[i] != b->types[i] || memcmp(x->params, y->params, sizeof(x->params)))
+			return false;
+	}
+	return true;
+}
+
+TEST("Parse 8 sources on 8 threads the same as one after another") {
+	struct parse_job serial[8] = {}, threaded[8] = {};
+	for(u32 i = 0; i < 8; i ++) {
+		char* str = malloc(1 << 20);
+		char* end = str;
+		for(u32 j = 0; j < 3000; j ++) {
+			end += sprintf(end, "return %u + (%u - -%u) * ~%u", i, j, i * j, j % 7);
+			for(u32 k = 0; k < (i + j) % 40; k ++) end = stpcpy(end, " ^ (2 * (3 + 4)");
+			for(u32 k = 0; k < (i + j) % 40; k ++) *end++ = ')';
+			end = stpcpy(end, ";\n");
+		}
+		serial[i].src = threaded[i].src = str;
+		run_parse_job(serial + i);
+	}
+
+	thrd_t workers[8];
+	for(u32 i = 0; i < 8; i ++) thrd_create(workers + i, run_parse_job, threaded + i);
+	for(u32 i = 0; i < 8; i ++) thrd_join(workers[i], NULL);
+
+	for(u32 i = 0; i < 8; i ++) {
+		expect(same_flat(serial + i, threaded + i));
+		free_flat(&serial[i].ast), free_flat(&threaded[i].ast);
+		vfree(serial[i].types), vfree(threaded[i].types);
+		free(serial[i].src);
+	}
+}
+
+TEST("Parse a 1000 file project on a work-stealing pool") {
+	RS_SourceFile files[1000];
+	for(u32 i = 0; i < 1000; i ++) {
+		// Every 50th file is much bigger, so the even split at the start leaves some workers with way more to do
+		u32 lines = i % 50 ? 100 : 5000;
+		char* str = malloc(lines * 64 + 1);
+		char* end = str;
+		for(u32 j = 0; j < lines; j ++) end += sprintf(end, "return %u + %u * (%u - 1) >> 2 ^ 7;\n", i, j, i + j);
+		files[i].src = str;
+		files[i].file = malloc(16);
+		files[i].cache = NULL;
+		sprintf(files[i].file, "mod%u.rc", i);
+	}
+
+	RS_Modules mods = parse_modules(files, 1000, 8);
+	expecteq(mods.failed, 0);
+	expecteq(mods.n, 1000);
+	bool ok = true;
+	for(u32 i = 0; i < 1000 && ok; i ++) {
+		u32 at = find_module(&mods, files[i].file);
+		struct RS_ParserState* st = at == RS_NONE ? NULL : mods.states[at];
+		ok = at == i && vlen(st->ast) == (i % 50 ? 100 : 5000) + 1 && toks_val(&st->toks, 1).intv == i;
+	}
+	expect(ok);
+	free_modules(&mods);
+
+	RS_SourceFile missing = { .file = "does/not/exist.rc" };
+	mods = parse_modules(&missing, 1, 8);
+	expecteq(mods.failed, 1);
+	expect(mods.states[0] == NULL);
+	expecteq(find_module(&mods, missing.file), RS_NONE);
+	free_modules(&mods);
+
+	benchiters(5);
+	BENCH("1000 files on 1 thread") { mods = parse_modules(files, 1000, 1); free_modules(&mods); }
+	BENCH("1000 files on 2 threads") { mods = parse_modules(files, 1000, 2); free_modules(&mods); }
+	BENCH("1000 files on 4 threads") { mods = parse_modules(files, 1000, 4); free_modules(&mods); }
+	BENCH("1000 files on 8 threads") { mods = parse_modules(files, 1000, 8); free_modules(&mods); }
+	benchiters(1000);
+	for(u32 i = 0; i < 1000; i ++) free(files[i].src), free(files[i].file);
+}
+
+TEST("Map files that haven't changed from their caches") {
+	RS_SourceFile files[9];
+	char* srcs[9];
+	for(u32 i = 0; i < 9; i ++) {
+		srcs[i] = malloc(64);
+		sprintf(srcs[i], i == 7 ? "return %u +\n" : "let a = %u\nreturn a * 2 + f(a, 3)\n", i);
+		files[i].file = malloc(32), files[i].cache = malloc(32);
+		sprintf(files[i].file, "cached%u.rc", i);
+		sprintf(files[i].cache, "cached%u.rcache", i);
+		files[i].src = srcs[i];
+	}
+	// One gets mapped in from disk by the driver, as a whole source to hash
+	FILE* fp = fopen(files[8].file, "wb");
+	assert(fp);
+	fputs(srcs[8], fp);
+	fclose(fp);
+	files[8].src = NULL;
+
+	// The first time everything parses, and everything without errors gets saved
+	RS_Diags d = {};
+	diags_collect(&d);
+	RS_Modules first = parse_modules(files, 9, 4);
+	expecteq(first.failed, 1);
+	bool parsed = true;
+	for(u32 i = 0; i < 9; i ++) parsed = parsed && first.states[i] && !first.caches[i].map;
+	expect(parsed);
+
+	// Then only the one that changed and the one with errors do
+	srcs[3][8] = '9';
+	RS_Modules again = parse_modules(files, 9, 4);
+	diags_collect(NULL);
+	expecteq(again.failed, 1);
+	expecteq(vlen(d.list), 2); // Nothing repeats the other messages
+	bool same = true;
+	for(u32 i = 0; i < 9; i ++) {
+		bool cached = i != 3 && i != 7;
+		same = same && !again.states[i] == cached && !again.caches[i].map == !cached;
+		if(!cached || !same) continue;
+		same = same && find_module(&again, files[i].file) == i; // Cached ones are found by name like the rest
+		RS_FlatAST ast = flatten(first.states[i]);
+		RS_FlatAST* from = &again.caches[i].ast;
+		same = vlen(from->nodes) == vlen(ast.nodes) && !memcmp(from->nodes, ast.nodes, vlen(ast.nodes) * sizeof(*ast.nodes)) &&
+			vlen(from->stmts) == vlen(ast.stmts) && !memcmp(from->stmts, ast.stmts, vlen(ast.stmts) * sizeof(*ast.stmts));
+		free_flat(&ast);
+	}
+	expect(same);
+	expecteq(toks_val(&again.states[3]->toks, 3).intv, 9);
+
+	free_modules(&first);
+	free_modules(&again);
+	diags_free(&d);
+	remove(files[8].file);
+	for(u32 i = 0; i < 9; i ++) {
+		remove(files[i].cache);
+		free(files[i].file), free(files[i].cache), free(srcs[i]);
+	}
+}
+
+// Everything a sink writes out in `format`
+static char* flushed(RS_Diags* d, RS_DiagFormat format) {
+	FILE* f = tmpfile();
+	diags_flush(d, f, format);
+	long len = ftell(f);
+	char* out = calloc(len + 1, 1);
+	rewind(f);
+	fread(out, 1, len, f);
+	fclose(f);
+	return out;
+}
+
+TEST("Collect messages and write them out as carets, JSON or SARIF") {
+	RS_Diags d = {};
+	diags_collect(&d);
+	struct RS_ParserState* state = parse("test19.rc", "let a = 1\nlet b = \"ü\" + ;\n");
+	diags_collect(NULL);
+	assert(state != NULL);
+	expecteq(state->errors, 1);
+	free_parser(state);
+
+	// Still there with the parse gone
+	assert(d.list != NULL);
+	expecteq(vlen(d.list), 1);
+	expecteq(d.list[0].severity, SEV_ERROR);
+	expecteq(d.list[0].line, 2);
+	expecteq(d.list[0].col, 16);
+	expect(!strcmp(d.text + d.list[0].file, "test19.rc"));
+
+	RS_Diags copy = {};
+	diags_merge(&copy, &d);
+	expecteq(vlen(d.list), 0);
+	diags_merge(&d, &copy);
+	diags_free(&copy);
+	char* caret = flushed(&d, DIAG_CARET);
+	expect(strstr(caret, "test19.rc@2:16: error: ") == caret);
+	expect(strstr(caret, "\n2 | let b = \"ü\" + ;\n  | " "               ^\n")); // No colors, it isn't a terminal
+	char* empty = flushed(&d, DIAG_JSON);
+	expect(!*empty); // Flushing emptied it
+	free(empty);
+
+	diags_collect(&d);
+	free_parser(parse("test19.rc", "let a = 1\nlet b = \"ü\" + ;\n"));
+	free_parser(parse("test19.rc", "return \"a\\tb\" +;"));
+	diags_collect(NULL);
+	char* json = flushed(&d, DIAG_JSON);
+	expect(strstr(json, "{\"severity\": \"error\", \"file\": \"test19.rc\", \"line\": 2, \"column\": 16, \"offset\": 26"));
+	expect(json[0] == '[' && strstr(json, "},\n\t{") && !strcmp(json + strlen(json) - 4, "}\n]\n"));
+
+	diags_collect(&d);
+	free_parser(parse("test19.rc", "let a = 1\nlet b = \"ü\" + ;\n"));
+	diags_collect(NULL);
+	char* sarif = flushed(&d, DIAG_SARIF);
+	expect(strstr(sarif, "\"version\": \"2.1.0\""));
+	expect(strstr(sarif, "\"region\": {\"startLine\": 2, \"startColumn\": 16}"));
+	free(caret), free(json), free(sarif);
+
+	// Parallel parses come out in the order of the files, no matter which thread got which
+	RS_SourceFile files[64];
+	for(u32 i = 0; i < 64; i ++) {
+		files[i].file = malloc(16);
+		sprintf(files[i].file, "bad%u.rc", i);
+		files[i].src = i % 3 ? "return 1 +;\nreturn 2 +;\n" : "return 1;\n";
+		files[i].cache = NULL;
+	}
+	char* runs[2];
+	for(u32 run = 0; run < 2; run ++) {
+		diags_collect(&d);
+		RS_Modules mods = parse_modules(files, 64, 8);
+		diags_collect(NULL);
+		expecteq(vlen(d.list), 42 * 2);
+		bool ordered = true;
+		for(u32 i = 0; i < vlen(d.list); i ++) {
+			u32 n = i / 2 + i / 4 + 1; // The files that have errors: 1, 2, 4, 5, 7, ...
+			char name[16];
+			sprintf(name, "bad%u.rc", n);
+			ordered &= !strcmp(d.text + d.list[i].file, name) && d.list[i].line == i % 2 + 1;
+		}
+		expect(ordered);
+		runs[run] = flushed(&d, DIAG_CARET);
+		free_modules(&mods);
+	}
+	expect(!strcmp(runs[0], runs[1]));
+	free(runs[0]), free(runs[1]);
+	for(u32 i = 0; i < 64; i ++) free(files[i].file);
+	diags_free(&d);
+}
+
+TEST("Parse 10k expression statements") {
+	char* str = malloc(1 << 20);
+	char* end = str;
+	for(u32 i = 0; i < 10000; i ++) end += sprintf(end, "return %u + %u * (%u - 1) >> 2 ^ 7;\n", i, i + 1, i + 2);
+
+	struct RS_ParserState* state = parse("test4.rc", str);
+	assert(state != NULL);
+	u32 n = vlen(state->toks.tt);
+	asserteq(vlen(state->toks.place), n);
+	asserteq(vlen(state->toks.from), n);
+	asserteq(vlen(state->toks.val), n);
+	// Only the numbers have a value, and each has its own
+	u32 valued = 0;
+	for(u32 i = 0; i < n; i ++) valued += state->toks.val[i] != TOK_NOVAL;
+	expecteq(valued, 60000);
+	expecteq(vlen(state->toks.vals), 60000);
+	expecteq(state->ast[10000].type, ST_EOF);
+
+	benchiters(20);
+	BENCH("Parse 10k expression statements") free_parser(parse("test4.rc", str));
+	benchiters(1000);
+	free(str);
+}
+
 #include "tests_end.h"
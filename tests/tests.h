@@ -1,5 +1,5 @@
 /*
- * tests.h v3.2.6 - Aqil Contractor @AqilC 2024
+ * tests.h v3.3.0 - Aqil Contractor @AqilC 2024
  * Licenced under Attribution-NonCommercial-ShareAlike 3.0
  *
  * This file is the beginning file of the 'tests.h' testing framework made by Aqil Contractor. To use this framework,
@@ -26,8 +26,23 @@
  * 1 / 2 tests passed. Took 0.00 ms
  *
  *
+ * Benchmarks:
+ * BENCH("name") { ... } runs its body benchiters(n) times (1000 by default) and prints the time per iteration. That's one
+ * mean, too noisy to trust for differences of a few percent. Setting TESTS_BENCH_SAMPLES, in the environment or as a
+ * define, times each bench statistically instead:
+ * - TESTS_BENCH_SAMPLES=n     How many batches to time, up to 1000. 0 is the plain mode above.
+ * - TESTS_BENCH_SAMPLE_MS=ms  How long a batch should take, 10 by default. The iterations per batch double until one
+ *                             does, so benchiters doesn't matter here. Bodies have to cope with any number of runs.
+ * - TESTS_BENCH_WARMUP=n      Batches to run and throw away before timing, 3 by default.
+ * - TESTS_BENCH_CPU=n         Pins the whole process to one CPU, threads a bench starts included.
+ * - TESTS_BENCH_JSON=path     Writes every bench's median, p95, mean, stddev and raw samples there, to compare runs.
+ * Each bench then prints samples x iterations, the median time per iteration, the p95 and the stddev as a percentage of
+ * the median. benchran() is how many iterations the last bench did, in either mode.
+ *
+ *
  * Version History:
  * - Other versions only include minor changes, bug fixes, or small features.
+ * - 3.3.0 - Add statistical benchmarks.
  * - 3.2.0 - Remove some macros used internally.
  * - 3.1.0 - Change test output colors.
  * - 3.0.0 - Change test syntax completely, allowing SUB("subtest name") {} instead of subtest("subtest name"); ... subend();
@@ -39,6 +54,8 @@
 
 
 
+#include <stdlib.h>
+
 #ifndef NO_PRINT
 #include <stdio.h>
 #include <string.h>
@@ -62,6 +79,37 @@ _Bool subtest_done = 0;
 int tests_benchprogress;
 int tests_benchiters = 1000;
 
+// Statistical benchmarks, off unless there are samples to take. See the top of the file.
+#ifndef TESTS_BENCH_SAMPLES
+#define TESTS_BENCH_SAMPLES 0
+#endif
+#ifndef TESTS_BENCH_WARMUP
+#define TESTS_BENCH_WARMUP 3
+#endif
+#ifndef TESTS_BENCH_SAMPLE_MS
+#define TESTS_BENCH_SAMPLE_MS 10
+#endif
+#ifndef TESTS_BENCH_CPU
+#define TESTS_BENCH_CPU -1
+#endif
+#define TESTS_MAXSAMPLES 1000
+int tests_benchsamples = TESTS_BENCH_SAMPLES;
+int tests_benchwarmup = TESTS_BENCH_WARMUP;
+double tests_benchsampletime = TESTS_BENCH_SAMPLE_MS / 1000.0;
+int tests_benchcpu = TESTS_BENCH_CPU;
+int tests_benchbatch;    // Iterations between two looks at the clock
+int tests_benchstage;    // -1 while working out the batch, then how many batches were timed, warmup ones included
+double tests_benchtotal;
+unsigned long long tests_benchbegin;
+double tests_benchtimes[TESTS_MAXSAMPLES]; // Seconds per iteration of each kept batch
+const char* tests_benchname;
+const char* tests_benchfile;
+int tests_benchcount;
+unsigned long long tests_benchran; // Iterations the last bench really did
+#ifndef NO_PRINT
+FILE* tests_benchjson;
+#endif
+
 
 char testtempbuf[1000];
 
@@ -142,6 +190,9 @@ LONG WINAPI plswork(PEXCEPTION_POINTERS pinfo) {
 #include <sys/ioctl.h>
 #include <unistd.h>
 #include <signal.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
 
 static inline unsigned long long get_precise_time() {
 	struct timespec t = {0};
@@ -351,8 +402,10 @@ static inline _Bool subend_(void) {
 
 
 #define benchiters(x) tests_benchiters = (x)
-#define BENCH(x) do { printf("\n" SUBTESTINDENT TERMGRAY "Bench: " x TERMRESET " %-*s", (int) (TESTNAMELIMIT - 7 - sizeof(SUBTESTINDENT) + 1 - sizeof(""x"") + 1), ""); tests_starttime = get_precise_time(); tests_benchprogress = 0; } while(0); while ((tests_benchprogress++) < tests_benchiters || benchend_())
-#define SUBBENCH() if(last_subtest_failed) tests_benchprogress = tests_benchiters; else { printf("\n" SUBTESTINDENT SUBTESTINDENT TERMGRAY "Bench for %s" TERMRESET " %-*s", tests_cursubtest, (int) (TESTNAMELIMIT - 10 - sizeof(SUBTESTINDENT SUBTESTINDENT) + 1 - strlen(tests_cursubtest)), ""); tests_starttime = get_precise_time(); tests_benchprogress = 0; } while ((tests_benchprogress++) < tests_benchiters || benchend_())
+// How many times the last bench ran its body, for checking what it added up
+#define benchran() tests_benchran
+#define BENCH(x) do { printf("\n" SUBTESTINDENT TERMGRAY "Bench: " x TERMRESET " %-*s", (int) (TESTNAMELIMIT - 7 - sizeof(SUBTESTINDENT) + 1 - sizeof(""x"") + 1), ""); tests_benchname = (x); tests_benchfile = __FILE__; benchstart_(); } while(0); while ((tests_benchprogress++) < tests_benchbatch || benchnext_())
+#define SUBBENCH() if(last_subtest_failed) tests_benchname = NULL, tests_benchprogress = tests_benchbatch = tests_benchiters; else { printf("\n" SUBTESTINDENT SUBTESTINDENT TERMGRAY "Bench for %s" TERMRESET " %-*s", tests_cursubtest, (int) (TESTNAMELIMIT - 10 - sizeof(SUBTESTINDENT SUBTESTINDENT) + 1 - strlen(tests_cursubtest)), ""); tests_benchname = tests_cursubtest; tests_benchfile = __FILE__; benchstart_(); } while ((tests_benchprogress++) < tests_benchbatch || benchnext_())
 
 static inline _Bool benchend_() {
 	// printf("\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\bstart: %lld, end: %lld", tests_starttime, get_precise_time());
@@ -374,6 +427,147 @@ static inline _Bool benchend_() {
 	return 0;
 }
 
+// Scale and unit to print a time in seconds with
+static inline double tests_timeunit_(double t, char** unit) {
+	if(t < 9.9e-6) return *unit = "ns", 1000000000.0;
+	if(t < 9.9e-3) return *unit = "\u03BCs", 1000000.0;
+	return *unit = "ms", 1000.0;
+}
+
+static double tests_sqrt_(double x) {
+	double r = x > 1 ? x : 1;
+	if(x <= 0) return 0;
+	for(int i = 0; i < 64; i ++) r = (r + x / r) / 2;
+	return r;
+}
+
+static int tests_cmpdouble_(const void* a, const void* b) {
+	double x = *(const double*) a, y = *(const double*) b;
+	return (x > y) - (x < y);
+}
+
+#ifndef NO_PRINT
+static void tests_jsonstr_(FILE* f, const char* s) {
+	fputc('"', f);
+	for(; *s; s ++)
+		if(*s == '"' || *s == '\\') fprintf(f, "\\%c", *s);
+		else if((unsigned char) *s < 0x20) fprintf(f, "\\u%04x", *s);
+		else fputc(*s, f);
+	fputc('"', f);
+}
+#endif
+
+static inline void benchstart_(void) {
+	tests_benchprogress = 0;
+	tests_benchbatch = tests_benchsamples ? 1 : tests_benchiters;
+	tests_benchstage = -1;
+	tests_benchtotal = 0;
+	tests_benchran = 0;
+	tests_benchbegin = tests_starttime = get_precise_time();
+}
+
+// Works out the spread of the batches that were timed, prints it and adds it to the JSON
+static _Bool benchstats_(void) {
+	int n = tests_benchsamples;
+	double sorted[TESTS_MAXSAMPLES], mean = 0, var = 0;
+	memcpy(sorted, tests_benchtimes, n * sizeof(double));
+	qsort(sorted, n, sizeof(double), tests_cmpdouble_);
+	for(int i = 0; i < n; i ++) mean += sorted[i];
+	mean /= n;
+	for(int i = 0; i < n; i ++) var += (sorted[i] - mean) * (sorted[i] - mean);
+	double stddev = n > 1 ? tests_sqrt_(var / (n - 1)) : 0;
+	double median = n & 1 ? sorted[n / 2] : (sorted[n / 2 - 1] + sorted[n / 2]) / 2;
+	double p95 = sorted[(n * 95 + 99) / 100 - 1];
+
+	char* timeunit, * ttimeunit;
+	double tmul = tests_timeunit_(median, &timeunit);
+	double ttmul = tests_timeunit_(tests_benchtotal, &ttimeunit);
+	int width = snprintf(NULL, 0, "%dx%d", n, tests_benchbatch);
+	printf("%.*s" TERMYELLOW "%dx%d " TERMBLUE "%04.0f %s/iter" TERMGRAY " p95 %04.0f ±%.1f%%" TERMRESET " " TERMBLUEBG " %04.0f %s " TERMRESET,
+		8 + width, "\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b\b", n, tests_benchbatch, median * tmul, timeunit, p95 * tmul,
+		median > 0 ? stddev / median * 100 : 0, tests_benchtotal * ttmul, ttimeunit);
+
+	#ifndef NO_PRINT
+	FILE* f = tests_benchjson;
+	if(f) {
+		fprintf(f, "%s\n\t\t{ \"file\": ", tests_benchcount++ ? "," : "");
+		tests_jsonstr_(f, tests_benchfile);
+		fprintf(f, ", \"name\": ");
+		tests_jsonstr_(f, tests_benchname);
+		fprintf(f, ", \"iters_per_sample\": %d, \"median_ns\": %.2f, \"p95_ns\": %.2f, \"mean_ns\": %.2f, \"stddev_ns\": %.2f, \"min_ns\": %.2f, \"max_ns\": %.2f, \"samples_ns\": [",
+			tests_benchbatch, median * 1e9, p95 * 1e9, mean * 1e9, stddev * 1e9, sorted[0] * 1e9, sorted[n - 1] * 1e9);
+		for(int i = 0; i < n; i ++) fprintf(f, "%s%.2f", i ? ", " : "", tests_benchtimes[i] * 1e9);
+		fprintf(f, "] }");
+	}
+	#endif
+	tests_starttime = tests_benchbegin;
+	return 0;
+}
+
+/*
+ * Runs at the end of every batch of a bench, saying whether to go again. Without samples a bench is the one batch of
+ * tests_benchiters. With them, the batch doubles until it takes long enough to time (which warms up caches and branch
+ * predictors too), then a few more get thrown away and the rest are kept.
+ */
+static _Bool benchnext_(void) {
+	tests_benchran += tests_benchbatch;
+	if(!tests_benchsamples) return benchend_();
+	if(!tests_benchname) return 0;
+
+	double passed_time = (double) (get_precise_time() - tests_starttime) / tests_clocks_per_sec;
+	tests_totaltime += passed_time;
+	tests_benchtotal += passed_time;
+	if(tests_benchstage < 0) {
+		if(passed_time < tests_benchsampletime && tests_benchbatch < (1 << 30)) tests_benchbatch *= 2;
+		else tests_benchstage = 0;
+	} else {
+		if(tests_benchstage >= tests_benchwarmup) tests_benchtimes[tests_benchstage - tests_benchwarmup] = passed_time / tests_benchbatch;
+		if(++tests_benchstage == tests_benchwarmup + tests_benchsamples) return benchstats_();
+	}
+
+	tests_benchprogress = 1;
+	tests_starttime = get_precise_time();
+	return 1;
+}
+
+// Reads the bench settings, see the top of the file
+static void benchconfig_(void) {
+	char* env;
+	if((env = getenv("TESTS_BENCH_SAMPLES"))) tests_benchsamples = atoi(env);
+	if((env = getenv("TESTS_BENCH_WARMUP"))) tests_benchwarmup = atoi(env);
+	if((env = getenv("TESTS_BENCH_SAMPLE_MS"))) tests_benchsampletime = atof(env) / 1000.0;
+	if((env = getenv("TESTS_BENCH_CPU"))) tests_benchcpu = atoi(env);
+	if(tests_benchsamples < 0) tests_benchsamples = 0;
+	if(tests_benchsamples > TESTS_MAXSAMPLES) tests_benchsamples = TESTS_MAXSAMPLES;
+	if(tests_benchwarmup < 0) tests_benchwarmup = 0;
+
+	if(tests_benchcpu >= 0) {
+		#if defined(_WIN32)
+			SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR) 1 << tests_benchcpu);
+		#elif defined(__linux__)
+			// The syscall itself, glibc's wrapper needs _GNU_SOURCE defined before anything gets included
+			unsigned long set[1024 / (8 * sizeof(long))] = {0};
+			set[tests_benchcpu / (8 * sizeof(long)) % (sizeof(set) / sizeof(long))] |= 1ul << tests_benchcpu % (8 * sizeof(long));
+			if(syscall(SYS_sched_setaffinity, 0, sizeof(set), set)) printf(TERMREDBOLD "Couldn't pin to CPU %d." TERMRESET "\n", tests_benchcpu);
+		#endif
+	}
+
+	#ifndef NO_PRINT
+	if(tests_benchsamples && (env = getenv("TESTS_BENCH_JSON"))) {
+		if(!(tests_benchjson = fopen(env, "w"))) printf(TERMREDBOLD "Couldn't open '%s'." TERMRESET "\n", env);
+		else fprintf(tests_benchjson, "{\n\t\"samples\": %d, \"warmup\": %d, \"sample_ms\": %g, \"cpu\": %d,\n\t\"benches\": [",
+			tests_benchsamples, tests_benchwarmup, tests_benchsampletime * 1000.0, tests_benchcpu);
+	}
+	#endif
+}
+
+static void benchclose_(void) {
+	#ifndef NO_PRINT
+	if(tests_benchjson) fprintf(tests_benchjson, "\n\t]\n}\n"), fclose(tests_benchjson);
+	tests_benchjson = NULL;
+	#endif
+}
+
 // ---------------------------------------------------- Macro based testing framework starts here ----------------------------------------------------
 
 #define TESTCONCAT(a, b) a##b
@@ -41,6 +41,7 @@ int main() {
 	#endif
 
 
+	benchconfig_();
 	if(init) init();
 
 	// Generates the array of funcs that are the tests in the file
@@ -121,5 +122,6 @@ int main() {
 	else if(failed == tests) printf(TERMREDBOLD "All tests failed. Spectacular." TERMRESET);
 	else printf("%d / %d tests passed.", tests - failed, tests);
 	printf(" Took " TERMBLUEBOLD "%.2f ms" TERMRESET "\n", tests_totaltime * 1000.0);
+	benchclose_();
 	return 0;
 }
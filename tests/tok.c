@@ -47,6 +47,24 @@ TEST("Tokenize a string: '\"Hello World\"'") {
 	freetoks(tok);
 }
 
+TEST("Tokenize what comes right after a string: '\"a\"+1', '\"b\"\\nc'") {
+	RS_Token* tok = tokenize("\"a\"+1");
+	expecteq(tok[0].type, TT_STRING);
+	expectstreq(tok[0].data, "\"a\"");
+	expecteq(tok[1].type, TT_OPADD);
+	expecteq(tok[2].type, TT_INT);
+	expecteq(tok[3].type, TT_EOF);
+	freetoks(tok);
+
+	// The newline after the quote is still seen, so it ends the statement
+	tok = tokenize("\"b\"\nc");
+	expecteq(tok[0].type, TT_STRING);
+	expecteq(tok[1].type, TT_PSEMICOLON);
+	expecteq(tok[2].type, TT_IDENT);
+	expecteq(tok[3].type, TT_EOF);
+	freetoks(tok);
+}
+
 TEST("Tokenize Operators: '+ - * / = += <<= => ++ == != a.b'") {
 	char* str = "+ - * / = += <<= => ++ == != a.b";
 	RS_Token* tok = tokenize(str);
@@ -56,7 +74,7 @@ TEST("Tokenize Operators: '+ - * / = += <<= => ++ == != a.b'") {
 	expecteq(tok[3].type, TT_OPDIV);
 	expecteq(tok[4].type, TT_OPSET);
 	expecteq(tok[5].type, TT_OPADDSET);
-	expecteq(tok[6].type, TT_OPBSHIFTLEFTSET);
+	expecteq(tok[6].type, TT_OPBSHLSET);
 	expecteq(tok[7].type, TT_PARROW);
 	expecteq(tok[8].type, TT_OPINCR);
 	expecteq(tok[9].type, TT_CEQ);
@@ -97,4 +115,251 @@ TEST("Tokenize a main function: 'fn main() {}'") {
   freetoks(tok);
 }
 
+TEST("Insert semicolons at line ends: 'a = b\\n+ c\\nreturn\\nx++\\n(y)'") {
+	char* str = "a = b\n+ c\nreturn\nx++\n(y)";
+	RS_Token* tok = tokenize(str);
+	RS_TokenType types[] = { TT_IDENT, TT_OPSET, TT_IDENT, TT_OPADD, TT_IDENT, TT_PSEMICOLON, TT_KRETURN, TT_PSEMICOLON,
+		TT_IDENT, TT_OPINCR, TT_POPENPAR, TT_IDENT, TT_PCLOSEPAR, TT_EOF };
+	asserteq(vlen(tok), sizeof(types) / sizeof(*types));
+	for(u32 i = 0; i < vlen(tok); i ++) expecteq(tok[i].type, types[i]);
+	expect(tok[3].nl);
+	expect(isvirtual(tok + 5));
+	expecteq(tok[5].place, 9);
+	expecteq(tok[7].place, 16);
+	freetoks(tok);
+}
+
+TEST("Semicolon insertion stays linear") {
+	char* str = malloc(500000 * 4 + 1);
+	char* semis = malloc(500000 * 4 + 1);
+	for(u32 i = 0; i < 500000; i ++) memcpy(str + i * 4, "x++\n", 4), memcpy(semis + i * 4, "x++;", 4);
+	str[500000 * 4] = semis[500000 * 4] = 0;
+
+	RS_Token* tok = tokenize(str);
+	expecteq(vlen(tok), 500000 * 3); // No semicolon before TT_EOF
+	freetoks(tok);
+
+	benchiters(10);
+	BENCH("Explicit semicolons") freetoks(tokenize(semis));
+	BENCH("Inserted semicolons") freetoks(tokenize(str));
+	str[250000 * 4] = 0;
+	BENCH("Inserted semicolons, half the input") freetoks(tokenize(str));
+	benchiters(1000);
+	free(semis);
+	free(str);
+}
+
+// Hands out the source a few bytes at a time so tokens end up straddling chunks
+struct chunked { char* str; u32 step; };
+static u32 read_chunked(void* ctx, char* buf, u32 cap) {
+	struct chunked* src = ctx;
+	u32 len = strnlen(src->str, src->step < cap ? src->step : cap);
+	memcpy(buf, src->str, len);
+	src->str += len;
+	return len;
+}
+
+TEST("Stream in 3 byte chunks: 'let abc = 1234 + \"hello\" <<= 5.25;'") {
+	char* str = "let abc = 1234 + \"hello\" <<= 5.25;";
+	RS_Token* tok = tokenize(str);
+	struct chunked src = { str, 3 };
+	RS_TokState st;
+	tok_init_reader(&st, read_chunked, &src);
+	for(u32 i = 0; i < vlen(tok); i ++) {
+		RS_Token streamed = tok_next(&st);
+		expecteq(streamed.type, tok[i].type);
+		expecteq(streamed.place, tok[i].place);
+		expecteq(streamed.len, tok[i].len);
+		if(tok[i].type == TT_IDENT || tok[i].type == TT_STRING) expectstreq(streamed.data, tok[i].data);
+	}
+	expecteq(tok_next(&st).type, TT_EOF);
+	tok_free(&st);
+	freetoks(tok);
+}
+
+// Writes `len` bytes of `str` to `path`, to be mapped back in
+static bool write_file(char* path, char* str, u32 len) {
+	FILE* fp = fopen(path, "wb");
+	if(!fp) return false;
+	bool ok = fwrite(str, 1, len, fp) == len;
+	return !fclose(fp) && ok;
+}
+
+TEST("Lex mapped files in place") {
+	// A file that fills its last page exactly has no zeroes of its own after it, one ending in an identifier needs them
+	char* str = malloc(4096 + 1);
+	memset(str, ' ', 4096);
+	memcpy(str, "let abc = 1234 + \"hello\"\n", 26);
+	memcpy(str + 4096 - 3, "xyz", 3);
+	str[4096] = 0;
+
+	for(u32 len = 4096; len >= 4090; len -= 3) {
+		char saved = str[len];
+		str[len] = 0;
+		RS_Token* tok = tokenize(str);
+		assert(write_file("tok_test.rc", str, len));
+		RS_TokState st;
+		assert(tok_init_file(&st, "tok_test.rc"));
+		expect(st.buf == st.map && !st.read); // Straight out of the mapping, no window to copy into
+		bool same = true;
+		for(u32 i = 0; i < vlen(tok) && same; i ++) {
+			RS_Token mapped = tok_next(&st);
+			same = mapped.type == tok[i].type && mapped.place == tok[i].place && mapped.len == tok[i].len;
+			if(tok[i].type == TT_IDENT || tok[i].type == TT_STRING) same = same && !strcmp(mapped.data, tok[i].data), free(mapped.data);
+		}
+		expect(same);
+		tok_free(&st);
+		freetoks(tok);
+		str[len] = saved;
+	}
+	remove("tok_test.rc");
+	free(str);
+}
+
+TEST("Parallel tokenize matches serial on a 4 MB source") {
+	char* lines[] = { "let abc = 12 * (x >> 3);\n", "y = \"multi\nline\";\n", "a = b .\n", "c\n", "x =\n", "-5 + z\n" };
+	char* str = malloc(4 << 20);
+	char* end = str;
+	for(u32 i = 0; end - str < (4 << 20) - 64; i ++) end = stpcpy(end, lines[i * 7 % 6]);
+
+	RS_Token* tok = tokenize(str);
+	RS_Token* par = tokenize_parallel(str, 4);
+	asserteq(vlen(par), vlen(tok));
+	for(u32 i = 0; i < vlen(tok); i ++)
+		if(par[i].type != tok[i].type || par[i].place != tok[i].place || par[i].len != tok[i].len) {
+			expecteq(i, -1);
+			break;
+		}
+	freetoks(par);
+	freetoks(tok);
+
+	benchiters(5);
+	BENCH("1 thread") freetoks(tokenize_parallel(str, 1));
+	BENCH("2 threads") freetoks(tokenize_parallel(str, 2));
+	BENCH("4 threads") freetoks(tokenize_parallel(str, 4));
+	BENCH("8 threads") freetoks(tokenize_parallel(str, 8));
+	benchiters(1000);
+	free(str);
+}
+
+static bool sametoks(RS_Token* a, RS_Token* b) {
+	if(vlen(a) != vlen(b)) return false;
+	for(u32 i = 0; i < vlen(a); i ++)
+		if(a[i].type != b[i].type || a[i].place != b[i].place || a[i].len != b[i].len || a[i].from != b[i].from) return false;
+	return true;
+}
+
+TEST("Retokenize edits to a 50k line source") {
+	char* line = "let abc = 12 * (x >> 3) + \"str\";\n";
+	u32 linelen = strlen(line);
+	char* str = malloc(50000 * linelen + 16);
+	char* end = str;
+	for(u32 i = 0; i < 50000; i ++) end = stpcpy(end, line);
+	u32 mid = 25000 * linelen;
+
+	RS_Token* tok = tokenize(str);
+	RS_Token* ref;
+
+	// Same length: "12" -> "13"
+	str[mid + 11] = '3';
+	tok = retokenize(tok, str, mid + 11, 1, 1);
+	expect(sametoks(tok, ref = tokenize(str)));
+	freetoks(ref);
+
+	// Grow an identifier: "abc" -> "abxc"
+	memmove(str + mid + 7, str + mid + 6, end - str - mid - 5);
+	str[mid + 6] = 'x', end ++;
+	tok = retokenize(tok, str, mid + 6, 0, 1);
+	expect(sametoks(tok, ref = tokenize(str)));
+	freetoks(ref);
+
+	// Delete across the end of a string, joining it with the next line
+	memmove(str + mid + 30, str + mid + 33, end - str - mid - 32);
+	end -= 3;
+	tok = retokenize(tok, str, mid + 30, 3, 0);
+	expect(sametoks(tok, ref = tokenize(str)));
+	freetoks(ref);
+
+	// Unterminated string at the very end
+	*end++ = '"', *end = 0;
+	tok = retokenize(tok, str, end - str - 1, 0, 1);
+	expect(sametoks(tok, ref = tokenize(str)));
+	freetoks(ref);
+
+	benchiters(20);
+	BENCH("Full tokenize") freetoks(tokenize(str));
+	benchiters(1000);
+	BENCH("Retokenize a one character edit") {
+		str[mid + 11] ^= 1;
+		tok = retokenize(tok, str, mid + 11, 1, 1);
+	}
+	freetoks(tok);
+	free(str);
+}
+
+// Same tokens, values included, with the list's split back together
+static bool samelist(RS_TokList* list, RS_Token* b) {
+	toks_seek(list, UINT32_MAX); // Everything before the gap, to go through by index
+	if(vlen(list->tt) != vlen(b) || vlen(list->place) != vlen(b) || vlen(list->val) != vlen(b)) return false;
+	for(u32 i = 0; i < vlen(b); i ++) {
+		RS_Token a = toks_at(list, i);
+		if(a.type != b[i].type || a.place != b[i].place || a.len != b[i].len || a.from != b[i].from || a.nl != b[i].nl)
+			return false;
+		if(a.type == TT_IDENT || a.type == TT_STRING ? strcmp(a.data, b[i].data) : a.type == TT_INT && a.intv != b[i].intv)
+			return false;
+	}
+	return true;
+}
+
+static void fill_list(RS_TokList* list, char* str) {
+	RS_Token* tok = tokenize(str);
+	vfor(tok, t) toks_push(list, *t); // The list takes the text
+	vfree(tok);
+}
+
+TEST("Token lists follow the same edits") {
+	char* line = "let abc = 12 * (x >> 3) + \"str\"\n";
+	u32 linelen = strlen(line);
+	char* str = malloc(1000 * linelen + 16);
+	char* end = str;
+	for(u32 i = 0; i < 1000; i ++) end = stpcpy(end, line);
+	u32 mid = 500 * linelen;
+
+	RS_TokList list;
+	toks_init(&list);
+	fill_list(&list, str);
+	RS_Token* ref = tokenize(str);
+	expect(samelist(&list, ref));
+	freetoks(ref);
+	// Keywords and punctuation take no room for a value
+	u32 vals = vlen(list.vals);
+	expecteq(vals, 5000);
+	expecteq(list.val[0], TOK_NOVAL);
+	expecteq(toks_val(&list, 3).intv, 12);
+
+	// "12" -> "13", the value's slot gets reused
+	str[mid + 11] = '3';
+	RS_TokEdit edit;
+	toks_retokenize(&list, str, mid + 11, 1, 1, &edit);
+	expect(samelist(&list, ref = tokenize(str)));
+	freetoks(ref);
+	expecteq(vlen(list.vals), vals);
+	expect(edit.count < 20);
+
+	// Grow an identifier, then join a string with the next line
+	memmove(str + mid + 7, str + mid + 6, end - str - mid - 5);
+	str[mid + 6] = 'x', end ++;
+	toks_retokenize(&list, str, mid + 6, 0, 1, NULL);
+	expect(samelist(&list, ref = tokenize(str)));
+	freetoks(ref);
+	memmove(str + mid + 29, str + mid + 32, end - str - mid - 31);
+	end -= 3;
+	toks_retokenize(&list, str, mid + 29, 3, 0, NULL);
+	expect(samelist(&list, ref = tokenize(str)));
+	freetoks(ref);
+
+	toks_free(&list);
+	free(str);
+}
+
 #include "tests_end.h"
@@ -0,0 +1,114 @@
+#include "tests.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define VEC_H_STATIC_INLINE
+#include <vec.h>
+#include "arena.h"
+
+TEST("Small vecs stay in their buffer until they outgrow it") {
+	vsmall(uint64_t, 8) buf;
+	uint64_t* v = vsmallinit(buf);
+	for(uint32_t i = 0; i < 8; i ++) vpush(v, i * 7);
+	expect(v == buf.items);
+	expecteq(vlen(v), 8);
+	expecteq(*vlast(v), 7 * 7);
+
+	vpush(v, 8 * 7);
+	expect(v != buf.items);
+	uint32_t wrong = 0;
+	for(uint32_t i = 9; i < 1000; i ++) vpush(v, i * 7);
+	for(uint32_t i = 0; i < 1000; i ++) wrong += v[i] != i * 7;
+	expecteq(wrong, 0);
+	expect(_DATA(v)->alloc == NULL); // Off to the heap, vfree gives it back there
+	vfree(v);
+
+	// Never spilled, so there's nothing to free
+	v = vsmallinit(buf);
+	vpush(v, 1);
+	vfree(v);
+}
+
+TEST("vinit sets up a whole header for vecs made by hand") {
+	char* mem = malloc(sizeof(struct vecdata_) + 8);
+	memset(mem, 0xAB, sizeof(struct vecdata_) + 8); // What a custom vnew() that doesn't zero would leave
+	uint32_t* v = vinit(mem, 8);
+	expect(_DATA(v)->alloc == NULL && vlen(v) == 0 && vcap(v) == 2);
+	for(uint32_t i = 0; i < 100; i ++) vpush(v, i); // Grows through realloc, not through whatever `alloc` held
+	uint32_t wrong = 0;
+	for(uint32_t i = 0; i < 100; i ++) wrong += v[i] != i;
+	expecteq(wrong, 0);
+	vfree(v);
+}
+
+// Laid out like the assembler's x64Ins, whose vecs get the most pushes one at a time
+typedef struct { uint32_t op; struct { uint64_t type; int64_t value; } params[4]; } ins;
+
+TEST("Reserve, then fill") {
+	ins* v = vnew();
+	vreserve(v, 1000);
+	ins* before = v;
+	for(uint32_t i = 0; i < 1000; i ++) vpush_unsafe(v, { .op = i });
+	expect(v == before); // Never had to grow
+	expecteq(vlen(v), 1000);
+	vreserve(v, 10);
+	expect(v == before); // Already has room
+	ins* more = vemplace_n(v, 24);
+	for(uint32_t i = 0; i < 24; i ++) more[i] = (ins) { .op = 1000 + i };
+	expecteq(vlen(v), 1024);
+	uint32_t wrong = 0;
+	for(uint32_t i = 0; i < vlen(v); i ++) wrong += v[i].op != i;
+	expecteq(wrong, 0);
+	vfree(v);
+
+	#define INS 10000000
+	benchiters(5);
+	BENCH("Push 10M x64Ins one at a time") {
+		ins* code = vnew();
+		for(uint32_t i = 0; i < INS; i ++) vpush(code, { .op = i, .params = { { 1, i } } });
+		wrong += vlen(code) != INS;
+		vfree(code);
+	}
+	BENCH("Reserve 10M x64Ins, then push unchecked") {
+		ins* code = vnew();
+		vreserve(code, INS);
+		for(uint32_t i = 0; i < INS; i ++) vpush_unsafe(code, { .op = i, .params = { { 1, i } } });
+		wrong += vlen(code) != INS;
+		vfree(code);
+	}
+	expecteq(wrong, 0);
+}
+
+TEST("Reserving a little at a time grows like pushing does") {
+	uint32_t* v = vnew();
+	uint32_t grew = 0, wrong = 0;
+	for(uint32_t i = 0; i < 1000000; i ++) {
+		vsize_t cap = _DATA(v)->cap;
+		vreserve(v, 1);
+		grew += _DATA(v)->cap != cap;
+		vpush_unsafe(v, i);
+	}
+	for(uint32_t i = 0; i < vlen(v); i ++) wrong += v[i] != i;
+	expecteq(wrong, 0);
+	expect(grew < 100); // Growing by a quarter each time, not once per reserve
+	vfree(v);
+}
+
+TEST("Vecs in an arena grow in place, and sizes the arena can't hold give NULL") {
+	RS_Arena arena = ARENA_INIT;
+	uint32_t* v = vnewin(&arena.alloc);
+	for(uint32_t i = 0; i < 1000; i ++) vpush(v, i);
+	uint32_t wrong = 0;
+	for(uint32_t i = 0; i < vlen(v); i ++) wrong += v[i] != i;
+	expecteq(wrong, 0);
+	expect(arena.cur->prev == NULL); // Grew inside the first block
+
+	// Rounding these up used to wrap around to a few bytes
+	expect(arena_alloc(&arena, SIZE_MAX - 2) == NULL);
+	expect(arena_resize(&arena.alloc, NULL, 0, SIZE_MAX) == NULL);
+	expect(arena_alloc(&arena, 8) != NULL);
+	arena_free(&arena);
+}
+
+#include "tests_end.h"
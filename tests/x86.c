@@ -29,4 +29,22 @@ TEST("\"return 1 + 1;\"") {
 	assertstreq(str, "\tmov rax, 1\n\tadd ax, 1\n\tret");
 }
 
+TEST("Generate the same code from a cached parse") {
+	char* src = "let x = 5; return 1 + 2 * x;";
+	struct RS_ParserState* state = parse("test2.rc", src);
+	assert(state != NULL);
+	RS_MachineResult res = x86_machine(state);
+
+	u64 key = cache_key(src, strlen(src));
+	assert(cache_save("test2.rcache", state, key));
+	RS_ASTCache cache;
+	assert(cache_load(&cache, "test2.rcache", key));
+	RS_MachineResult again = x86_machine_cached(&cache);
+
+	asserteq(again.len, res.len);
+	assert(!memcmp(again.code, res.code, res.len));
+	cache_free(&cache);
+	remove("test2.rcache");
+}
+
 #include "tests_end.h"
\ No newline at end of file